@@ -10,5 +10,6 @@ rc ..\code\resources.rc
 
 del *.pdb > NUL 2> NUL
 cl  %COMPILER_FLAGS% ..\code\hy3d_engine.cpp -Fmhy3d_engine.map -LD -link -incremental:no -opt:ref  -PDB:hy3d_engine_%RANDOM%.pdb -EXPORT:UpdateAndRender
+cl  %COMPILER_FLAGS% ..\code\hy3d_packer.cpp -Fmhy3d_packer.map -link -incremental:no -opt:ref
 cl  %COMPILER_FLAGS% ..\code\win32_platform.cpp hy3d.res -Fmwin32_platform.map -Fehy3d -link %LINKER_FLAGS%
 popd
@@ -0,0 +1,117 @@
+#pragma once
+#include "hy3d_types.h"
+
+// NOTE:
+// HYA is the packed asset format built offline by hy3d_packer over the data folder.
+// Layout on disk:
+//      hya_header
+//      asset data (each block aligned to HYA_DATA_ALIGNMENT)
+//      hya_asset table of contents (sorted by name)
+// The data of every asset is stored exactly the way the engine uses it, so at runtime
+// the file is mapped once and assets are handed out as views into the mapping.
+
+#define HYA_CODE(a, b, c, d) (((u32)(a) << 0) | ((u32)(b) << 8) | ((u32)(c) << 16) | ((u32)(d) << 24))
+#define HYA_MAGIC_VALUE HYA_CODE('h', 'y', 'a', 'p')
+#define HYA_VERSION 5
+#define HYA_NAME_LENGTH 64
+#define HYA_DATA_ALIGNMENT 64
+
+enum hya_asset_type
+{
+    HYA_ASSET_MESH,
+    HYA_ASSET_BITMAP
+};
+
+#pragma pack(push, 1)
+struct hya_header
+{
+    u32 magicValue;
+    u32 version;
+    u32 assetCount;
+    u32 reserved;
+    u64 tocOffset;
+};
+
+// NOTE: Data is an array of nVertices vertex structs (3 per triangle). With
+// hasOcclusion it is followed by the baked ambient occlusion, nVertices f32s.
+struct hya_mesh
+{
+    u32 nVertices;
+    u32 hasNormals;
+    u32 hasOcclusion;
+    f32 boundsMin[3];
+    f32 boundsMax[3];
+};
+
+// NOTE: Data is the whole mip chain, base level first, every level in the
+// canonical texel format (see ImportBitmap) ordered by layout (a texture_layout).
+// isOpaque is set when every texel has alpha 255.
+struct hya_bitmap
+{
+    i32 width;
+    i32 height;
+    i32 mipCount;
+    u32 layout;
+    u32 isOpaque;
+};
+
+struct hya_asset
+{
+    char name[HYA_NAME_LENGTH];
+    u32 type;
+    u32 reserved;
+    u64 dataOffset;
+    u64 dataSize;
+    union
+    {
+        hya_mesh mesh;
+        hya_bitmap bitmap;
+    };
+};
+#pragma pack(pop)
+
+// NOTE:
+// HYT is the decoded texture cache written next to a loose .bmp the first time it
+// is imported (bunny_tex.bmp -> bunny_tex.hyt). The mip chain starts at dataOffset
+// and is mapped straight into a loaded_bitmap. The source size and write time tell
+// us when the cache went stale.
+#define HYT_MAGIC_VALUE HYA_CODE('h', 'y', 't', 'x')
+#define HYT_VERSION 4
+#define HYT_DATA_OFFSET 64
+
+#pragma pack(push, 1)
+struct hyt_header
+{
+    u32 magicValue;
+    u32 version;
+    i32 width;
+    i32 height;
+    u64 sourceSize;
+    u64 sourceWriteTime;
+    u32 dataOffset;
+    i32 mipCount;
+    u32 layout;
+    u32 isOpaque;
+};
+#pragma pack(pop)
+
+// NOTE:
+// HYV is a virtual texture built by hy3d_packer -virtual (terrain.bmp -> terrain.hyv).
+// After the header come the pages of every mip level, level 0 first, pages in row
+// order. A page is pageSize x pageSize texels in the canonical texel format,
+// rows bottom-up; pages on the right and top edges are padded.
+#define HYV_MAGIC_VALUE HYA_CODE('h', 'y', 'v', 't')
+#define HYV_VERSION 2
+#define HYV_DATA_OFFSET 64
+
+#pragma pack(push, 1)
+struct hyv_header
+{
+    u32 magicValue;
+    u32 version;
+    i32 width;
+    i32 height;
+    i32 levelCount;
+    u32 pageSize;
+};
+#pragma pack(pop)
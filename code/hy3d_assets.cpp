@@ -0,0 +1,1737 @@
+#include "hy3d_engine.h"
+#include <intrin.h>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Texture Import
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:
+// Every texture the engine sees is in the canonical layout:
+//      u32 texels 0xAARRGGBB (BB GG RR AA in memory), color premultiplied by alpha
+//      rows bottom-up like the back buffer, pitch == width
+// 24 bit and 32 bit (BI_RGB or byte aligned BI_BITFIELDS) BMPs are supported.
+struct bitmap_import_info
+{
+    i32 width;
+    i32 height;
+    bool isTopDown;
+    u32 bytesPerPixel;
+    u32 sourcePitch;
+    u8 *sourceTexels;
+
+    // NOTE: Byte offset of each channel inside a source pixel, -1 if it isn't there
+    i32 blueByte;
+    i32 greenByte;
+    i32 redByte;
+    i32 alphaByte;
+};
+
+static inline i32 GetChannelByte(u32 mask)
+{
+    unsigned long shift;
+    if (!_BitScanForward(&shift, mask))
+        return -1;
+    if ((shift % 8) != 0 || (mask >> shift) != 0xFF)
+        return -2;
+    return (i32)(shift / 8);
+}
+
+static bool GetBitmapImportInfo(debug_read_file_result file, bitmap_import_info *info)
+{
+    *info = {};
+    if (!file.content || file.size < sizeof(bitmap_header) - 4 * sizeof(u32))
+        return false;
+
+    bitmap_header *header = (bitmap_header *)file.content;
+    if (header->fileType != 0x4D42 || header->planes != 1)
+        return false;
+    if (header->bitsPerPixel != 24 && header->bitsPerPixel != 32)
+        return false;
+
+    info->width = header->width;
+    info->isTopDown = header->height < 0;
+    info->height = info->isTopDown ? -header->height : header->height;
+    info->bytesPerPixel = header->bitsPerPixel / 8;
+    info->sourcePitch = (info->width * info->bytesPerPixel + 3) & ~3u;
+    info->sourceTexels = (u8 *)file.content + header->bitmapOffset;
+    if (header->bitmapOffset + (u64)info->sourcePitch * info->height > file.size)
+        return false;
+
+    // NOTE: Without bitfields the layout is BB GG RR (xx) and there is no alpha.
+    info->blueByte = 0;
+    info->greenByte = 1;
+    info->redByte = 2;
+    info->alphaByte = -1;
+    if (header->bitsPerPixel == 32 && header->compression == 3)
+    {
+        u32 alphaMask = (header->size >= 56)
+                            ? header->alphaMask
+                            : ~(header->redMask | header->greenMask | header->blueMask);
+        info->redByte = GetChannelByte(header->redMask);
+        info->greenByte = GetChannelByte(header->greenMask);
+        info->blueByte = GetChannelByte(header->blueMask);
+        info->alphaByte = GetChannelByte(alphaMask);
+        if (info->redByte < 0 || info->greenByte < 0 || info->blueByte < 0 || info->alphaByte == -2)
+            return false;
+    }
+    else if (header->compression != 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+// NOTE: c * a / 255 rounded, on 16 bit lanes.
+static inline __m128i MultiplyDiv255(__m128i c, __m128i a)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// NOTE: Multiplies the color of 4 texels by their alpha, alpha stays as it is.
+static inline __m128i PremultiplyTexels4(__m128i texels)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i keepAlpha = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+    __m128i lo = _mm_unpacklo_epi8(texels, zero);
+    __m128i hi = _mm_unpackhi_epi8(texels, zero);
+    __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+    __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+    alphaLo = _mm_max_epi16(_mm_andnot_si128(_mm_set1_epi64x(0xFFFF000000000000), alphaLo), keepAlpha);
+    alphaHi = _mm_max_epi16(_mm_andnot_si128(_mm_set1_epi64x(0xFFFF000000000000), alphaHi), keepAlpha);
+    return _mm_packus_epi16(MultiplyDiv255(lo, alphaLo), MultiplyDiv255(hi, alphaHi));
+}
+
+// NOTE: 4 pixels per shuffle. Missing alpha becomes opaque. Returns whether
+// every pixel of the row is opaque.
+static bool ImportBitmapRow32(u8 *source, u32 *dest, i32 width, bitmap_import_info *info)
+{
+    i32 a = info->alphaByte;
+    i32 r = info->redByte;
+    i32 g = info->greenByte;
+    i32 b = info->blueByte;
+    char shuffleBytes[16];
+    for (i32 i = 0; i < 4; i++)
+    {
+        shuffleBytes[i * 4 + 0] = (char)(i * 4 + b);
+        shuffleBytes[i * 4 + 1] = (char)(i * 4 + g);
+        shuffleBytes[i * 4 + 2] = (char)(i * 4 + r);
+        shuffleBytes[i * 4 + 3] = (char)((a < 0) ? -1 : i * 4 + a);
+    }
+    __m128i shuffle = _mm_loadu_si128((__m128i *)shuffleBytes);
+    __m128i opaque = _mm_set1_epi32((a < 0) ? 0xFF000000 : 0);
+
+    __m128i alphaAnd = _mm_set1_epi32(-1);
+    i32 x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i texels = _mm_loadu_si128((__m128i *)(source + x * 4));
+        texels = _mm_or_si128(_mm_shuffle_epi8(texels, shuffle), opaque);
+        alphaAnd = _mm_and_si128(alphaAnd, texels);
+        _mm_storeu_si128((__m128i *)(dest + x), PremultiplyTexels4(texels));
+    }
+    u32 tail[4] = {0xFF000000, 0xFF000000, 0xFF000000, 0xFF000000};
+    for (i32 i = 0; x + i < width; i++)
+    {
+        u8 *at = source + (x + i) * 4;
+        u32 alpha = (a < 0) ? 0xFF : at[a];
+        tail[i] = (alpha << 24) | (at[r] << 16) | (at[g] << 8) | at[b];
+    }
+    __m128i texels = _mm_loadu_si128((__m128i *)tail);
+    alphaAnd = _mm_and_si128(alphaAnd, texels);
+    _mm_storeu_si128((__m128i *)tail, PremultiplyTexels4(texels));
+    for (i32 i = 0; x < width; i++, x++)
+        dest[x] = tail[i];
+
+    __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(alphaAnd, alphaMask), alphaMask)) == 0xFFFF;
+}
+
+static void ImportBitmapRow24(u8 *source, u32 *dest, i32 width)
+{
+    __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i opaque = _mm_set1_epi32(0xFF000000);
+
+    // NOTE: Each load reads 16 bytes but only uses 12, stay clear of the end of the row.
+    i32 x = 0;
+    for (; x + 6 <= width; x += 4)
+    {
+        __m128i texels = _mm_loadu_si128((__m128i *)(source + x * 3));
+        texels = _mm_or_si128(_mm_shuffle_epi8(texels, shuffle), opaque);
+        _mm_storeu_si128((__m128i *)(dest + x), texels);
+    }
+    for (; x < width; x++)
+    {
+        u8 *at = source + x * 3;
+        dest[x] = 0xFF000000 | (at[2] << 16) | (at[1] << 8) | at[0];
+    }
+}
+
+// NOTE: dest must hold width * height texels. Returns whether the bitmap is opaque.
+static bool ImportBitmap(bitmap_import_info *info, u32 *dest)
+{
+    bool isOpaque = true;
+    for (i32 y = 0; y < info->height; y++)
+    {
+        i32 sourceRow = info->isTopDown ? (info->height - 1 - y) : y;
+        u8 *source = info->sourceTexels + (u64)sourceRow * info->sourcePitch;
+        u32 *destRow = dest + (u64)y * info->width;
+        if (info->bytesPerPixel == 4)
+            isOpaque &= ImportBitmapRow32(source, destRow, info->width, info);
+        else
+            ImportBitmapRow24(source, destRow, info->width);
+    }
+    return isOpaque;
+}
+
+// NOTE:
+// Mip levels are generated once at import time with a 2x2 box filter and stored
+// right after the base level, so the packer, the texture cache and the loose
+// import all share one layout. A level is half of the previous one (rounded
+// down, at least 1) and the chain ends at 1x1. Tiled and Morton levels are
+// padded up to whole tiles / powers of two; padding texels are never read.
+static inline u32 CeilLog2(i32 n)
+{
+    u32 shift = 0;
+    while ((1 << shift) < n)
+        shift++;
+    return shift;
+}
+
+// NOTE: Returns the number of texels the level takes in memory.
+static u64 InitializeMipLevel(bitmap_mip *mip, i32 width, i32 height, texture_layout layout)
+{
+    *mip = {};
+    mip->width = width;
+    mip->height = height;
+    mip->layout = layout;
+    switch (layout)
+    {
+    case TEXTURE_LAYOUT_TILED_4X4:
+    case TEXTURE_LAYOUT_TILED_8X8:
+    {
+        mip->blockShift = (layout == TEXTURE_LAYOUT_TILED_4X4) ? 2 : 3;
+        u32 side = 1u << mip->blockShift;
+        mip->blocksPerRow = (width + side - 1) >> mip->blockShift;
+        u32 blocksPerColumn = (height + side - 1) >> mip->blockShift;
+        return ((u64)mip->blocksPerRow * blocksPerColumn) << (2 * mip->blockShift);
+    }
+    case TEXTURE_LAYOUT_MORTON:
+    {
+        u32 xShift = CeilLog2(width);
+        u32 yShift = CeilLog2(height);
+        mip->blockShift = (xShift < yShift) ? xShift : yShift;
+        return (u64)1 << (xShift + yShift);
+    }
+    case TEXTURE_LAYOUT_BC1:
+    {
+        // NOTE: Counted in u32s, a block is two of them.
+        mip->blockShift = 2;
+        mip->blocksPerRow = (width + 3) >> 2;
+        u32 blocksPerColumn = (height + 3) >> 2;
+        return (u64)mip->blocksPerRow * blocksPerColumn * 2;
+    }
+    default:
+        return (u64)width * height;
+    }
+}
+
+static u64 GetMipChainTexelCount(i32 width, i32 height, texture_layout layout, i32 *mipCount)
+{
+    u64 count = 0;
+    i32 levels = 0;
+    bitmap_mip mip;
+    while (levels < MAX_MIP_LEVELS)
+    {
+        count += InitializeMipLevel(&mip, width, height, layout);
+        levels++;
+        if (width == 1 && height == 1)
+            break;
+        width = maxInt(width / 2, 1);
+        height = maxInt(height / 2, 1);
+    }
+    *mipCount = levels;
+    return count;
+}
+
+static void SetMipChain(loaded_bitmap *bmp, u32 *texels, i32 width, i32 height, i32 mipCount, texture_layout layout)
+{
+    bmp->width = width;
+    bmp->height = height;
+    bmp->pixels = texels;
+    bmp->mipCount = mipCount;
+    for (i32 i = 0; i < mipCount; i++)
+    {
+        u64 texelCount = InitializeMipLevel(&bmp->mips[i], width, height, layout);
+        bmp->mips[i].pixels = texels;
+        texels += texelCount;
+        width = maxInt(width / 2, 1);
+        height = maxInt(height / 2, 1);
+    }
+}
+
+// NOTE: 4 destination texels per iteration: two rows of 8 source texels are
+// widened to 16 bits, summed vertically, then neighbours are summed horizontally.
+// An odd last row or column is folded into the texel before it.
+static void DownsampleMip(bitmap_mip *source, bitmap_mip *dest)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi16(2);
+    for (i32 y = 0; y < dest->height; y++)
+    {
+        u32 *row0 = source->pixels + (u64)minInt(2 * y, source->height - 1) * source->width;
+        u32 *row1 = source->pixels + (u64)minInt(2 * y + 1, source->height - 1) * source->width;
+        u32 *destRow = dest->pixels + (u64)y * dest->width;
+
+        i32 x = 0;
+        for (; 2 * x + 8 <= source->width && x + 4 <= dest->width; x += 4)
+        {
+            __m128i a = _mm_loadu_si128((__m128i *)(row0 + 2 * x));
+            __m128i b = _mm_loadu_si128((__m128i *)(row0 + 2 * x + 4));
+            __m128i c = _mm_loadu_si128((__m128i *)(row1 + 2 * x));
+            __m128i d = _mm_loadu_si128((__m128i *)(row1 + 2 * x + 4));
+
+            __m128i aLo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(c, zero));
+            __m128i aHi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(c, zero));
+            __m128i bLo = _mm_add_epi16(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(d, zero));
+            __m128i bHi = _mm_add_epi16(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(d, zero));
+
+            __m128i sum01 = _mm_add_epi16(_mm_unpacklo_epi64(aLo, aHi), _mm_unpackhi_epi64(aLo, aHi));
+            __m128i sum23 = _mm_add_epi16(_mm_unpacklo_epi64(bLo, bHi), _mm_unpackhi_epi64(bLo, bHi));
+            sum01 = _mm_srli_epi16(_mm_add_epi16(sum01, round), 2);
+            sum23 = _mm_srli_epi16(_mm_add_epi16(sum23, round), 2);
+            _mm_storeu_si128((__m128i *)(destRow + x), _mm_packus_epi16(sum01, sum23));
+        }
+        for (; x < dest->width; x++)
+        {
+            i32 x0 = minInt(2 * x, source->width - 1);
+            i32 x1 = minInt(2 * x + 1, source->width - 1);
+            u32 t[4] = {row0[x0], row0[x1], row1[x0], row1[x1]};
+            u32 result = 0;
+            for (i32 shift = 0; shift < 32; shift += 8)
+            {
+                u32 sum = 2;
+                for (i32 i = 0; i < 4; i++)
+                    sum += (t[i] >> shift) & 0xFF;
+                result |= (sum >> 2) << shift;
+            }
+            destRow[x] = result;
+        }
+    }
+}
+
+// NOTE: Linear levels only.
+static void GenerateMipChain(loaded_bitmap *bmp)
+{
+    for (i32 i = 1; i < bmp->mipCount; i++)
+    {
+        ASSERT(bmp->mips[i].layout == TEXTURE_LAYOUT_LINEAR);
+        DownsampleMip(&bmp->mips[i - 1], &bmp->mips[i]);
+    }
+}
+
+static void SwizzleMip(bitmap_mip *source, bitmap_mip *dest)
+{
+    for (i32 y = 0; y < source->height; y++)
+    {
+        u32 *row = source->pixels + (u64)y * source->width;
+        for (i32 x = 0; x < source->width; x++)
+            dest->pixels[dest->GetTexelIndex(x, y)] = row[x];
+    }
+}
+
+static inline u32 To565(u32 c)
+{
+    u32 r = (c >> 16) & 0xFF;
+    u32 g = (c >> 8) & 0xFF;
+    u32 b = (c >> 0) & 0xFF;
+    return (((r * 31 + 127) / 255) << 11) | (((g * 63 + 127) / 255) << 5) | ((b * 31 + 127) / 255);
+}
+
+static inline i32 ColorDistanceSq(u32 a, u32 b)
+{
+    i32 result = 0;
+    for (u32 shift = 0; shift < 24; shift += 8)
+    {
+        i32 d = (i32)((a >> shift) & 0xFF) - (i32)((b >> shift) & 0xFF);
+        result += d * d;
+    }
+    return result;
+}
+
+// NOTE:
+// Endpoints are the two texels furthest apart along the diagonal of the block's
+// color bounding box, which is close enough to the principal axis for texture
+// data. Blocks with a texel under half alpha use the 3 color mode so it can be
+// transparent.
+static void CompressBlockBC1(u32 *texels, u32 *block)
+{
+    bool hasTransparent = false;
+    i32 minC[3] = {255, 255, 255};
+    i32 maxC[3] = {0, 0, 0};
+    for (i32 i = 0; i < 16; i++)
+    {
+        if ((texels[i] >> 24) < 128)
+        {
+            hasTransparent = true;
+            continue;
+        }
+        for (i32 c = 0; c < 3; c++)
+        {
+            i32 v = (texels[i] >> (8 * c)) & 0xFF;
+            minC[c] = minInt(minC[c], v);
+            maxC[c] = maxInt(maxC[c], v);
+        }
+    }
+    if (minC[0] > maxC[0])
+    {
+        block[0] = 0;
+        block[1] = 0xFFFFFFFF;
+        return;
+    }
+
+    i32 minProjection = INT32_MAX;
+    i32 maxProjection = INT32_MIN;
+    u32 low = 0;
+    u32 high = 0;
+    for (i32 i = 0; i < 16; i++)
+    {
+        if ((texels[i] >> 24) < 128)
+            continue;
+        i32 projection = 0;
+        for (i32 c = 0; c < 3; c++)
+            projection += (((texels[i] >> (8 * c)) & 0xFF) - minC[c]) * (maxC[c] - minC[c]);
+        if (projection < minProjection)
+        {
+            minProjection = projection;
+            low = texels[i];
+        }
+        if (projection > maxProjection)
+        {
+            maxProjection = projection;
+            high = texels[i];
+        }
+    }
+
+    u32 c0 = To565(high);
+    u32 c1 = To565(low);
+    if (hasTransparent ? (c0 > c1) : (c0 < c1))
+    {
+        u32 temp = c0;
+        c0 = c1;
+        c1 = temp;
+    }
+
+    u32 palette[4];
+    block[0] = c0 | (c1 << 16);
+    DecodeBC1Palette(block[0], palette);
+    i32 colorCount = (c0 > c1) ? 4 : 3;
+    u32 indices = 0;
+    for (i32 i = 0; i < 16; i++)
+    {
+        u32 index = 3;
+        if ((texels[i] >> 24) >= 128)
+        {
+            index = 0;
+            i32 best = ColorDistanceSq(texels[i], palette[0]);
+            for (i32 p = 1; p < colorCount; p++)
+            {
+                i32 distance = ColorDistanceSq(texels[i], palette[p]);
+                if (distance < best)
+                {
+                    best = distance;
+                    index = p;
+                }
+            }
+        }
+        indices |= index << (2 * i);
+    }
+    block[1] = indices;
+}
+
+// NOTE: Edge blocks repeat the last row / column.
+static void CompressMipBC1(bitmap_mip *source, bitmap_mip *dest)
+{
+    u32 texels[16];
+    for (i32 blockY = 0; blockY < source->height; blockY += 4)
+    {
+        for (i32 blockX = 0; blockX < source->width; blockX += 4)
+        {
+            for (i32 y = 0; y < 4; y++)
+            {
+                u32 *row = source->pixels + (u64)minInt(blockY + y, source->height - 1) * source->width;
+                for (i32 x = 0; x < 4; x++)
+                    texels[y * 4 + x] = row[minInt(blockX + x, source->width - 1)];
+            }
+            CompressBlockBC1(texels, dest->GetBlock(blockX, blockY));
+        }
+    }
+}
+
+// NOTE: bmp must already be set up with SetMipChain. linear holds the imported
+// base level with room for a whole linear chain; it can be bmp->pixels when bmp
+// is linear itself. Otherwise the chain is built there and swizzled or
+// compressed into bmp.
+static void BuildMipChain(loaded_bitmap *bmp, u32 *linear)
+{
+    loaded_bitmap source = {};
+    SetMipChain(&source, linear, bmp->width, bmp->height, bmp->mipCount, TEXTURE_LAYOUT_LINEAR);
+    GenerateMipChain(&source);
+    if (bmp->mips[0].layout != TEXTURE_LAYOUT_LINEAR)
+    {
+        for (i32 i = 0; i < bmp->mipCount; i++)
+        {
+            if (bmp->mips[i].layout == TEXTURE_LAYOUT_BC1)
+                CompressMipBC1(&source.mips[i], &bmp->mips[i]);
+            else
+                SwizzleMip(&source.mips[i], &bmp->mips[i]);
+        }
+    }
+}
+
+static inline void SplitData(const std::string &in, std::vector<std::string> &out, std::string token)
+{
+    out.clear();
+    std::string temp;
+    for (int i = 0; i < int(in.size()); i++)
+    {
+        std::string test = in.substr(i, token.size());
+        if (test == token)
+        {
+            if (!temp.empty())
+            {
+                out.push_back(temp);
+                temp.clear();
+                i += (int)token.size() - 1;
+            }
+            else
+            {
+                out.push_back("");
+            }
+        }
+        else if (i + token.size() >= in.size())
+        {
+            temp += in.substr(i, token.size());
+            out.push_back(temp);
+            break;
+        }
+        else
+        {
+            temp += in[i];
+        }
+    }
+}
+
+// NOTE: Counts the vertices of the expanded triangle list and rewinds the file.
+static u32 CountOBJVertices(std::ifstream &file, bool *hasNormals)
+{
+    std::string tag;
+    std::string line;
+
+    u32 nVertices = 0;
+    *hasNormals = false;
+
+    while (std::getline(file, line))
+    {
+        if (!line.empty())
+        {
+            size_t tagStart = line.find_first_not_of(" \t");
+            size_t tagEnd = line.find_first_of(" \t", tagStart);
+            if (tagStart != std::string::npos && tagEnd != std::string::npos)
+                tag = line.substr(tagStart, tagEnd - tagStart);
+            else if (tagStart != std::string::npos)
+                tag = line.substr(tagStart);
+        }
+
+        if (tag == "f")
+            nVertices += 3;
+        if (tag == "vn")
+            *hasNormals = true;
+    }
+    file.clear();
+    file.seekg(0);
+    return nVertices;
+}
+
+static bool LoadOBJ(std::string filename, memory_arena *arena, object *object, loaded_bitmap *texture, vec3 position, vec3 material)
+{
+    if (filename.substr(filename.size() - 4, 4) != ".obj")
+        return false;
+
+    std::ifstream file(filename);
+
+    if (!file.is_open())
+        return false;
+
+    object->texture = texture;
+
+    std::string tag;
+    std::string data;
+    std::string line;
+
+    u32 nVertices = CountOBJVertices(file, &object->hasNormals);
+    object->vertices = ReserveArrayMemory(arena, nVertices, vertex);
+    object->nVertices = nVertices;
+    object->occlusion = 0; // NOTE: Only the packer bakes it
+
+    std::vector<vec3> positions;
+    std::vector<vec2> texCoords;
+    std::vector<vec3> normals;
+    positions.reserve(nVertices / 3);
+    texCoords.reserve(nVertices / 3);
+    normals.reserve(nVertices / 3);
+
+    i32 i = 0;
+    while (std::getline(file, line))
+    {
+        if (!line.empty())
+        {
+            size_t tagStart = line.find_first_not_of(" \t");
+            size_t tagEnd = line.find_first_of(" \t", tagStart);
+            if (tagStart != std::string::npos && tagEnd != std::string::npos)
+                tag = line.substr(tagStart, tagEnd - tagStart);
+            else if (tagStart != std::string::npos)
+                tag = line.substr(tagStart);
+
+            size_t dataStart = line.find_first_not_of(" \t", tagEnd);
+            size_t dataEnd = line.find_last_not_of(" \t");
+            if (dataStart != std::string::npos && dataEnd != std::string::npos)
+                data = line.substr(dataStart, dataEnd - dataStart + 1);
+            else if (dataStart != std::string::npos)
+                data = line.substr(dataStart);
+        }
+
+        if (tag == "v")
+        {
+            std::vector<std::string> dataSplit;
+            SplitData(data, dataSplit, " ");
+
+            vec3 v;
+            v.x = std::stof(dataSplit[0]);
+            v.y = std::stof(dataSplit[1]);
+            v.z = std::stof(dataSplit[2]);
+            positions.push_back(v);
+        }
+        else if (tag == "vt")
+        {
+            std::vector<std::string> dataSplit;
+            SplitData(data, dataSplit, " ");
+
+            vec2 v;
+            v.x = std::stof(dataSplit[0]);
+            v.y = std::stof(dataSplit[1]);
+            texCoords.push_back(v);
+        }
+        else if (tag == "vn")
+        {
+            std::vector<std::string> dataSplit;
+            SplitData(data, dataSplit, " ");
+
+            vec3 v;
+            v.x = std::stof(dataSplit[0]);
+            v.y = std::stof(dataSplit[1]);
+            v.z = std::stof(dataSplit[2]);
+            normals.push_back(v);
+        }
+        else if (tag == "f")
+        {
+            std::vector<std::string> dataSplit; // p/t/n
+            SplitData(data, dataSplit, " ");
+
+            // Contains 3 indices to the vertices that make a triangle
+            // Cases:
+            // P
+            // P/TC
+            // P/TC/N
+            // P//N
+            std::vector<std::string> faceVert;
+
+            for (std::string faceVertString : dataSplit)
+            {
+                SplitData(faceVertString, faceVert, "/");
+
+                vertex v = {};
+
+                // We always have the position index
+                i32 index = std::stoi(faceVert[0]) - 1;
+                v.pos = positions[index];
+
+                // Position/Texture Coordinates
+                if (faceVert.size() == 2)
+                {
+                    index = std::stoi(faceVert[1]) - 1;
+                    v.texCoord = texCoords[index];
+                }
+                else if (faceVert.size() == 3)
+                {
+                    // Position/Texture Coordinate/Normal
+                    if (faceVert[1] != "")
+                    {
+                        index = std::stoi(faceVert[1]) - 1;
+                        v.texCoord = texCoords[index];
+
+                        index = std::stoi(faceVert[2]) - 1;
+                        v.normal = normals[index];
+                    }
+                    // Position//Normal
+                    else
+                    {
+                        index = std::stoi(faceVert[2]) - 1;
+                        v.normal = normals[index];
+                    }
+                }
+                object->vertices[i] = v;
+                i++;
+            }
+        }
+    }
+    file.close();
+    object->pos = position;
+    object->mat = material;
+    return true;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Ambient Occlusion
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline vec3 GetTriangleCentroid(vertex *vertices, i32 triangle)
+{
+    vertex *v = vertices + 3 * triangle;
+    return (v[0].pos + v[1].pos + v[2].pos) * (1.0f / 3.0f);
+}
+
+static inline void GrowBounds(vec3 *boundsMin, vec3 *boundsMax, vec3 p)
+{
+    *boundsMin = {minF32(boundsMin->x, p.x), minF32(boundsMin->y, p.y), minF32(boundsMin->z, p.z)};
+    *boundsMax = {maxF32(boundsMax->x, p.x), maxF32(boundsMax->y, p.y), maxF32(boundsMax->z, p.z)};
+}
+
+// NOTE: Splits the triangles at the median centroid along the longest axis of
+// the centroids' bounds until a node holds OCCLUSION_BVH_LEAF_SIZE or less.
+static void BuildOcclusionBVH(occlusion_bake *bake, i32 nodeIndex, i32 first, i32 count)
+{
+    occlusion_bvh_node *node = bake->nodes + nodeIndex;
+    vec3 boundsMin = bake->vertices[3 * bake->triangles[first]].pos;
+    vec3 boundsMax = boundsMin;
+    vec3 centroidMin = GetTriangleCentroid(bake->vertices, bake->triangles[first]);
+    vec3 centroidMax = centroidMin;
+    for (i32 i = first; i < first + count; i++)
+    {
+        vertex *v = bake->vertices + 3 * bake->triangles[i];
+        GrowBounds(&boundsMin, &boundsMax, v[0].pos);
+        GrowBounds(&boundsMin, &boundsMax, v[1].pos);
+        GrowBounds(&boundsMin, &boundsMax, v[2].pos);
+        GrowBounds(&centroidMin, &centroidMax, GetTriangleCentroid(bake->vertices, bake->triangles[i]));
+    }
+    node->boundsMin = boundsMin;
+    node->boundsMax = boundsMax;
+
+    vec3 extent = centroidMax - centroidMin;
+    i32 axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+    if (count <= OCCLUSION_BVH_LEAF_SIZE || extent.pos[axis] == 0.0f)
+    {
+        node->first = first;
+        node->count = count;
+        return;
+    }
+
+    vertex *vertices = bake->vertices;
+    i32 *triangles = bake->triangles + first;
+    i32 half = count / 2;
+    std::nth_element(triangles, triangles + half, triangles + count, [vertices, axis](i32 a, i32 b) {
+        return GetTriangleCentroid(vertices, a).pos[axis] < GetTriangleCentroid(vertices, b).pos[axis];
+    });
+
+    i32 left = bake->nodeCount;
+    bake->nodeCount += 2;
+    node->first = left;
+    node->count = 0;
+    BuildOcclusionBVH(bake, left, first, half);
+    BuildOcclusionBVH(bake, left + 1, first + half, count - half);
+}
+
+// NOTE:
+// Vertices that share a position and a normal get one factor, so the bake
+// costs the number of distinct vertices instead of 3 per triangle. Meshes
+// without normals use the face normals, like flat shading does.
+static void BeginOcclusionBake(occlusion_bake *bake, memory_arena *arena, vertex *vertices, i32 nVertices, bool hasNormals)
+{
+    *bake = {};
+    bake->vertices = vertices;
+    bake->nVertices = nVertices;
+    i32 nTriangles = nVertices / 3;
+    bake->normals = ReserveArrayMemory(arena, nVertices, vec3);
+    for (i32 i = 0; i < nTriangles * 3; i += 3)
+    {
+        vec3 faceNormal = CrossProduct(vertices[i + 1].pos - vertices[i].pos,
+                                       vertices[i + 2].pos - vertices[i].pos).normalized();
+        for (i32 j = i; j < i + 3; j++)
+            bake->normals[j] = hasNormals ? vertices[j].normal.normalized() : faceNormal;
+    }
+
+    i32 *order = ReserveArrayMemory(arena, nVertices, i32);
+    for (i32 i = 0; i < nVertices; i++)
+        order[i] = i;
+    vec3 *normals = bake->normals;
+    auto isLess = [vertices, normals](i32 a, i32 b) {
+        for (i32 i = 0; i < 3; i++)
+        {
+            if (vertices[a].pos.pos[i] != vertices[b].pos.pos[i])
+                return vertices[a].pos.pos[i] < vertices[b].pos.pos[i];
+        }
+        for (i32 i = 0; i < 3; i++)
+        {
+            if (normals[a].pos[i] != normals[b].pos[i])
+                return normals[a].pos[i] < normals[b].pos[i];
+        }
+        return false;
+    };
+    std::sort(order, order + nVertices, isLess);
+
+    bake->distinctVertices = ReserveArrayMemory(arena, nVertices, i32);
+    bake->vertexToDistinct = ReserveArrayMemory(arena, nVertices, i32);
+    for (i32 i = 0; i < nVertices; i++)
+    {
+        if (i == 0 || isLess(order[i - 1], order[i]))
+            bake->distinctVertices[bake->distinctCount++] = order[i];
+        bake->vertexToDistinct[order[i]] = bake->distinctCount - 1;
+    }
+    bake->distinctOcclusion = ReserveArrayMemory(arena, bake->distinctCount, f32);
+
+    // NOTE: A median split tree has less than 2 * nTriangles / LEAF_SIZE nodes, 2 * nTriangles is always enough.
+    bake->triangles = ReserveArrayMemory(arena, maxInt(nTriangles, 1), i32);
+    bake->nodes = ReserveArrayMemory(arena, maxInt(2 * nTriangles, 1), occlusion_bvh_node);
+    for (i32 i = 0; i < nTriangles; i++)
+        bake->triangles[i] = i;
+    bake->nodeCount = 1;
+    if (nTriangles > 0)
+    {
+        BuildOcclusionBVH(bake, 0, 0, nTriangles);
+        vec3 diagonal = bake->nodes[0].boundsMax - bake->nodes[0].boundsMin;
+        bake->maxDistance = OCCLUSION_DISTANCE_SCALE * diagonal.length();
+        bake->offset = 0.001f * diagonal.length();
+    }
+}
+
+static inline bool RayHitsBounds(vec3 origin, vec3 invDirection, f32 maxT, vec3 boundsMin, vec3 boundsMax)
+{
+    f32 tMin = 0.0f;
+    f32 tMax = maxT;
+    for (i32 i = 0; i < 3; i++)
+    {
+        f32 t0 = (boundsMin.pos[i] - origin.pos[i]) * invDirection.pos[i];
+        f32 t1 = (boundsMax.pos[i] - origin.pos[i]) * invDirection.pos[i];
+        tMin = maxF32(tMin, minF32(t0, t1));
+        tMax = minF32(tMax, maxF32(t0, t1));
+    }
+    return tMin <= tMax;
+}
+
+// NOTE: Moller-Trumbore, both sides of the triangle count.
+static inline bool RayHitsTriangle(vec3 origin, vec3 direction, f32 maxT, vertex *v)
+{
+    vec3 edge1 = v[1].pos - v[0].pos;
+    vec3 edge2 = v[2].pos - v[0].pos;
+    vec3 p = CrossProduct(direction, edge2);
+    f32 det = edge1 * p;
+    if (det > -1e-12f && det < 1e-12f)
+        return false;
+    f32 invDet = 1.0f / det;
+    vec3 s = origin - v[0].pos;
+    f32 u = (s * p) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    vec3 q = CrossProduct(s, edge1);
+    f32 w = (direction * q) * invDet;
+    if (w < 0.0f || u + w > 1.0f)
+        return false;
+    f32 t = (edge2 * q) * invDet;
+    return t > 0.0f && t < maxT;
+}
+
+// NOTE: Any hit is enough, so the traversal stops at the first one.
+static bool IsRayOccluded(occlusion_bake *bake, vec3 origin, vec3 direction, f32 maxT)
+{
+    vec3 invDirection = {1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+    i32 stack[OCCLUSION_BVH_MAX_DEPTH];
+    i32 stackCount = 0;
+    stack[stackCount++] = 0;
+    while (stackCount > 0)
+    {
+        occlusion_bvh_node *node = bake->nodes + stack[--stackCount];
+        if (!RayHitsBounds(origin, invDirection, maxT, node->boundsMin, node->boundsMax))
+            continue;
+
+        if (node->count)
+        {
+            for (i32 i = node->first; i < node->first + node->count; i++)
+            {
+                if (RayHitsTriangle(origin, direction, maxT, bake->vertices + 3 * bake->triangles[i]))
+                    return true;
+            }
+        }
+        else
+        {
+            ASSERT(stackCount + 2 <= OCCLUSION_BVH_MAX_DEPTH);
+            stack[stackCount++] = node->first;
+            stack[stackCount++] = node->first + 1;
+        }
+    }
+    return false;
+}
+
+// NOTE:
+// Bakes distinct vertices first to end. Every vertex seeds its own jitter, so
+// the result doesn't depend on how the vertices are split between threads.
+static void BakeOcclusionRange(occlusion_bake *bake, i32 first, i32 end)
+{
+    f32 cellSize = 1.0f / (f32)OCCLUSION_RAY_GRID;
+    for (i32 d = first; d < end; d++)
+    {
+        i32 index = bake->distinctVertices[d];
+        vec3 normal = bake->normals[index];
+        if (normal.lengthSq() == 0.0f)
+        {
+            bake->distinctOcclusion[d] = 1.0f;
+            continue;
+        }
+
+        vec3 tangent = (fabsf(normal.x) > 0.5f) ? vec3{0.0f, 1.0f, 0.0f} : vec3{1.0f, 0.0f, 0.0f};
+        tangent = CrossProduct(tangent, normal).normalized();
+        vec3 bitangent = CrossProduct(normal, tangent);
+        vec3 origin = bake->vertices[index].pos + bake->offset * normal;
+
+        u32 random = (u32)d * 0x9E3779B9u + 1;
+        i32 openCount = 0;
+        for (i32 cellY = 0; cellY < OCCLUSION_RAY_GRID; cellY++)
+        {
+            for (i32 cellX = 0; cellX < OCCLUSION_RAY_GRID; cellX++)
+            {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                f32 u = ((f32)cellX + (f32)(random & 0xFFFF) * (1.0f / 65536.0f)) * cellSize;
+                f32 v = ((f32)cellY + (f32)(random >> 16) * (1.0f / 65536.0f)) * cellSize;
+
+                // NOTE: Cosine weighted, so every ray counts the same.
+                f32 r = sqrtf(u);
+                f32 phi = 6.2831853f * v;
+                f32 z = sqrtf(maxF32(1.0f - u, 0.0f));
+                vec3 direction = (r * cosf(phi)) * tangent + (r * sinf(phi)) * bitangent + z * normal;
+                if (!IsRayOccluded(bake, origin, direction, bake->maxDistance))
+                    openCount++;
+            }
+        }
+        bake->distinctOcclusion[d] = (f32)openCount / (f32)(OCCLUSION_RAY_GRID * OCCLUSION_RAY_GRID);
+    }
+}
+
+// NOTE: After every distinct vertex is baked. occlusion has nVertices entries.
+static void EndOcclusionBake(occlusion_bake *bake, f32 *occlusion)
+{
+    for (i32 i = 0; i < bake->nVertices; i++)
+        occlusion[i] = bake->distinctOcclusion[bake->vertexToDistinct[i]];
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Asset Pack
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static bool OpenAssetPack(asset_pack *pack, engine_memory *memory, char *filename)
+{
+    *pack = {};
+    if (!memory->PlatformMapFile)
+        return false;
+
+    platform_mapped_file file = memory->PlatformMapFile(filename);
+    if (!file.memory)
+        return false;
+
+    hya_header *header = (hya_header *)file.memory;
+    bool isValid =
+        file.size >= sizeof(hya_header) &&
+        header->magicValue == HYA_MAGIC_VALUE &&
+        header->version == HYA_VERSION &&
+        header->tocOffset + header->assetCount * sizeof(hya_asset) <= file.size;
+    if (!isValid)
+    {
+        memory->PlatformUnmapFile(&file);
+        return false;
+    }
+
+    pack->file = file;
+    pack->header = header;
+    pack->assets = (hya_asset *)((u8 *)file.memory + header->tocOffset);
+    pack->assetCount = header->assetCount;
+    return true;
+}
+
+static void CloseAssetPack(asset_pack *pack, engine_memory *memory)
+{
+    if (pack->file.memory)
+        memory->PlatformUnmapFile(&pack->file);
+    *pack = {};
+}
+
+// NOTE: The table of contents is sorted by name by the packer.
+static hya_asset *FindAsset(asset_pack *pack, char *name, hya_asset_type type)
+{
+    i32 first = 0;
+    i32 last = (i32)pack->assetCount - 1;
+    while (first <= last)
+    {
+        i32 middle = first + (last - first) / 2;
+        hya_asset *asset = pack->assets + middle;
+        i32 compare = strncmp(name, asset->name, HYA_NAME_LENGTH);
+        if (compare == 0)
+            return (asset->type == (u32)type) ? asset : 0;
+        if (compare < 0)
+            last = middle - 1;
+        else
+            first = middle + 1;
+    }
+    return 0;
+}
+
+static inline void *GetAssetData(asset_pack *pack, hya_asset *asset)
+{
+    return (u8 *)pack->file.memory + asset->dataOffset;
+}
+
+static bool LoadBitmapFromPack(asset_pack *pack, loaded_bitmap *bmp, char *name)
+{
+    hya_asset *asset = FindAsset(pack, name, HYA_ASSET_BITMAP);
+    if (!asset)
+        return false;
+
+    bmp->opacity = 1.0f;
+    bmp->isOpaque = asset->bitmap.isOpaque != 0;
+    SetMipChain(bmp, (u32 *)GetAssetData(pack, asset), asset->bitmap.width, asset->bitmap.height,
+                asset->bitmap.mipCount, (texture_layout)asset->bitmap.layout);
+    return true;
+}
+
+static bool LoadOBJFromPack(asset_pack *pack, object *object, char *name, loaded_bitmap *texture, vec3 position, vec3 material)
+{
+    hya_asset *asset = FindAsset(pack, name, HYA_ASSET_MESH);
+    if (!asset)
+        return false;
+
+    object->vertices = (vertex *)GetAssetData(pack, asset);
+    object->nVertices = (i32)asset->mesh.nVertices;
+    object->hasNormals = asset->mesh.hasNormals != 0;
+    object->occlusion = asset->mesh.hasOcclusion ? (f32 *)(object->vertices + object->nVertices) : 0;
+    object->texture = texture;
+    object->pos = position;
+    object->mat = material;
+    return true;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Asset Heap
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE: A first-fit free list over one region. Blocks stay in address order so
+// freed neighbours can be merged back together.
+static asset_memory_block *InsertBlock(asset_memory_block *prev, u64 size, void *memory)
+{
+    ASSERT(size > sizeof(asset_memory_block))
+    asset_memory_block *block = (asset_memory_block *)memory;
+    block->flags = 0;
+    block->size = size - sizeof(asset_memory_block);
+    block->prev = prev;
+    block->next = prev->next;
+    block->prev->next = block;
+    block->next->prev = block;
+    return block;
+}
+
+static bool MergeIfPossible(asset_cache *cache, asset_memory_block *first, asset_memory_block *second)
+{
+    if (first == &cache->blockSentinel || second == &cache->blockSentinel)
+        return false;
+    if ((first->flags & ASSET_BLOCK_USED) || (second->flags & ASSET_BLOCK_USED))
+        return false;
+
+    u8 *expectedSecond = (u8 *)first + sizeof(asset_memory_block) + first->size;
+    if ((u8 *)second != expectedSecond)
+        return false;
+
+    second->next->prev = second->prev;
+    second->prev->next = second->next;
+    first->size += sizeof(asset_memory_block) + second->size;
+    return true;
+}
+
+static void *AllocateAssetMemory(asset_cache *cache, u64 size, asset_memory_block **blockOut)
+{
+    void *result = 0;
+    size = (size + 63) & ~63ULL;
+
+    BeginTicketMutex(&cache->heapMutex);
+    for (asset_memory_block *block = cache->blockSentinel.next;
+         block != &cache->blockSentinel;
+         block = block->next)
+    {
+        if (!(block->flags & ASSET_BLOCK_USED) && block->size >= size)
+        {
+            block->flags |= ASSET_BLOCK_USED;
+            result = (u8 *)(block + 1);
+
+            // NOTE: Split off the rest if it is worth keeping around.
+            u64 remaining = block->size - size;
+            if (remaining > KILOBYTES(4))
+            {
+                block->size = size;
+                InsertBlock(block, remaining, (u8 *)result + size);
+            }
+            *blockOut = block;
+            break;
+        }
+    }
+    EndTicketMutex(&cache->heapMutex);
+
+    return result;
+}
+
+static void FreeAssetMemory(asset_cache *cache, asset_memory_block *block)
+{
+    BeginTicketMutex(&cache->heapMutex);
+    block->flags &= ~ASSET_BLOCK_USED;
+    if (MergeIfPossible(cache, block->prev, block))
+        block = block->prev;
+    MergeIfPossible(cache, block, block->next);
+    EndTicketMutex(&cache->heapMutex);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Asset Cache
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeAssetCache(asset_cache *cache, engine_memory *memory, memory_arena *arena,
+                                 char *packName, u32 maxSlotCount, u64 budget)
+{
+    OpenAssetPack(&cache->pack, memory, packName);
+    cache->ReadFile = memory->DEBUGReadFile;
+    cache->WriteFile = memory->DEBUGWriteFile;
+    cache->FreeFile = memory->DEBUGFreeFileMemory;
+    cache->GetFileInfo = memory->PlatformGetFileInfo;
+    cache->MapFile = memory->PlatformMapFile;
+    cache->UnmapFile = memory->PlatformUnmapFile;
+
+    cache->budget = budget;
+    cache->residentSize = 0;
+    cache->loadsInFlight = 0;
+    cache->frameIndex = 0;
+
+    cache->slotCount = 0;
+    cache->maxSlotCount = maxSlotCount;
+    cache->slots = ReserveArrayMemory(arena, maxSlotCount, asset_slot);
+    cache->lruSentinel.lruNext = &cache->lruSentinel;
+    cache->lruSentinel.lruPrev = &cache->lruSentinel;
+
+    // NOTE: The heap is bigger than the budget, so loads can land before the
+    // main thread gets to evict at the end of the frame.
+    u64 heapSize = 2 * budget;
+    cache->blockSentinel.flags = ASSET_BLOCK_USED;
+    cache->blockSentinel.next = &cache->blockSentinel;
+    cache->blockSentinel.prev = &cache->blockSentinel;
+    InsertBlock(&cache->blockSentinel, heapSize, ReserveMemory(arena, heapSize));
+}
+
+static asset_slot *RegisterAsset(asset_cache *cache, char *name, hya_asset_type type)
+{
+    ASSERT(cache->slotCount < cache->maxSlotCount)
+    asset_slot *slot = cache->slots + cache->slotCount++;
+    *slot = {};
+    strncpy(slot->name, name, HYA_NAME_LENGTH - 1);
+    slot->cache = cache;
+    slot->packAsset = FindAsset(&cache->pack, name, type);
+    return slot;
+}
+
+static void RegisterAssetBitmap(asset_cache *cache, loaded_bitmap *bmp, char *name)
+{
+    bmp->slot = RegisterAsset(cache, name, HYA_ASSET_BITMAP);
+    bmp->slot->bitmap = bmp;
+    bmp->loadState = ASSET_STATE_UNLOADED;
+    bmp->filter = TEXTURE_FILTER_TRILINEAR;
+    bmp->layout = TEXTURE_LAYOUT_TILED_4X4;
+}
+
+static void RegisterAssetOBJ(asset_cache *cache, object *object, char *name,
+                             loaded_bitmap *texture, vec3 position, vec3 material)
+{
+    object->slot = RegisterAsset(cache, name, HYA_ASSET_MESH);
+    object->slot->object = object;
+    object->texture = texture;
+    object->pos = position;
+    object->mat = material;
+
+    // NOTE: The pack knows the bounds up front, so we can draw a placeholder box while loading.
+    hya_asset *packAsset = object->slot->packAsset;
+    if (packAsset)
+    {
+        object->boundsMin = {packAsset->mesh.boundsMin[0], packAsset->mesh.boundsMin[1], packAsset->mesh.boundsMin[2]};
+        object->boundsMax = {packAsset->mesh.boundsMax[0], packAsset->mesh.boundsMax[1], packAsset->mesh.boundsMax[2]};
+    }
+    else
+    {
+        object->boundsMin = {-0.5f, -0.5f, -0.5f};
+        object->boundsMax = {0.5f, 0.5f, 0.5f};
+    }
+    object->loadState = ASSET_STATE_UNLOADED;
+}
+
+static inline u32 volatile *GetLoadState(asset_slot *slot)
+{
+    return slot->object ? &slot->object->loadState : &slot->bitmap->loadState;
+}
+
+// NOTE: Touch every page of a mapped asset on the loader thread, so the first
+// draw that uses it doesn't stall on the disk.
+static void PrefetchPages(void *memory, u64 size)
+{
+    u8 volatile *at = (u8 volatile *)memory;
+    u8 sum = 0;
+    for (u64 offset = 0; offset < size; offset += 4096)
+        sum += at[offset];
+    (void)sum;
+}
+
+// NOTE: ASSET_STATE_UNLOADED when the heap is full, so the load is retried.
+static asset_state LoadMeshSlot(asset_slot *slot, object *loaded)
+{
+    asset_cache *cache = slot->cache;
+    if (slot->packAsset)
+    {
+        LoadOBJFromPack(&cache->pack, loaded, slot->name, 0, {}, {});
+        PrefetchPages(loaded->vertices, slot->packAsset->dataSize);
+        slot->residentSize = slot->packAsset->dataSize;
+        return ASSET_STATE_LOADED;
+    }
+
+    std::ifstream file(slot->name);
+    if (!file.is_open())
+        return ASSET_STATE_FAILED;
+    bool hasNormals;
+    u64 size = CountOBJVertices(file, &hasNormals) * sizeof(vertex);
+    file.close();
+    if (size == 0)
+        return ASSET_STATE_FAILED;
+
+    void *memory = AllocateAssetMemory(cache, size, &slot->block);
+    if (!memory)
+        return ASSET_STATE_UNLOADED;
+
+    memory_arena blockArena;
+    InitializeMemoryArena(&blockArena, (u8 *)memory, slot->block->size);
+    LoadOBJ(slot->name, &blockArena, loaded, 0, {}, {});
+    slot->residentSize = slot->block->size;
+
+    // NOTE: Loose meshes only guessed their bounds when they were registered.
+    if (loaded->nVertices > 0)
+    {
+        loaded->boundsMin = loaded->vertices[0].pos;
+        loaded->boundsMax = loaded->vertices[0].pos;
+        for (i32 i = 1; i < loaded->nVertices; i++)
+            GrowBounds(&loaded->boundsMin, &loaded->boundsMax, loaded->vertices[i].pos);
+    }
+    return ASSET_STATE_LOADED;
+}
+
+static void GetTextureCacheName(char *name, char *cacheName)
+{
+    strncpy(cacheName, name, HYA_NAME_LENGTH - 1);
+    cacheName[HYA_NAME_LENGTH - 1] = 0;
+    char *extension = strrchr(cacheName, '.');
+    if (extension && (extension - cacheName) + 4 < HYA_NAME_LENGTH)
+        strcpy(extension, ".hyt");
+}
+
+// NOTE: Maps the decoded texture cache of a loose bitmap if it is still up to date.
+static bool MapTextureCache(asset_slot *slot, char *cacheName, platform_file_info source, loaded_bitmap *loaded)
+{
+    asset_cache *cache = slot->cache;
+    platform_mapped_file file = cache->MapFile(cacheName);
+    if (!file.memory)
+        return false;
+
+    hyt_header *header = (hyt_header *)file.memory;
+    bool isValid =
+        file.size >= HYT_DATA_OFFSET &&
+        header->magicValue == HYT_MAGIC_VALUE &&
+        header->version == HYT_VERSION &&
+        header->sourceSize == source.size &&
+        header->sourceWriteTime == source.writeTime &&
+        header->width > 0 && header->height > 0 &&
+        header->layout == (u32)slot->bitmap->layout;
+    texture_layout layout = slot->bitmap->layout;
+    i32 mipCount = 0;
+    u64 texelsSize = isValid ? GetMipChainTexelCount(header->width, header->height, layout, &mipCount) * sizeof(u32) : 0;
+    isValid = isValid &&
+              header->mipCount == mipCount &&
+              header->dataOffset + texelsSize <= file.size;
+    if (!isValid)
+    {
+        cache->UnmapFile(&file);
+        return false;
+    }
+
+    loaded->opacity = 1.0f;
+    loaded->isOpaque = header->isOpaque != 0;
+    SetMipChain(loaded, (u32 *)((u8 *)file.memory + header->dataOffset), header->width, header->height, mipCount, layout);
+    slot->mappedFile = file;
+    slot->residentSize = texelsSize;
+    PrefetchPages(loaded->pixels, slot->residentSize);
+    return true;
+}
+
+// NOTE: ASSET_STATE_UNLOADED when the heap is full, so the load is retried.
+static asset_state LoadBitmapSlot(asset_slot *slot, loaded_bitmap *loaded)
+{
+    asset_cache *cache = slot->cache;
+    if (slot->packAsset)
+    {
+        LoadBitmapFromPack(&cache->pack, loaded, slot->name);
+        PrefetchPages(loaded->pixels, slot->packAsset->dataSize);
+        slot->residentSize = slot->packAsset->dataSize;
+        return ASSET_STATE_LOADED;
+    }
+
+    platform_file_info source = cache->GetFileInfo(slot->name);
+    if (!source.exists)
+        return ASSET_STATE_FAILED;
+
+    char cacheName[HYA_NAME_LENGTH];
+    GetTextureCacheName(slot->name, cacheName);
+    if (MapTextureCache(slot, cacheName, source, loaded))
+        return ASSET_STATE_LOADED;
+
+    debug_read_file_result file = cache->ReadFile(slot->name);
+    bitmap_import_info info;
+    if (!GetBitmapImportInfo(file, &info))
+    {
+        cache->FreeFile(file.content);
+        return ASSET_STATE_FAILED;
+    }
+
+    // NOTE: The block holds the cache file header followed by the mip chain, so the
+    // same memory is written out as the new cache.
+    texture_layout layout = slot->bitmap->layout;
+    i32 mipCount;
+    u64 texelsSize = GetMipChainTexelCount(info.width, info.height, layout, &mipCount) * sizeof(u32);
+    u8 *memory = (u8 *)AllocateAssetMemory(cache, HYT_DATA_OFFSET + texelsSize, &slot->block);
+    if (!memory)
+    {
+        cache->FreeFile(file.content);
+        return ASSET_STATE_UNLOADED;
+    }
+
+    // NOTE: Other layouts build the linear chain in a scratch block first.
+    u32 *texels = (u32 *)(memory + HYT_DATA_OFFSET);
+    u32 *linear = texels;
+    asset_memory_block *scratchBlock = 0;
+    if (layout != TEXTURE_LAYOUT_LINEAR)
+    {
+        i32 linearMipCount;
+        u64 linearSize = GetMipChainTexelCount(info.width, info.height, TEXTURE_LAYOUT_LINEAR, &linearMipCount) * sizeof(u32);
+        linear = (u32 *)AllocateAssetMemory(cache, linearSize, &scratchBlock);
+        if (!linear)
+        {
+            FreeAssetMemory(cache, slot->block);
+            slot->block = 0;
+            cache->FreeFile(file.content);
+            return ASSET_STATE_UNLOADED;
+        }
+    }
+    loaded->isOpaque = ImportBitmap(&info, linear);
+    cache->FreeFile(file.content);
+    loaded->opacity = 1.0f;
+    SetMipChain(loaded, texels, info.width, info.height, mipCount, layout);
+    BuildMipChain(loaded, linear);
+    if (scratchBlock)
+        FreeAssetMemory(cache, scratchBlock);
+
+    hyt_header *header = (hyt_header *)memory;
+    *header = {};
+    header->magicValue = HYT_MAGIC_VALUE;
+    header->version = HYT_VERSION;
+    header->width = info.width;
+    header->height = info.height;
+    header->sourceSize = source.size;
+    header->sourceWriteTime = source.writeTime;
+    header->dataOffset = HYT_DATA_OFFSET;
+    header->mipCount = mipCount;
+    header->layout = layout;
+    header->isOpaque = loaded->isOpaque;
+    cache->WriteFile(cacheName, (u32)(HYT_DATA_OFFSET + texelsSize), memory);
+
+    slot->residentSize = slot->block->size;
+    return ASSET_STATE_LOADED;
+}
+
+static PLATFORM_WORK_QUEUE_CALLBACK(LoadAssetWork)
+{
+    asset_slot *slot = (asset_slot *)data;
+    asset_cache *cache = slot->cache;
+    slot->block = 0;
+    slot->mappedFile = {};
+    slot->residentSize = 0;
+
+    asset_state state;
+    if (slot->object)
+    {
+        object mesh = {};
+        state = LoadMeshSlot(slot, &mesh);
+
+        // NOTE: Only the mesh fields are ours. Position and orientation belong to the main thread.
+        object *o = slot->object;
+        o->vertices = mesh.vertices;
+        o->nVertices = mesh.nVertices;
+        o->hasNormals = mesh.hasNormals;
+        o->occlusion = mesh.occlusion;
+        if (!slot->packAsset && mesh.nVertices > 0)
+        {
+            o->boundsMin = mesh.boundsMin;
+            o->boundsMax = mesh.boundsMax;
+        }
+    }
+    else
+    {
+        loaded_bitmap image = {};
+        state = LoadBitmapSlot(slot, &image);
+
+        loaded_bitmap *bmp = slot->bitmap;
+        bmp->width = image.width;
+        bmp->height = image.height;
+        bmp->opacity = image.opacity;
+        bmp->isOpaque = image.isOpaque;
+        bmp->pixels = image.pixels;
+        bmp->mipCount = image.mipCount;
+        for (i32 i = 0; i < image.mipCount; i++)
+            bmp->mips[i] = image.mips[i];
+    }
+    AtomicAddU64(&cache->residentSize, slot->residentSize);
+
+    // NOTE: If the heap was full the slot goes back to unloaded and is retried
+    // on its next use, after the main thread had a chance to evict.
+    CompletePreviousWritesBeforeFutureWrites;
+    *GetLoadState(slot) = state;
+    if (queue)
+        AtomicAddU64(&cache->loadsInFlight, (u64)0 - 1);
+}
+
+static inline void RemoveFromLRU(asset_slot *slot)
+{
+    slot->lruPrev->lruNext = slot->lruNext;
+    slot->lruNext->lruPrev = slot->lruPrev;
+    slot->lruPrev = slot->lruNext = 0;
+}
+
+static inline void InsertAtLRUFront(asset_cache *cache, asset_slot *slot)
+{
+    slot->lruNext = cache->lruSentinel.lruNext;
+    slot->lruPrev = &cache->lruSentinel;
+    slot->lruNext->lruPrev = slot;
+    slot->lruPrev->lruNext = slot;
+}
+
+// NOTE: Call for every asset a frame draws. Queues the load on first use. With
+// ASSET_MAX_LOADS_IN_FLIGHT loads already queued the slot stays unloaded, and
+// is queued by a later use.
+static void UseAsset(asset_cache *cache, engine_memory *memory, asset_slot *slot)
+{
+    slot->lastUsedFrame = cache->frameIndex;
+    u32 volatile *loadState = GetLoadState(slot);
+    if (*loadState == ASSET_STATE_UNLOADED)
+    {
+        if (!memory->lowPriorityQueue)
+        {
+            *loadState = ASSET_STATE_QUEUED;
+            LoadAssetWork(0, slot);
+        }
+        else if (cache->loadsInFlight < ASSET_MAX_LOADS_IN_FLIGHT)
+        {
+            *loadState = ASSET_STATE_QUEUED;
+            AtomicAddU64(&cache->loadsInFlight, 1);
+            memory->PlatformAddWorkEntry(memory->lowPriorityQueue, LoadAssetWork, slot);
+        }
+    }
+    else if (*loadState == ASSET_STATE_LOADED)
+    {
+        if (slot->lruNext)
+            RemoveFromLRU(slot);
+        InsertAtLRUFront(cache, slot);
+    }
+}
+
+static void UseObjectAssets(asset_cache *cache, engine_memory *memory, object *o)
+{
+    if (o->slot)
+        UseAsset(cache, memory, o->slot);
+    if (o->texture && o->texture->slot)
+        UseAsset(cache, memory, o->texture->slot);
+}
+
+static void EvictAsset(asset_cache *cache, engine_memory *memory, asset_slot *slot)
+{
+    RemoveFromLRU(slot);
+    if (slot->block)
+        FreeAssetMemory(cache, slot->block);
+    else if (slot->mappedFile.memory)
+        cache->UnmapFile(&slot->mappedFile);
+    else if (slot->packAsset && memory->PlatformEvictMappedRange)
+        memory->PlatformEvictMappedRange((u8 *)cache->pack.file.memory + slot->packAsset->dataOffset,
+                                         slot->packAsset->dataSize);
+    AtomicAddU64(&cache->residentSize, (u64)0 - slot->residentSize);
+    slot->block = 0;
+    slot->residentSize = 0;
+
+    if (slot->object)
+    {
+        slot->object->vertices = 0;
+        slot->object->nVertices = 0;
+        slot->object->occlusion = 0;
+        slot->object->loadState = ASSET_STATE_UNLOADED;
+    }
+    else
+    {
+        slot->bitmap->pixels = 0;
+        slot->bitmap->mipCount = 0;
+        slot->bitmap->loadState = ASSET_STATE_UNLOADED;
+    }
+}
+
+// NOTE: Call once at the end of the frame. Assets used this frame are never evicted.
+static void EvictAssetsOverBudget(asset_cache *cache, engine_memory *memory)
+{
+    asset_slot *slot = cache->lruSentinel.lruPrev;
+    while (cache->residentSize > cache->budget && slot != &cache->lruSentinel)
+    {
+        asset_slot *prev = slot->lruPrev;
+        if (slot->lastUsedFrame != cache->frameIndex)
+            EvictAsset(cache, memory, slot);
+        slot = prev;
+    }
+    cache->frameIndex++;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Virtual Textures
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE: Levels follow the mip chain rules. Returns the total page count.
+static u64 InitializeVirtualTextureLevels(virtual_texture *texture, i32 width, i32 height)
+{
+    texture->width = width;
+    texture->height = height;
+    u64 pageCount = 0;
+    i32 levelCount = 0;
+    while (levelCount < MAX_MIP_LEVELS)
+    {
+        virtual_texture_level *level = texture->levels + levelCount;
+        level->width = width;
+        level->height = height;
+        level->pagesX = (width + VT_PAGE_SIZE - 1) >> VT_PAGE_SHIFT;
+        level->pagesY = (height + VT_PAGE_SIZE - 1) >> VT_PAGE_SHIFT;
+        level->firstPage = pageCount;
+        pageCount += (u64)level->pagesX * level->pagesY;
+        levelCount++;
+        if (width == 1 && height == 1)
+            break;
+        width = maxInt(width / 2, 1);
+        height = maxInt(height / 2, 1);
+    }
+    texture->levelCount = levelCount;
+    return pageCount;
+}
+
+static u8 *GetVirtualPageData(virtual_texture *texture, u32 key)
+{
+    virtual_texture_level *level = texture->levels + (key >> 26);
+    u64 pageY = (key >> 13) & 0x1FFF;
+    u64 pageX = key & 0x1FFF;
+    u64 page = level->firstPage + pageY * level->pagesX + pageX;
+    return (u8 *)texture->file.memory + HYV_DATA_OFFSET + page * VT_PAGE_SIZE * VT_PAGE_SIZE * sizeof(u32);
+}
+
+// NOTE: The mapped source range is dropped right away, only the physical page counts.
+static void CopyVirtualPage(virtual_page *page)
+{
+    virtual_texture *texture = page->texture;
+    u8 *source = GetVirtualPageData(texture, page->key);
+    u64 size = VT_PAGE_SIZE * VT_PAGE_SIZE * sizeof(u32);
+    memcpy(page->texels, source, (size_t)size);
+    if (texture->EvictMappedRange)
+        texture->EvictMappedRange(source, size);
+}
+
+static PLATFORM_WORK_QUEUE_CALLBACK(LoadVirtualPageWork)
+{
+    virtual_page *page = (virtual_page *)data;
+    CopyVirtualPage(page);
+    CompletePreviousWritesBeforeFutureWrites;
+    page->state = VIRTUAL_PAGE_RESIDENT;
+}
+
+// NOTE: The table only ever holds the pages that have a physical page, plus the
+// requests of the current frame, so it is rebuilt from the pages every frame.
+static void RebuildVirtualPageTable(virtual_texture *texture)
+{
+    for (u32 i = 0; i <= texture->tableMask; i++)
+    {
+        texture->table[i].key = VT_KEY_EMPTY;
+        texture->table[i].value = 0;
+    }
+    for (u32 pageIndex = 0; pageIndex < texture->pageCount; pageIndex++)
+    {
+        virtual_page *page = texture->pages + pageIndex;
+        if (page->state == VIRTUAL_PAGE_FREE)
+            continue;
+        u32 i = HashVirtualPageKey(texture, page->key);
+        while (texture->table[i].key != VT_KEY_EMPTY)
+            i = (i + 1) & texture->tableMask;
+        texture->table[i].key = page->key;
+        texture->table[i].value = VT_ENTRY_ASSIGNED | pageIndex;
+    }
+}
+
+static bool LoadVirtualTexture(virtual_texture *texture, engine_memory *memory, memory_arena *arena,
+                               char *filename, u32 physicalPageCount)
+{
+    platform_mapped_file file = memory->PlatformMapFile(filename);
+    if (!file.memory)
+        return false;
+
+    hyv_header *header = (hyv_header *)file.memory;
+    bool isValid =
+        file.size >= HYV_DATA_OFFSET &&
+        header->magicValue == HYV_MAGIC_VALUE &&
+        header->version == HYV_VERSION &&
+        header->pageSize == VT_PAGE_SIZE &&
+        header->width > 0 && header->height > 0 &&
+        header->width <= (VT_PAGE_SIZE << 13) && header->height <= (VT_PAGE_SIZE << 13);
+    u64 pageCount = isValid ? InitializeVirtualTextureLevels(texture, header->width, header->height) : 0;
+    isValid = isValid &&
+              header->levelCount == texture->levelCount &&
+              HYV_DATA_OFFSET + pageCount * VT_PAGE_SIZE * VT_PAGE_SIZE * sizeof(u32) <= file.size;
+    if (!isValid)
+    {
+        memory->PlatformUnmapFile(&file);
+        return false;
+    }
+    texture->file = file;
+    texture->EvictMappedRange = memory->PlatformEvictMappedRange;
+
+    // NOTE: Every level from the first one that fits in a page is pinned.
+    i32 firstPinned = 0;
+    while (texture->levels[firstPinned].pagesX > 1 || texture->levels[firstPinned].pagesY > 1)
+        firstPinned++;
+    u32 pinnedCount = texture->levelCount - firstPinned;
+
+    texture->pageCount = physicalPageCount + pinnedCount;
+    texture->pages = ReserveArrayMemory(arena, texture->pageCount, virtual_page);
+    u32 tableSize = 1;
+    while (tableSize < 2 * (texture->pageCount + VT_MAX_FEEDBACK))
+        tableSize *= 2;
+    texture->tableMask = tableSize - 1;
+    texture->table = ReserveArrayMemory(arena, tableSize, virtual_page_entry);
+
+    for (u32 i = 0; i < texture->pageCount; i++)
+    {
+        virtual_page *page = texture->pages + i;
+        *page = {};
+        page->texture = texture;
+        page->texels = ReserveArrayMemory(arena, VT_PAGE_SIZE * VT_PAGE_SIZE, u32);
+    }
+    for (u32 i = 0; i < pinnedCount; i++)
+    {
+        virtual_page *page = texture->pages + physicalPageCount + i;
+        page->key = GetVirtualPageKey(firstPinned + i, 0, 0);
+        CopyVirtualPage(page);
+        page->state = VIRTUAL_PAGE_PINNED;
+    }
+    texture->frameIndex = 0;
+    texture->feedbackCount = 0;
+    RebuildVirtualPageTable(texture);
+    return true;
+}
+
+static void BindVirtualTexture(loaded_bitmap *bmp, virtual_texture *texture)
+{
+    bmp->slot = 0;
+    bmp->width = texture->width;
+    bmp->height = texture->height;
+    bmp->opacity = 1.0f;
+    bmp->pixels = 0;
+    bmp->filter = TEXTURE_FILTER_TRILINEAR;
+    bmp->layout = TEXTURE_LAYOUT_VIRTUAL;
+    bmp->mipCount = texture->levelCount;
+    for (i32 i = 0; i < texture->levelCount; i++)
+    {
+        bitmap_mip *mip = bmp->mips + i;
+        *mip = {};
+        mip->width = texture->levels[i].width;
+        mip->height = texture->levels[i].height;
+        mip->layout = TEXTURE_LAYOUT_VIRTUAL;
+        mip->virtualTexture = texture;
+        mip->level = i;
+    }
+    bmp->loadState = ASSET_STATE_LOADED;
+}
+
+static virtual_page *FindVirtualPageToReuse(virtual_texture *texture)
+{
+    virtual_page *result = 0;
+    for (u32 i = 0; i < texture->pageCount; i++)
+    {
+        virtual_page *page = texture->pages + i;
+        if (page->state == VIRTUAL_PAGE_FREE)
+            return page;
+        if (page->state == VIRTUAL_PAGE_RESIDENT && page->lastUsedFrame != texture->frameIndex &&
+            (!result || page->lastUsedFrame < result->lastUsedFrame))
+            result = page;
+    }
+    return result;
+}
+
+// NOTE: Call before UpdateVirtualTexture. True while the texture will look
+// different next frame: it missed pages this frame or some are still loading.
+static bool IsVirtualTextureStreaming(virtual_texture *texture)
+{
+    if (texture->feedbackCount > 0)
+        return true;
+    for (u32 i = 0; i < texture->pageCount; i++)
+    {
+        if (texture->pages[i].state == VIRTUAL_PAGE_LOADING)
+            return true;
+    }
+    return false;
+}
+
+// NOTE: Call once at the end of the frame, after the rasterizer is done with the
+// texture. Coarse pages are loaded first so the fallback gets better quickly.
+// Requests that don't get a page this frame are simply made again next frame.
+static void UpdateVirtualTexture(virtual_texture *texture, engine_memory *memory)
+{
+    u32 count = (texture->feedbackCount < VT_MAX_FEEDBACK) ? (u32)texture->feedbackCount : VT_MAX_FEEDBACK;
+    std::sort(texture->feedback, texture->feedback + count, std::greater<u32>());
+    for (u32 i = 0; i < count && i < VT_MAX_LOADS_PER_FRAME; i++)
+    {
+        virtual_page *page = FindVirtualPageToReuse(texture);
+        if (!page)
+            break;
+        page->key = texture->feedback[i];
+        page->lastUsedFrame = texture->frameIndex;
+        page->state = VIRTUAL_PAGE_LOADING;
+        if (memory->lowPriorityQueue)
+            memory->PlatformAddWorkEntry(memory->lowPriorityQueue, LoadVirtualPageWork, page);
+        else
+            LoadVirtualPageWork(0, page);
+    }
+    texture->feedbackCount = 0;
+    RebuildVirtualPageTable(texture);
+    texture->frameIndex++;
+}
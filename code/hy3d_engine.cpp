@@ -1,62 +1,7 @@
 #include "hy3d_engine.h"
 #include "hy3d_renderer.cpp"
-#include <intrin.h>
-
-static void LoadBitmap(loaded_bitmap *bmp, debug_read_file *ReadFile, char *filename)
-{
-    debug_read_file_result file = ReadFile(filename);
-    if (file.size != 0 && file.content)
-    {
-        bmp->opacity = 1.0f;
-        bitmap_header *header = (bitmap_header *)file.content;
-        u8 *address = (u8 *)file.content + header->bitmapOffset;
-        u32 *pixels = (u32 *)address;
-        bmp->pixels = pixels;
-        bmp->height = (i16)header->height;
-        bmp->width = (i16)header->width;
-
-        if (header->compression == 3)
-        {
-            u32 alphaMask = ~(header->redMask | header->greenMask | header->blueMask);
-            u32 redShift, greenShift, blueShift, alphaShift;
-            _BitScanForward((unsigned long *)&redShift, header->redMask);
-            _BitScanForward((unsigned long *)&greenShift, header->greenMask);
-            _BitScanForward((unsigned long *)&blueShift, header->blueMask);
-            _BitScanForward((unsigned long *)&alphaShift, alphaMask);
-            if (alphaShift == 24 && redShift == 16 && greenShift == 8 && blueShift == 0)
-                return;
-            u32 *dest = pixels;
-            for (i32 y = 0; y < header->height; y++)
-            {
-                for (i32 x = 0; x < header->width; x++)
-                {
-                    u32 c = *dest;
-                    *dest++ = ((((c >> alphaShift) & 0xFF) << 24) |
-                               (((c >> redShift) & 0xFF) << 16) |
-                               (((c >> greenShift) & 0xFF) << 8) |
-                               (((c >> blueShift) & 0xFF) << 0));
-                }
-            }
-        }
-    }
-}
-
-static void InitializeMemoryArena(memory_arena *arena, u8 *base, size_t size)
-{
-    arena->base = base;
-    arena->size = size;
-    arena->used = 0;
-}
-
-#define ReserveStructMemory(arena, type) (type *)ReserveMemory(arena, sizeof(type))
-#define ReserveArrayMemory(arena, count, type) (type *)ReserveMemory(arena, (count) * sizeof(type))
-static void *ReserveMemory(memory_arena *arena, size_t size)
-{
-    ASSERT(arena->used + size <= arena->size)
-    void *result = arena->base + arena->used;
-    arena->used += size;
-    return result;
-}
+#include "hy3d_assets.cpp"
+#include "hy3d_particles.cpp"
 
 static mesh ReserveMeshMemory(memory_arena *arena, i32 nVertices, i32 nIndices)
 {
@@ -76,201 +21,6 @@ static mesh ReserveOBJMeshMemory(memory_arena *arena, i32 nVertices)
     return result;
 }
 
-#include <string>
-#include <fstream>
-#include <vector>
-
-static inline void SplitData(const std::string &in, std::vector<std::string> &out, std::string token)
-{
-    out.clear();
-    std::string temp;
-    for (int i = 0; i < int(in.size()); i++)
-    {
-        std::string test = in.substr(i, token.size());
-        if (test == token)
-        {
-            if (!temp.empty())
-            {
-                out.push_back(temp);
-                temp.clear();
-                i += (int)token.size() - 1;
-            }
-            else
-            {
-                out.push_back("");
-            }
-        }
-        else if (i + token.size() >= in.size())
-        {
-            temp += in.substr(i, token.size());
-            out.push_back(temp);
-            break;
-        }
-        else
-        {
-            temp += in[i];
-        }
-    }
-}
-
-static bool LoadOBJ(std::string filename, memory_arena *arena, object *object, loaded_bitmap *texture, vec3 position, vec3 material)
-{
-    if (filename.substr(filename.size() - 4, 4) != ".obj")
-        return false;
-
-    std::ifstream file(filename);
-
-    if (!file.is_open())
-        return false;
-
-    object->texture = texture;
-
-    std::string tag;
-    std::string data;
-    std::string line;
-
-    u32 nVertices = 0;
-    object->hasNormals = false;
-
-    while (std::getline(file, line))
-    {
-        if (!line.empty())
-        {
-            size_t tagStart = line.find_first_not_of(" \t");
-            size_t tagEnd = line.find_first_of(" \t", tagStart);
-            if (tagStart != std::string::npos && tagEnd != std::string::npos)
-                tag = line.substr(tagStart, tagEnd - tagStart);
-            else if (tagStart != std::string::npos)
-                tag = line.substr(tagStart);
-        }
-
-        if (tag == "f")
-            nVertices += 3;
-        if (tag == "vn")
-            object->hasNormals = true;
-    }
-    object->vertices = ReserveArrayMemory(arena, nVertices, vertex);
-    object->nVertices = nVertices;
-    file.clear();
-    file.seekg(0);
-
-    std::vector<vec3> positions;
-    std::vector<vec2> texCoords;
-    std::vector<vec3> normals;
-    positions.reserve(nVertices / 3);
-    texCoords.reserve(nVertices / 3);
-    normals.reserve(nVertices / 3);
-
-    i32 i = 0;
-    while (std::getline(file, line))
-    {
-        if (!line.empty())
-        {
-            size_t tagStart = line.find_first_not_of(" \t");
-            size_t tagEnd = line.find_first_of(" \t", tagStart);
-            if (tagStart != std::string::npos && tagEnd != std::string::npos)
-                tag = line.substr(tagStart, tagEnd - tagStart);
-            else if (tagStart != std::string::npos)
-                tag = line.substr(tagStart);
-
-            size_t dataStart = line.find_first_not_of(" \t", tagEnd);
-            size_t dataEnd = line.find_last_not_of(" \t");
-            if (dataStart != std::string::npos && dataEnd != std::string::npos)
-                data = line.substr(dataStart, dataEnd - dataStart + 1);
-            else if (dataStart != std::string::npos)
-                data = line.substr(dataStart);
-        }
-
-        if (tag == "v")
-        {
-            std::vector<std::string> dataSplit;
-            SplitData(data, dataSplit, " ");
-
-            vec3 v;
-            v.x = std::stof(dataSplit[0]);
-            v.y = std::stof(dataSplit[1]);
-            v.z = std::stof(dataSplit[2]);
-            positions.push_back(v);
-        }
-        else if (tag == "vt")
-        {
-            std::vector<std::string> dataSplit;
-            SplitData(data, dataSplit, " ");
-
-            vec2 v;
-            v.x = std::stof(dataSplit[0]);
-            v.y = std::stof(dataSplit[1]);
-            texCoords.push_back(v);
-        }
-        else if (tag == "vn")
-        {
-            std::vector<std::string> dataSplit;
-            SplitData(data, dataSplit, " ");
-
-            vec3 v;
-            v.x = std::stof(dataSplit[0]);
-            v.y = std::stof(dataSplit[1]);
-            v.z = std::stof(dataSplit[2]);
-            normals.push_back(v);
-        }
-        else if (tag == "f")
-        {
-            std::vector<std::string> dataSplit; // p/t/n
-            SplitData(data, dataSplit, " ");
-
-            // Contains 3 indices to the vertices that make a triangle
-            // Cases:
-            // P
-            // P/TC
-            // P/TC/N
-            // P//N
-            std::vector<std::string> faceVert;
-
-            for (std::string faceVertString : dataSplit)
-            {
-                SplitData(faceVertString, faceVert, "/");
-
-                vertex v = {};
-
-                // We always have the position index
-                i32 index = std::stoi(faceVert[0]) - 1;
-                v.pos = positions[index];
-
-                // Position/Texture Coordinates
-                if (faceVert.size() == 2)
-                {
-                    index = std::stoi(faceVert[1]) - 1;
-                    v.texCoord = texCoords[index];
-                }
-                else if (faceVert.size() == 3)
-                {
-                    // Position/Texture Coordinate/Normal
-                    if (faceVert[1] != "")
-                    {
-                        index = std::stoi(faceVert[1]) - 1;
-                        v.texCoord = texCoords[index];
-
-                        index = std::stoi(faceVert[2]) - 1;
-                        v.normal = normals[index];
-                    }
-                    // Position//Normal
-                    else
-                    {
-                        index = std::stoi(faceVert[2]) - 1;
-                        v.normal = normals[index];
-                    }
-                }
-                object->vertices[i] = v;
-                i++;
-            }
-        }
-    }
-    file.close();
-    object->pos = position;
-    object->mat = material;
-    return true;
-}
-
 #define PI 3.141592741f
 static inline i32 calcIdx(i32 longDiv, i32 iLat, i32 iLong)
 {
@@ -357,6 +107,44 @@ static void LoadSphere(f32 radius, i32 latDiv, i32 longDiv,
     }
 }
 
+// NOTE: A square in the xy plane facing -z, split in divisions x divisions quads.
+static void LoadPlane(f32 side, i32 divisions, memory_arena *arena, object *object,
+                      loaded_bitmap *texture, vec3 position, vec3 material)
+{
+    object->pos = position;
+    object->mat = material;
+    object->texture = texture;
+    // NOTE: Flat and smooth shading are the same on a plane, and only the flat path is textured.
+    object->hasNormals = false;
+    object->nVertices = divisions * divisions * 6;
+    object->vertices = ReserveArrayMemory(arena, object->nVertices, vertex);
+    object->boundsMin = {-side / 2.0f, -side / 2.0f, 0.0f};
+    object->boundsMax = {side / 2.0f, side / 2.0f, 0.0f};
+
+    f32 step = side / (f32)divisions;
+    f32 texStep = 1.0f / (f32)divisions;
+    vertex *v = object->vertices;
+    for (i32 row = 0; row < divisions; row++)
+    {
+        for (i32 col = 0; col < divisions; col++)
+        {
+            vec3 p = {-side / 2.0f + col * step, -side / 2.0f + row * step, 0.0f};
+            vec2 t = {col * texStep, row * texStep};
+            vertex bottomLeft = {p, t, {0.0f, 0.0f, -1.0f}};
+            vertex topLeft = {p + vec3{0.0f, step, 0.0f}, t + vec2{0.0f, texStep}, {0.0f, 0.0f, -1.0f}};
+            vertex bottomRight = {p + vec3{step, 0.0f, 0.0f}, t + vec2{texStep, 0.0f}, {0.0f, 0.0f, -1.0f}};
+            vertex topRight = {p + vec3{step, step, 0.0f}, t + vec2{texStep, texStep}, {0.0f, 0.0f, -1.0f}};
+            *v++ = bottomLeft;
+            *v++ = topLeft;
+            *v++ = bottomRight;
+            *v++ = topLeft;
+            *v++ = topRight;
+            *v++ = bottomRight;
+        }
+    }
+    object->loadState = ASSET_STATE_LOADED;
+}
+
 static void Initialize(hy3d_engine *e, engine_state *state, engine_memory *memory)
 {
     e->input = {};
@@ -373,26 +161,63 @@ static void Initialize(hy3d_engine *e, engine_state *state, engine_memory *memor
     InitializeMemoryArena(&state->memoryArena,
                           (u8 *)memory->permanentMemory + sizeof(engine_state),
                           memory->permanentMemorySize - sizeof(engine_state));
+    InitializeMemoryArena(&state->frameArena, (u8 *)memory->transientMemory, memory->transientMemorySize);
 
     state->curObject = &state->monkey;
-    LoadBitmap(&state->bunnyTexture, memory->DEBUGReadFile, "bunny_tex.bmp");
-    LoadBitmap(&state->cruiserTexture, memory->DEBUGReadFile, "cruiser.bmp");
-    LoadBitmap(&state->f16Tex, memory->DEBUGReadFile, "F16s.bmp");
-    LoadBitmap(&state->background, memory->DEBUGReadFile, "city_bg_purple.bmp");
-    
-    LoadOBJ("bunny.obj", &state->memoryArena, &state->bunny, 0, {0.0f, -0.1f, 1.0f}, {0.9f, 0.85f, 0.9f});
-    LoadOBJ("suzanne.obj", &state->memoryArena, &state->monkey, 0, {0.0f, 0.0f, 5.0f}, {0.9f, 0.75f, 0.45f});
-    LoadOBJ("gourad.obj", &state->memoryArena, &state->gourad, 0, {0.0f, 0.0f, 5.0f}, {0.0f, 0.0f, 1.0f});
-    LoadOBJ("bunny_tex.obj", &state->memoryArena, &state->bunnyTextured, &state->bunnyTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
-    LoadOBJ("cruiser.obj", &state->memoryArena, &state->cruiser, &state->cruiserTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
-    LoadOBJ("f16.obj", &state->memoryArena, &state->f16, &state->cruiserTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
+    InitializeAssetCache(&state->assets, memory, &state->memoryArena, "hy3d.hya", 4096, ASSET_MEMORY_BUDGET);
+    // NOTE: These layouts only apply to textures imported from .bmp files. A pack
+    // keeps the layout it was built with, so pack.bat gives the same ones.
+    RegisterAssetBitmap(&state->assets, &state->bunnyTexture, "bunny_tex.bmp");
+    state->bunnyTexture.layout = TEXTURE_LAYOUT_BC1;
+    RegisterAssetBitmap(&state->assets, &state->cruiserTexture, "cruiser.bmp");
+    RegisterAssetBitmap(&state->assets, &state->f16Tex, "F16s.bmp");
+    RegisterAssetBitmap(&state->assets, &state->background, "city_bg_purple.bmp");
+    state->background.layout = TEXTURE_LAYOUT_LINEAR;
+    RegisterAssetBitmap(&state->assets, &state->logo, "hy3d.bmp");
+
+    RegisterAssetOBJ(&state->assets, &state->bunny, "bunny.obj", 0, {0.0f, -0.1f, 1.0f}, {0.9f, 0.85f, 0.9f});
+    RegisterAssetOBJ(&state->assets, &state->monkey, "suzanne.obj", 0, {0.0f, 0.0f, 5.0f}, {0.9f, 0.75f, 0.45f});
+    RegisterAssetOBJ(&state->assets, &state->gourad, "gourad.obj", 0, {0.0f, 0.0f, 5.0f}, {0.0f, 0.0f, 1.0f});
+    RegisterAssetOBJ(&state->assets, &state->bunnyTextured, "bunny_tex.obj", &state->bunnyTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
+    RegisterAssetOBJ(&state->assets, &state->cruiser, "cruiser.obj", &state->cruiserTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
+    RegisterAssetOBJ(&state->assets, &state->f16, "f16.obj", &state->cruiserTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
+
+    object *litObjects[7] = {&state->bunny, &state->monkey, &state->gourad, &state->bunnyTextured,
+                             &state->cruiser, &state->f16, &state->terrain};
+    for (i32 i = 0; i < 7; i++)
+    {
+        state->lightingCaches[i] = {};
+        state->lightingCaches[i].arena = &state->memoryArena;
+        litObjects[i]->lightingCache = state->lightingCaches + i;
+        InitializeImpostor(state->impostors + i, &state->memoryArena);
+        litObjects[i]->impostor = state->impostors + i;
+    }
+
+    // NOTE: The terrain is a virtual texture, built with the packer from hy3d_plane.bmp.
+    loaded_bitmap *terrainTexture = 0;
+    if (LoadVirtualTexture(&state->terrainTexture, memory, &state->memoryArena, "terrain.hyv", 128))
+    {
+        BindVirtualTexture(&state->terrainBitmap, &state->terrainTexture);
+        terrainTexture = &state->terrainBitmap;
+    }
+    LoadPlane(4.0f, 16, &state->memoryArena, &state->terrain, terrainTexture, {0.0f, 0.0f, 5.0f}, {1.0f, 1.0f, 1.0f});
+    InitializeSpriteBatch(&state->sprites, &state->memoryArena, 4096);
+    InitializeParticleSystem(&state->particles, &state->memoryArena, 128 * 1024);
+    InitializeLightGrid(&state->lightGrid, &state->memoryArena, e->pixelBuffer.width, e->pixelBuffer.height);
+    InitializeVisibilityBuffer(&state->visibility, &state->memoryArena, e->pixelBuffer.width, e->pixelBuffer.height);
+    InitializeShadowMap(&state->shadowMap, &state->memoryArena, SHADOW_MAP_SIZE);
+    state->isShadowOn = true;
 
     state->orientation = {};
 
     state->diffuse.intensity = {1.0f, 1.0f, 1.0f};
     state->diffuse.direction = {0.0f, 0.0f, 1.0f};
     state->ambient = {0.2f, 0.15f, 0.25f};
-    state->pointLight = {{0.0f, 0.0f, 2.0f}, 1.0f, 2.619f, 0.382f};
+    state->environmentSH = {};
+    AddSHAmbient(&state->environmentSH, state->ambient);
+    state->isSHLightingOn = true;
+    state->pointLights[0] = {{0.0f, 0.0f, 2.0f}, 1.0f, 2.619f, 0.382f, {1.0f, 1.0f, 1.0f}};
+    state->pointLightCount = 1;
 
     memory->isInitialized = true;
     e->frameStart = std::chrono::steady_clock::now();
@@ -403,7 +228,8 @@ extern "C" UPDATE_AND_RENDER(UpdateAndRender)
     engine_state *state = (engine_state *)memory->permanentMemory;
     if (!memory->isInitialized)
         Initialize(&e, state, memory);
-    ClearZBuffer(&e.pixelBuffer);
+    e.pixelBuffer.stats = {};
+    state->frameArena.used = 0;
 
     // NOTE: UPDATE
     std::chrono::steady_clock::time_point frameEnd = std::chrono::steady_clock::now();
@@ -423,6 +249,8 @@ extern "C" UPDATE_AND_RENDER(UpdateAndRender)
         state->curObject = &state->cruiser;
     if (e.input.keyboard.isPressed[SIX])
         state->curObject = &state->f16;
+    if (e.input.keyboard.isPressed[SEVEN])
+        state->curObject = &state->terrain;
 
     // Cube Control
     f32 speed = 2.5f * dt;
@@ -462,13 +290,339 @@ extern "C" UPDATE_AND_RENDER(UpdateAndRender)
         state->diffuse.direction.z *= -1.0f;
     }
 
+    // NOTE: F cycles the texture filter of the current object.
+    bool isFilterKeyPressed = e.input.keyboard.isPressed[F];
+    if (isFilterKeyPressed && !state->wasFilterKeyPressed && state->curObject->texture)
+    {
+        loaded_bitmap *texture = state->curObject->texture;
+        texture->filter = (texture_filter)((texture->filter + 1) % TEXTURE_FILTER_COUNT);
+    }
+    state->wasFilterKeyPressed = isFilterKeyPressed;
+
+    // NOTE: P toggles a fountain of sparks above the current object.
+    bool isParticleKeyPressed = e.input.keyboard.isPressed[P];
+    if (isParticleKeyPressed && !state->wasParticleKeyPressed)
+        state->isEmittingParticles = !state->isEmittingParticles;
+    state->wasParticleKeyPressed = isParticleKeyPressed;
+    if (state->isEmittingParticles)
+    {
+        vec3 emitter = state->curObject->pos + vec3{0.0f, 0.5f, 0.0f};
+        i32 spawnCount = (i32)(50000.0f * minF32(dt, 0.1f));
+        SpawnParticles(&state->particles, spawnCount, emitter, {0.0f, 1.5f, 0.0f}, 1.0f, 2.5f, 0xFFFFA040);
+    }
+    UpdateParticles(&state->particles, memory, dt);
+
+    // NOTE: L switches close objects between per vertex and per pixel lighting.
+    bool isLightingKeyPressed = e.input.keyboard.isPressed[L];
+    if (isLightingKeyPressed && !state->wasLightingKeyPressed)
+        state->isPerPixelLighting = !state->isPerPixelLighting;
+    state->wasLightingKeyPressed = isLightingKeyPressed;
+
+    // NOTE: I switches between shading while rasterizing and the visibility buffer.
+    bool isVisibilityKeyPressed = e.input.keyboard.isPressed[I];
+    if (isVisibilityKeyPressed && !state->wasVisibilityKeyPressed)
+        state->isVisibilityBufferOn = !state->isVisibilityBufferOn;
+    state->wasVisibilityKeyPressed = isVisibilityKeyPressed;
+
+    // NOTE: E toggles a depth prepass for everything drawn with DrawObject.
+    bool isPrepassKeyPressed = e.input.keyboard.isPressed[E];
+    if (isPrepassKeyPressed && !state->wasPrepassKeyPressed)
+        state->isDepthPrepassOn = !state->isDepthPrepassOn;
+    state->wasPrepassKeyPressed = isPrepassKeyPressed;
+
+    // NOTE: J toggles the shadows of the directional light.
+    bool isShadowKeyPressed = e.input.keyboard.isPressed[J];
+    if (isShadowKeyPressed && !state->wasShadowKeyPressed)
+        state->isShadowOn = !state->isShadowOn;
+    state->wasShadowKeyPressed = isShadowKeyPressed;
+
+    // NOTE: U toggles SH ambient lighting.
+    bool isSHKeyPressed = e.input.keyboard.isPressed[U];
+    if (isSHKeyPressed && !state->wasSHKeyPressed)
+        state->isSHLightingOn = !state->isSHLightingOn;
+    state->wasSHKeyPressed = isSHKeyPressed;
+
+    // NOTE: K toggles a ring of small colored lights orbiting the current object.
+    bool isLightRingKeyPressed = e.input.keyboard.isPressed[K];
+    if (isLightRingKeyPressed && !state->wasLightRingKeyPressed)
+        state->isLightRingOn = !state->isLightRingOn;
+    state->wasLightRingKeyPressed = isLightRingKeyPressed;
+    state->pointLightCount = 1;
+    if (state->isLightRingOn)
+    {
+        i32 ringCount = 32;
+        state->lightRingAngle += 0.5f * dt;
+        for (i32 i = 0; i < ringCount; i++)
+        {
+            f32 angle = state->lightRingAngle + (f32)i * (6.2831853f / (f32)ringCount);
+            vec3 pos = state->curObject->pos + vec3{1.2f * cosf(angle), 0.3f * sinf(3.0f * angle), 1.2f * sinf(angle)};
+            vec3 color = {0.5f + 0.5f * cosf(angle), 0.5f + 0.5f * cosf(angle + 2.094f), 0.5f + 0.5f * cosf(angle + 4.189f)};
+            state->pointLights[state->pointLightCount++] = {pos, 0.0f, 400.0f, 1.0f, color * 2.0f};
+        }
+    }
+
+    // NOTE: O toggles a ring of hy3d logos circling the current object.
+    bool isLogoKeyPressed = e.input.keyboard.isPressed[O];
+    if (isLogoKeyPressed && !state->wasLogoKeyPressed)
+        state->isLogoRingOn = !state->isLogoRingOn;
+    state->wasLogoKeyPressed = isLogoKeyPressed;
+    if (state->isLogoRingOn)
+        state->logoRingAngle += 0.5f * dt;
+
+    // NOTE: A toggles the crowd.
+    bool isCrowdKeyPressed = e.input.keyboard.isPressed[A];
+    if (isCrowdKeyPressed && !state->wasCrowdKeyPressed)
+        state->isCrowdOn = !state->isCrowdOn;
+    state->wasCrowdKeyPressed = isCrowdKeyPressed;
+
+    // NOTE: S toggles drawing the current object as a stereo pair.
+    bool isStereoKeyPressed = e.input.keyboard.isPressed[S];
+    if (isStereoKeyPressed && !state->wasStereoKeyPressed)
+        state->isStereoOn = !state->isStereoOn;
+    state->wasStereoKeyPressed = isStereoKeyPressed;
+
     // NOTE: RENDER
-    //DrawBitmap(&state->background, 0, 0, &e.pixelBuffer);
-    if (state->curObject->pos.z >= 15.0f)
-        DrawObject(state->curObject, state->diffuse, state->ambient, state->pointLight, shade_type::FLAT,
-                   &e.pixelBuffer, &e.screenTransformer);
+    UseObjectAssets(&state->assets, memory, state->curObject);
+    // NOTE:
+    // With SH lighting the ambient comes from the background, projected once it
+    // has loaded and scaled to the brightness of the flat ambient. Point lights
+    // far from the current object, or past the 8 strongest on it, are folded in
+    // instead of being lit per vertex / pixel.
+    if (state->isSHLightingOn)
+    {
+        if (!state->isEnvironmentProjected)
+        {
+            UseAsset(&state->assets, memory, state->background.slot);
+            sh9 environment = {};
+            if (ProjectEnvironmentToSH(&environment, &state->background, 1.0f))
+            {
+                vec3 average = GetSHAverage(&environment);
+                f32 brightness = average.r + average.g + average.b;
+                if (brightness > 0.0f)
+                    ScaleSH(&environment, (state->ambient.r + state->ambient.g + state->ambient.b) / brightness);
+                state->environmentSH = environment;
+                state->isEnvironmentProjected = true;
+            }
+        }
+
+        object *o = state->curObject;
+        mat3 rotation = RotateX(o->orientation.thetaX) *
+                        RotateY(o->orientation.thetaY) *
+                        RotateZ(o->orientation.thetaZ);
+        vec3 center = 0.5f * (o->boundsMin + o->boundsMax) * rotation + o->pos;
+        f32 radius = 0.5f * (o->boundsMax - o->boundsMin).length();
+        sh9 sh = state->environmentSH;
+        point_light nearLights[MAX_POINT_LIGHTS];
+        i32 nearCount = FoldPointLights(&sh, state->pointLights, state->pointLightCount, center, 4.0f * radius, 8, nearLights);
+        BuildLightGrid(&state->lightGrid, nearLights, nearCount, &sh, &e.screenTransformer);
+    }
     else
-        DrawObject(state->curObject, state->diffuse, state->ambient, state->pointLight, shade_type::GOURAUD,
-                   &e.pixelBuffer, &e.screenTransformer);
-    //DrawObject(&state->sphere, {}, {}, {}, shade_type::SOLID, &e.pixelBuffer, &e.screenTransformer);
+    {
+        BuildLightGrid(&state->lightGrid, state->pointLights, state->pointLightCount, 0, &e.screenTransformer);
+    }
+    state->diffuse.shadow = 0;
+    if (state->isShadowOn)
+    {
+        RenderShadowMap(&state->shadowMap, &state->curObject, 1, state->diffuse.direction);
+        state->diffuse.shadow = &state->shadowMap;
+    }
+    // NOTE: The background is drawn under everything but the stereo pair. It is
+    // opaque and packed linear, so it is copied in rows.
+    UseAsset(&state->assets, memory, state->background.slot);
+    loaded_bitmap *background = 0;
+    if (state->background.loadState == ASSET_STATE_LOADED && !state->isStereoOn)
+        background = &state->background;
+    shade_type shade = shade_type::FLAT;
+    if (state->curObject->pos.z < 15.0f)
+        shade = state->isPerPixelLighting ? shade_type::PHONG : shade_type::GOURAUD;
+
+    // NOTE: The logos are sprites at the view space depth of their spot on the
+    // ring, depth tested so the far half goes behind the object. They spin and
+    // overlap, so the batch gets sorted and blended every frame.
+    if (state->isLogoRingOn && !state->isStereoOn)
+    {
+        UseAsset(&state->assets, memory, state->logo.slot);
+        if (state->logo.loadState == ASSET_STATE_LOADED)
+        {
+            i32 ringCount = 12;
+            object *o = state->curObject;
+            f32 radius = 0.6f * (o->boundsMax - o->boundsMin).length();
+            state->sprites.depthTest = true;
+            for (i32 i = 0; i < ringCount; i++)
+            {
+                f32 angle = state->logoRingAngle + (f32)i * (2.0f * PI / (f32)ringCount);
+                vec3 pos = o->pos + vec3{radius * cosf(angle), 0.0f, radius * sinf(angle)};
+                if (pos.z < 0.1f)
+                    continue;
+                f32 x = (pos.x / pos.z + 1.0f) * e.screenTransformer.xFactor;
+                f32 y = (pos.y / pos.z + 1.0f) * e.screenTransformer.yFactor;
+                f32 scale = 0.25f * radius * e.screenTransformer.xFactor / (pos.z * (f32)state->logo.width);
+                PushSprite(&state->sprites, &state->logo, x, y, scale, -2.0f * angle, 0.8f, pos.z);
+            }
+        }
+    }
+
+    // NOTE:
+    // Only what changed since the last frame is drawn again. A frame drawn from
+    // the same state as the last one is skipped. The current object is the only
+    // one drawn and everything in frame_key only changes how it looks, so when
+    // that changes (or its virtual texture is still streaming in) only the union
+    // of its old and new screen rects is cleared and redrawn. A new view redraws
+    // the whole screen, and so do particles and sprites, which move on their own,
+    // and a change to the object while the crowd of its copies or the stereo
+    // pair is on. The stereo pair is only the current object.
+    object *o = state->curObject;
+    frame_view view;
+    memset(&view, 0, sizeof(view));
+    view.pixels = e.pixelBuffer.memory;
+    view.width = e.pixelBuffer.width;
+    view.height = e.pixelBuffer.height;
+    view.st = e.screenTransformer;
+    view.isVisibilityBufferOn = state->isVisibilityBufferOn;
+    view.isDepthPrepassOn = state->isDepthPrepassOn;
+    view.isAnimated = state->particles.count > 0 || state->sprites.count > 0;
+    view.isCrowdOn = state->isCrowdOn && !state->isVisibilityBufferOn && !state->isStereoOn;
+    view.isStereoOn = state->isStereoOn;
+    view.background = background ? background->pixels : 0;
+    frame_key key;
+    memset(&key, 0, sizeof(key));
+    key.d = state->diffuse;
+    key.shadowVersion = state->diffuse.shadow ? state->diffuse.shadow->renderCount : 0;
+    key.a = state->ambient;
+    key.lightsVersion = state->lightGrid.version;
+    key.shade = shade;
+    key.object = o;
+    key.loadState = o->loadState;
+    key.vertices = o->vertices;
+    key.nVertices = o->nVertices;
+    key.mat = o->mat;
+    key.orientation = o->orientation;
+    key.pos = o->pos;
+    key.texture = o->texture;
+    if (o->texture)
+    {
+        key.textureLoadState = o->texture->loadState;
+        key.texturePixels = o->texture->pixels;
+        key.textureFilter = o->texture->filter;
+    }
+
+    // NOTE: A far object is drawn as its impostor, rendered again here only when
+    // it no longer looks like the object. The visibility buffer draws the mesh.
+    bool isImpostor = o->impostor && o->loadState == ASSET_STATE_LOADED &&
+                      o->pos.z >= IMPOSTOR_DISTANCE && !state->isVisibilityBufferOn && !state->isStereoOn;
+    if (isImpostor)
+        RenderImpostor(o->impostor, o, state->diffuse, state->ambient, &state->lightGrid, &e.screenTransformer);
+
+    screen_rect screen = {0, 0, e.pixelBuffer.width, e.pixelBuffer.height};
+    screen_rect objectRect = GetObjectScreenRect(o, &e.pixelBuffer, &e.screenTransformer);
+    if (isImpostor)
+        objectRect = UnionRect(objectRect, GetImpostorScreenRect(o->impostor, o, &e.pixelBuffer, &e.screenTransformer));
+    bool isSameView = state->isLastFrameValid && memcmp(&view, &state->lastView, sizeof(view)) == 0 &&
+                      !view.isAnimated;
+    bool isObjectChanged = memcmp(&key, &state->lastFrame, sizeof(key)) != 0 ||
+                           (o == &state->terrain && state->isTerrainStreaming);
+    screen_rect dirty = {};
+    if (!isSameView)
+        dirty = screen;
+    else if (isObjectChanged)
+        dirty = (view.isCrowdOn || view.isStereoOn) ? screen : UnionRect(state->lastObjectRect, objectRect);
+    state->lastView = view;
+    state->lastFrame = key;
+    state->lastObjectRect = objectRect;
+    state->isLastFrameValid = true;
+    e.presentRect = dirty;
+
+    if (!IsEmptyRect(dirty))
+    {
+        ClearRect(&e.pixelBuffer, dirty);
+        if (background)
+            DrawBitmap(background, 0, 0, &e.pixelBuffer, dirty);
+        if (state->isStereoOn)
+        {
+            i16 eyeWidth = e.pixelBuffer.width / 2;
+            pixel_buffer eyes[2];
+            render_view views[2];
+            for (i32 eye = 0; eye < 2; eye++)
+            {
+                eyes[eye] = {};
+                eyes[eye].memory = ReserveArrayMemory(&state->frameArena, eyeWidth * e.pixelBuffer.height, u32);
+                eyes[eye].zBuffer = ReserveArrayMemory(&state->frameArena, eyeWidth * e.pixelBuffer.height, f32);
+                eyes[eye].width = eyeWidth;
+                eyes[eye].height = e.pixelBuffer.height;
+                eyes[eye].bytesPerPixel = 4;
+                eyes[eye].size = eyeWidth * e.pixelBuffer.height * 4;
+                memset(eyes[eye].memory, 0, eyes[eye].size);
+                ClearZBuffer(&eyes[eye]);
+                views[eye].pb = eyes + eye;
+                views[eye].st = {0.5f * e.screenTransformer.xFactor, e.screenTransformer.yFactor};
+                views[eye].pos = {(eye ? 0.5f : -0.5f) * STEREO_EYE_SEPARATION, 0.0f, 0.0f};
+                views[eye].rotation = Scale(1.0f);
+            }
+            DrawObjectMultiView(o, state->diffuse, state->ambient, &state->lightGrid, shade, 0, 0,
+                                views, 2, &state->frameArena, memory);
+            for (i32 eye = 0; eye < 2; eye++)
+            {
+                for (i32 y = 0; y < e.pixelBuffer.height; y++)
+                {
+                    memcpy((u32 *)e.pixelBuffer.memory + y * e.pixelBuffer.width + eye * eyeWidth,
+                           (u32 *)eyes[eye].memory + y * eyeWidth, eyeWidth * sizeof(u32));
+                }
+            }
+        }
+        else if (state->isVisibilityBufferOn)
+        {
+            ClearVisibilityBuffer(&state->visibility);
+            VisibilityDrawObject(&state->visibility, &state->frameArena, state->curObject, state->diffuse,
+                                 state->ambient, &state->lightGrid, shade, &e.pixelBuffer, &e.screenTransformer);
+            ShadeVisibilityBuffer(&state->visibility, &e.pixelBuffer, &e.screenTransformer, memory);
+        }
+        else if (isImpostor)
+        {
+            DrawImpostor(o->impostor, o, &e.pixelBuffer, &e.screenTransformer);
+        }
+        else if (state->isDepthPrepassOn)
+        {
+            DrawObjectDepth(state->curObject, &e.pixelBuffer, &e.screenTransformer);
+            e.pixelBuffer.depthTest = DEPTH_TEST_EQUAL;
+            DrawObject(state->curObject, state->diffuse, state->ambient, &state->lightGrid, shade,
+                       &e.pixelBuffer, &e.screenTransformer);
+            e.pixelBuffer.depthTest = DEPTH_TEST_LESS;
+        }
+        else
+        {
+            DrawObject(state->curObject, state->diffuse, state->ambient, &state->lightGrid, shade,
+                       &e.pixelBuffer, &e.screenTransformer);
+        }
+        if (view.isCrowdOn)
+        {
+            f32 spacing = 1.5f * (o->boundsMax - o->boundsMin).length();
+            for (i32 z = 0; z < CROWD_SIDE; z++)
+            {
+                for (i32 x = 0; x < CROWD_SIDE; x++)
+                {
+                    instance_data *instance = state->crowd + z * CROWD_SIDE + x;
+                    instance->pos = o->pos + vec3{((f32)x - 0.5f * (f32)(CROWD_SIDE - 1)) * spacing, 0.0f,
+                                                  (f32)(z + 1) * spacing};
+                    instance->orientation = o->orientation;
+                    instance->orientation.thetaY += 0.7f * (f32)x + 1.3f * (f32)z;
+                }
+            }
+            DrawObjectInstanced(o, state->crowd, CROWD_SIDE * CROWD_SIDE, state->diffuse, state->ambient,
+                                &state->lightGrid, shade, &e.pixelBuffer, &e.screenTransformer);
+        }
+        //DrawObject(&state->sphere, {}, {}, {}, shade_type::SOLID, &e.pixelBuffer, &e.screenTransformer);
+        if (!state->isStereoOn)
+        {
+            DrawParticles(&state->particles, &e.pixelBuffer, &e.screenTransformer);
+            DrawSpriteBatch(&state->sprites, &e.pixelBuffer);
+        }
+    }
+
+    state->isTerrainStreaming = false;
+    if (state->terrain.texture)
+    {
+        state->isTerrainStreaming = IsVirtualTextureStreaming(&state->terrainTexture);
+        UpdateVirtualTexture(&state->terrainTexture, memory);
+    }
+    EvictAssetsOverBudget(&state->assets, memory);
 }
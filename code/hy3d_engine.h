@@ -2,6 +2,7 @@
 #include "hy3d_types.h"
 #include "hy3d_renderer.h"
 #include "hy3d_objects.h"
+#include "hy3d_asset_pack.h"
 
 #include <chrono>
 
@@ -10,6 +11,15 @@
 #define GIGABYTES(val) (MEGABYTES(val) * 1024LL)
 #define TERABYTES(val) (GIGABYTES(val) * 1024LL)
 
+// NOTE: How much mesh and texture data the asset cache keeps resident before it
+// starts evicting the least recently drawn assets.
+#define ASSET_MEMORY_BUDGET MEGABYTES(16)
+
+// NOTE: How many asset loads may wait on the low priority queue at once. The
+// queue holds 255 entries, and the terrain's virtual texture can have up to 128
+// page loads on it, so the rest have to wait for a later frame.
+#define ASSET_MAX_LOADS_IN_FLIGHT 64
+
 struct debug_read_file_result
 {
     void *content;
@@ -25,6 +35,46 @@ typedef DEBUG_WRITE_FILE(debug_write_file);
 #define DEBUG_FREE_FILE(name) void name(void *memory)
 typedef DEBUG_FREE_FILE(debug_free_file);
 
+struct platform_file_info
+{
+    bool exists;
+    u64 size;
+    u64 writeTime;
+};
+
+#define PLATFORM_GET_FILE_INFO(name) platform_file_info name(char *filename)
+typedef PLATFORM_GET_FILE_INFO(platform_get_file_info);
+
+// NOTE: Read-only view of a whole file. handle is owned by the platform layer.
+struct platform_mapped_file
+{
+    void *memory;
+    u64 size;
+    void *handle;
+};
+
+#define PLATFORM_MAP_FILE(name) platform_mapped_file name(char *filename)
+typedef PLATFORM_MAP_FILE(platform_map_file);
+
+#define PLATFORM_UNMAP_FILE(name) void name(platform_mapped_file *file)
+typedef PLATFORM_UNMAP_FILE(platform_unmap_file);
+
+// NOTE: Hint that a range of a mapped file won't be used for a while. The pages leave our
+// working set but stay in the OS file cache.
+#define PLATFORM_EVICT_MAPPED_RANGE(name) void name(void *memory, u64 size)
+typedef PLATFORM_EVICT_MAPPED_RANGE(platform_evict_mapped_range);
+
+// NOTE: Work queues are serviced by platform threads. Entries must be added from the main thread.
+struct platform_work_queue;
+#define PLATFORM_WORK_QUEUE_CALLBACK(name) void name(platform_work_queue *queue, void *data)
+typedef PLATFORM_WORK_QUEUE_CALLBACK(platform_work_queue_callback);
+
+#define PLATFORM_ADD_WORK_ENTRY(name) void name(platform_work_queue *queue, platform_work_queue_callback *callback, void *data)
+typedef PLATFORM_ADD_WORK_ENTRY(platform_add_work_entry);
+
+#define PLATFORM_COMPLETE_ALL_WORK(name) void name(platform_work_queue *queue)
+typedef PLATFORM_COMPLETE_ALL_WORK(platform_complete_all_work);
+
 #pragma pack(push, 1)
 struct bitmap_header
 {
@@ -48,6 +98,7 @@ struct bitmap_header
     u32 redMask;
     u32 greenMask;
     u32 blueMask;
+    u32 alphaMask; // NOTE: Only there if size >= 56 (V3 header and later)
 };
 #pragma pack(pop)
 
@@ -62,13 +113,494 @@ struct engine_memory
     debug_read_file *DEBUGReadFile;
     debug_write_file *DEBUGWriteFile;
     debug_free_file *DEBUGFreeFileMemory;
+
+    platform_get_file_info *PlatformGetFileInfo;
+    platform_map_file *PlatformMapFile;
+    platform_unmap_file *PlatformUnmapFile;
+    platform_evict_mapped_range *PlatformEvictMappedRange;
+
+    platform_work_queue *highPriorityQueue;
+    platform_work_queue *lowPriorityQueue;
+    platform_add_work_entry *PlatformAddWorkEntry;
+    platform_complete_all_work *PlatformCompleteAllWork;
 };
 
 struct memory_arena
 {
     u8 *base;
-    size_t size;
-    size_t used;
+    u64 size;
+    u64 volatile used;
+};
+
+static void InitializeMemoryArena(memory_arena *arena, u8 *base, size_t size)
+{
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+}
+
+#define ReserveStructMemory(arena, type) (type *)ReserveMemory(arena, sizeof(type))
+#define ReserveArrayMemory(arena, count, type) (type *)ReserveMemory(arena, (count) * sizeof(type))
+static void *ReserveMemory(memory_arena *arena, size_t size)
+{
+    // NOTE: Asset loads reserve memory from the background threads too.
+    u64 used = AtomicAddU64(&arena->used, size);
+    ASSERT(used + size <= arena->size)
+    void *result = arena->base + used;
+    return result;
+}
+
+struct asset_pack
+{
+    platform_mapped_file file;
+    hya_header *header;
+    hya_asset *assets;
+    u32 assetCount;
+};
+
+#define ASSET_BLOCK_USED 0x1
+struct asset_memory_block
+{
+    asset_memory_block *prev;
+    asset_memory_block *next;
+    u64 flags;
+    u64 size;
+};
+
+struct asset_cache;
+
+// NOTE:
+// Ambient occlusion, baked per distinct vertex (same position and normal) by
+// casting OCCLUSION_RAY_GRID^2 cosine weighted rays, stratified on a grid, over
+// the hemisphere around the normal against a BVH of the mesh. The factor is the
+// fraction of rays that get further than OCCLUSION_DISTANCE_SCALE times the
+// diagonal of the mesh's bounds, 1 is fully open. Vertices are independent of
+// each other, so BakeOcclusionRange can run on as many threads as there are.
+#define OCCLUSION_RAY_GRID 8
+#define OCCLUSION_DISTANCE_SCALE 0.2f
+#define OCCLUSION_BVH_LEAF_SIZE 4
+// NOTE: The median split halves the triangles at every level, so the tree is
+// at most 31 levels deep and the traversal stack never holds more than 32.
+#define OCCLUSION_BVH_MAX_DEPTH 64
+
+struct occlusion_bvh_node
+{
+    vec3 boundsMin;
+    vec3 boundsMax;
+    i32 first; // NOTE: Leaves: first of triangles. Inner nodes: the left child, the right one follows it.
+    i32 count; // NOTE: 0 for inner nodes
+};
+
+struct occlusion_bake
+{
+    vertex *vertices;
+    i32 nVertices;
+    vec3 *normals;   // NOTE: Unit, face normals where the mesh has none
+    i32 *triangles;  // NOTE: In BVH leaf order
+    occlusion_bvh_node *nodes;
+    i32 nodeCount;
+    i32 *distinctVertices; // NOTE: One vertex of each distinct vertex
+    i32 *vertexToDistinct;
+    i32 distinctCount;
+    f32 *distinctOcclusion;
+    f32 maxDistance;
+    f32 offset; // NOTE: Rays start this far off the surface
+};
+
+// NOTE: One slot per registered mesh or bitmap. Pack assets are views into the mapped pack,
+// loose assets live in a block of the cache's heap.
+struct asset_slot
+{
+    char name[HYA_NAME_LENGTH];
+    hya_asset *packAsset;
+    asset_cache *cache;
+    object *object;
+    loaded_bitmap *bitmap;
+
+    asset_memory_block *block;
+    platform_mapped_file mappedFile;
+    u64 residentSize;
+    u32 lastUsedFrame;
+    asset_slot *lruPrev;
+    asset_slot *lruNext;
+};
+
+struct asset_cache
+{
+    asset_pack pack;
+    debug_read_file *ReadFile;
+    debug_write_file *WriteFile;
+    debug_free_file *FreeFile;
+    platform_get_file_info *GetFileInfo;
+    platform_map_file *MapFile;
+    platform_unmap_file *UnmapFile;
+
+    // NOTE: The heap is shared with the loader threads.
+    ticket_mutex heapMutex;
+    asset_memory_block blockSentinel;
+
+    u64 budget;
+    u64 volatile residentSize;
+    u64 volatile loadsInFlight; // NOTE: Queued or running on the low priority queue
+    u32 frameIndex;
+
+    // NOTE: Loaded slots, most recently used first. Only touched by the main thread.
+    asset_slot lruSentinel;
+
+    u32 slotCount;
+    u32 maxSlotCount;
+    asset_slot *slots;
+};
+
+// NOTE:
+// Virtual textures are split into VT_PAGE_SIZE^2 pages per mip level and stay on
+// disk (a mapped HYV file). Only a fixed number of physical pages is resident,
+// so memory doesn't depend on the size of the texture:
+//      - the rasterizer looks pages up in a fixed size hash table and records the
+//        ones it misses in the feedback list, falling back to coarser levels
+//      - at the end of the frame UpdateVirtualTexture gives the requested pages
+//        the least recently used physical pages and queues the loads
+//      - a loader thread copies the page in and marks it resident
+// Levels that fit in a single page are pinned at load so there's always a fallback.
+#define VT_PAGE_SHIFT 7
+#define VT_PAGE_SIZE (1 << VT_PAGE_SHIFT)
+#define VT_MAX_FEEDBACK 1024
+#define VT_MAX_LOADS_PER_FRAME 32
+#define VT_KEY_EMPTY 0xFFFFFFFF
+#define VT_ENTRY_ASSIGNED 0x80000000
+
+enum virtual_page_state
+{
+    VIRTUAL_PAGE_FREE,
+    VIRTUAL_PAGE_LOADING,
+    VIRTUAL_PAGE_RESIDENT,
+    VIRTUAL_PAGE_PINNED
+};
+
+struct virtual_texture;
+struct virtual_page
+{
+    virtual_texture *texture;
+    u32 *texels;
+    u32 volatile state;
+    u32 key;
+    u32 lastUsedFrame;
+};
+
+// NOTE: value is VT_ENTRY_ASSIGNED | physical page index, or 0 while the page is
+// only requested. Entries are added by the rasterizer and removed by the main
+// thread at the end of the frame, never both at once.
+struct virtual_page_entry
+{
+    u32 volatile key;
+    u32 volatile value;
+};
+
+struct virtual_texture_level
+{
+    i32 width;
+    i32 height;
+    i32 pagesX;
+    i32 pagesY;
+    u64 firstPage;
+};
+
+struct virtual_texture
+{
+    platform_mapped_file file;
+    platform_evict_mapped_range *EvictMappedRange;
+    i32 width;
+    i32 height;
+    i32 levelCount;
+    virtual_texture_level levels[MAX_MIP_LEVELS];
+
+    u32 pageCount;
+    virtual_page *pages;
+    u32 tableMask;
+    virtual_page_entry *table;
+
+    u32 frameIndex;
+    u64 volatile feedbackCount;
+    u32 feedback[VT_MAX_FEEDBACK];
+};
+
+// NOTE: Sorting keys puts coarser levels first.
+inline u32 GetVirtualPageKey(i32 level, i32 pageX, i32 pageY)
+{
+    return ((u32)level << 26) | ((u32)pageY << 13) | (u32)pageX;
+}
+
+inline u32 HashVirtualPageKey(virtual_texture *texture, u32 key)
+{
+    return (key * 2654435761u) & texture->tableMask;
+}
+
+inline virtual_page_entry *FindVirtualPageEntry(virtual_texture *texture, u32 key)
+{
+    for (u32 i = HashVirtualPageKey(texture, key);; i = (i + 1) & texture->tableMask)
+    {
+        virtual_page_entry *entry = texture->table + i;
+        if (entry->key == key)
+            return entry;
+        if (entry->key == VT_KEY_EMPTY)
+            return 0;
+    }
+}
+
+// NOTE: Safe to call from several rasterizer threads.
+inline void RequestVirtualPage(virtual_texture *texture, u32 key)
+{
+    if (texture->feedbackCount >= VT_MAX_FEEDBACK)
+        return;
+    for (u32 i = HashVirtualPageKey(texture, key);; i = (i + 1) & texture->tableMask)
+    {
+        virtual_page_entry *entry = texture->table + i;
+        u32 found = entry->key;
+        if (found == VT_KEY_EMPTY)
+            found = AtomicCompareExchangeU32(&entry->key, key, VT_KEY_EMPTY);
+        if (found == VT_KEY_EMPTY)
+        {
+            u64 index = AtomicAddU64(&texture->feedbackCount, 1);
+            if (index < VT_MAX_FEEDBACK)
+                texture->feedback[index] = key;
+            return;
+        }
+        if (found == key)
+            return;
+    }
+}
+
+// NOTE:
+// Particles are kept as separate arrays per component (SoA) so the simulation
+// runs on 4 lanes at a time, 2 vectors per step. capacity is a multiple of
+// PARTICLE_BATCH_SIZE and count only grows: spawns reuse the oldest slot once the
+// arrays are full, dead particles (life <= 0) are skipped by the renderer.
+// Positions are in view space like objects.
+#define PARTICLE_STEP 8
+#define PARTICLE_BATCH_SIZE 4096
+#define PARTICLE_MAX_BATCHES 64
+
+struct particle_system;
+struct particle_update_work
+{
+    particle_system *system;
+    i32 first;
+    i32 end;
+    f32 dt;
+};
+
+struct particle_system
+{
+    i32 capacity;
+    i32 count;
+    i32 nextSpawn;
+    u32 randomState;
+
+    f32 *posX;
+    f32 *posY;
+    f32 *posZ;
+    f32 *velX;
+    f32 *velY;
+    f32 *velZ;
+    f32 *life;
+    u32 *color; // NOTE: Premultiplied 0xAARRGGBB
+
+    vec3 gravity;
+    f32 drag;     // NOTE: Fraction of the velocity lost per second
+    f32 size;     // NOTE: World space side of a splat
+    f32 fadeTime; // NOTE: Seconds before death a particle starts to fade out
+    f32 maxLife;  // NOTE: The longest life left, every particle is dead once it runs out
+
+    particle_update_work work[PARTICLE_MAX_BATCHES];
+};
+
+// NOTE:
+// The visibility buffer keeps, per pixel, which triangle of which draw is the
+// closest one: (draw index + 1) << VISIBILITY_TRIANGLE_BITS | triangle index,
+// 0 where nothing was drawn. Depth stays in the pixel buffer's zBuffer. Draws
+// keep their vertices in view space (normals rotated too) in the frame arena
+// so the shading pass can rebuild any triangle from its id.
+#define VISIBILITY_TRIANGLE_BITS 20
+#define VISIBILITY_TRIANGLE_MASK ((1 << VISIBILITY_TRIANGLE_BITS) - 1)
+#define VISIBILITY_MAX_DRAWS 256
+#define VISIBILITY_CACHE_SIZE 64
+#define VISIBILITY_MAX_BANDS 64
+#define VISIBILITY_BAND_HEIGHT 32
+
+struct visibility_draw
+{
+    shade_type shade;
+    loaded_bitmap *texture; // NOTE: Only set when the texture is loaded
+    lighting l;
+    vertex *vertices;
+    f32 *occlusion; // NOTE: The object's, per vertex, 0 if it has none
+    vec3 *colors; // NOTE: Gouraud only, lit per vertex while rasterizing
+};
+
+// NOTE:
+// The part of a DrawObjectMultiView draw that every view shares, done once:
+// positions in view space (after the vertex shader) and the colors. Smooth
+// draws have a color per vertex, the rest one per triangle, at i / 3.
+struct multi_view_draw
+{
+    object *o;
+    vec3 *positions;
+    vec3 *colors;
+    loaded_bitmap *texture; // NOTE: Only set when the texture is loaded
+    bool isSmooth;
+    bool isSolid; // NOTE: Culled the other way round, like DrawObjectSolid
+};
+
+struct multi_view_work
+{
+    multi_view_draw *draw;
+    render_view *view;
+};
+
+// NOTE: What the shading pass needs of one triangle, set up once per cache miss.
+// 1/z and the barycentrics times 1/z are linear in normalized screen
+// coordinates r = (x, y, 1): z = d / (r * n), b1 = (r * m1) / (r * n),
+// b2 = (r * m2) / (r * n).
+struct visibility_triangle
+{
+    u32 id;
+    visibility_draw *draw;
+    vertex v[3];
+    vec3 n;
+    vec3 m1;
+    vec3 m2;
+    f32 d;
+    u32 flatColor;
+    __m128i shade;
+    texture_sampler sampler;
+};
+
+struct visibility_buffer;
+struct visibility_shade_work
+{
+    visibility_buffer *vb;
+    pixel_buffer *pb;
+    screen_transformer *st;
+    i32 yStart;
+    i32 yEnd;
+};
+
+struct visibility_buffer
+{
+    i32 width;
+    i32 height;
+    u32 *ids;
+    i32 drawCount;
+    visibility_draw draws[VISIBILITY_MAX_DRAWS];
+    visibility_shade_work work[VISIBILITY_MAX_BANDS];
+};
+
+// NOTE:
+// Depth of the casters as the directional light sees them, drawn by
+// RenderShadowMap with the depth only rasterizer. Light space looks down the
+// light direction from 20 radii behind the casters' bounding sphere, far enough
+// for the perspective to be close to parallel, with x and y scaled so the
+// sphere fills the map. axisX, axisY, axisZ are the light space
+// axes in view space (x and y with that scale in them).
+// The map is only drawn again when the light or one of the casters changed.
+#define SHADOW_MAP_SIZE 512
+#define SHADOW_MAX_CASTERS 16
+
+struct shadow_caster_state
+{
+    object *o;
+    u32 loadState;
+    orientation orientation;
+    vec3 pos;
+};
+
+struct shadow_map
+{
+    pixel_buffer depth; // NOTE: Only the zBuffer
+    screen_transformer st;
+    vec3 origin;
+    vec3 axisX;
+    vec3 axisY;
+    vec3 axisZ;
+    f32 bias; // NOTE: Relative to the light space depth
+
+    vec3 lightDirection;
+    i32 casterCount;
+    shadow_caster_state casters[SHADOW_MAX_CASTERS];
+    bool isValid;
+    u32 renderCount;
+};
+
+// NOTE:
+// The Gouraud colors of one object, one per vertex, and everything they were
+// lit with. While the key stays the same the colors are used as they are, so
+// an object nobody moved isn't lit again. A different key relights the
+// vertices of the triangles drawn with it (see UseVertexLightingCache).
+struct vertex_lighting_key
+{
+    vertex *vertices;
+    i32 nVertices;
+    mat3 rotation;
+    vec3 translation;
+    diffuse d;
+    u32 shadowVersion;
+    ambient a;
+    material m;
+    light_grid *grid;
+    u32 lightsVersion;
+};
+
+struct vertex_lighting_cache
+{
+    memory_arena *arena;
+    vec3 *colors;
+    i32 capacity;
+    bool isValid;
+    vertex_lighting_key key;
+};
+
+// NOTE:
+// A far object drawn as a sprite. RenderImpostor draws it flat shaded into a
+// small color and depth image, looking from the eye straight at the center of
+// its bounds, with x and y scaled so the bounding sphere fills the image. The
+// image is drawn every frame where the sphere is now, scaled to its size.
+// It is only rendered again when the direction the object is seen or lit from
+// (in object space, so turning it counts) moves past IMPOSTOR_MIN_COS, its
+// distance changes by more than IMPOSTOR_MAX_DISTANCE_CHANGE, the ambient by
+// more than IMPOSTOR_MAX_AMBIENT_CHANGE, or the key does.
+#define IMPOSTOR_DISTANCE 15.0f
+#define IMPOSTOR_MAX_SIZE 128
+#define IMPOSTOR_MIN_COS 0.9986f // NOTE: About 3 degrees
+#define IMPOSTOR_MAX_DISTANCE_CHANGE 0.1f
+#define IMPOSTOR_MAX_AMBIENT_CHANGE (1.0f / 255.0f) // NOTE: Folded point lights move it a little every frame
+
+struct impostor_key
+{
+    vertex *vertices;
+    i32 nVertices;
+    f32 *occlusion;
+    material mat;
+    vec3 intensity;
+    loaded_bitmap *texture;
+    u32 *texturePixels;
+    texture_filter textureFilter;
+};
+
+struct impostor
+{
+    pixel_buffer image; // NOTE: Color and depth along axisZ, FLT_MAX where the object isn't
+    vec3 axisX;
+    vec3 axisY;
+    vec3 axisZ;
+    f32 distance; // NOTE: From the eye to the center of the bounds
+    f32 extent;   // NOTE: Half the side of the image at depth 1
+
+    vec3 viewDirection;  // NOTE: Object space
+    vec3 lightDirection; // NOTE: Object space
+    ambient a;
+    bool isValid;
+    impostor_key key;
+    u32 renderCount;
 };
 
 enum KEYBOARD_BUTTON
@@ -95,6 +627,7 @@ enum KEYBOARD_BUTTON
     L,
     U,
     O,
+    P,
     SHIFT,
     CTRL,
     ALT,
@@ -169,9 +702,59 @@ struct engine_input
     keyboard keyboard;
 };
 
+// NOTE: The stereo pair is drawn side by side, each eye into half the width,
+// STEREO_EYE_SEPARATION apart and looking straight ahead.
+#define STEREO_EYE_SEPARATION 0.2f
+
+// NOTE: The crowd is a CROWD_SIDE by CROWD_SIDE grid of copies of the current
+// object, standing behind it and turned with it, drawn with DrawObjectInstanced.
+#define CROWD_SIDE 32
+
+// NOTE:
+// What a frame is drawn from. Versions and pointers stand in for what they
+// point to: the light grid and the shadow map bump theirs whenever they
+// change, assets change theirs when they (un)load. Compared with memcmp, so
+// they are cleared before they are filled.
+struct frame_view
+{
+    void *pixels;
+    i16 width;
+    i16 height;
+    screen_transformer st;
+    bool isVisibilityBufferOn;
+    bool isDepthPrepassOn;
+    bool isAnimated; // NOTE: Particles or sprites are drawn
+    bool isCrowdOn;
+    bool isStereoOn;
+    u32 *background; // NOTE: 0 until it has loaded, and in stereo
+};
+
+struct frame_key
+{
+    diffuse d;
+    u32 shadowVersion;
+    ambient a;
+    u32 lightsVersion;
+    shade_type shade;
+
+    object *object;
+    u32 loadState;
+    vertex *vertices;
+    i32 nVertices;
+    material mat;
+    orientation orientation;
+    vec3 pos;
+    loaded_bitmap *texture;
+    u32 textureLoadState;
+    u32 *texturePixels;
+    texture_filter textureFilter;
+};
+
 struct engine_state
 {
     memory_arena memoryArena;
+    memory_arena frameArena; // NOTE: Transient memory, emptied every frame
+    asset_cache assets;
 
     object bunny;
     object monkey;
@@ -179,17 +762,61 @@ struct engine_state
     object bunnyTextured;
     object cruiser;
     object f16;
+    object terrain;
     loaded_bitmap bunnyTexture;
     loaded_bitmap cruiserTexture;
     loaded_bitmap f16Tex;
     loaded_bitmap background;
+    loaded_bitmap terrainBitmap;
+    virtual_texture terrainTexture;
+    sprite_batch sprites;
+    loaded_bitmap logo;
+    bool isLogoRingOn;
+    bool wasLogoKeyPressed;
+    f32 logoRingAngle;
+    particle_system particles;
+    bool isEmittingParticles;
+    bool wasParticleKeyPressed;
+    bool isPerPixelLighting;
+    bool wasLightingKeyPressed;
+    visibility_buffer visibility;
+    bool isVisibilityBufferOn;
+    bool wasVisibilityKeyPressed;
+    bool isDepthPrepassOn;
+    bool wasPrepassKeyPressed;
+    shadow_map shadowMap;
+    vertex_lighting_cache lightingCaches[7];
+    impostor impostors[7];
+    sh9 environmentSH;
+    bool isEnvironmentProjected;
+    bool isSHLightingOn;
+    bool wasSHKeyPressed;
+    bool isShadowOn;
+    bool wasShadowKeyPressed;
 
     object *curObject;
     orientation orientation;
+    bool wasFilterKeyPressed;
 
     diffuse diffuse;
     ambient ambient;
-    point_light pointLight;
+    point_light pointLights[MAX_POINT_LIGHTS];
+    i32 pointLightCount;
+    light_grid lightGrid;
+    f32 lightRingAngle;
+    bool isLightRingOn;
+    bool wasLightRingKeyPressed;
+    instance_data crowd[CROWD_SIDE * CROWD_SIDE];
+    bool isCrowdOn;
+    bool wasCrowdKeyPressed;
+    bool isStereoOn;
+    bool wasStereoKeyPressed;
+
+    frame_view lastView;
+    frame_key lastFrame;
+    screen_rect lastObjectRect;
+    bool isLastFrameValid;
+    bool isTerrainStreaming;
 };
 
 struct hy3d_engine
@@ -199,6 +826,7 @@ struct hy3d_engine
     space3d space;
     screen_transformer screenTransformer;
     std::chrono::steady_clock::time_point frameStart;
+    screen_rect presentRect; // NOTE: What changed this frame, the platform only presents that
 
     void InitializePixelBuffer(void *pixelBufferMemory, f32 *zBufferMemory, i16 width, i16 height, i8 bytesPerPixel, i32 bufferSize)
     {
@@ -16,6 +16,20 @@ inline f32 maxF32(f32 a, f32 b)
     return b;
 }
 
+inline i32 minInt(i32 a, i32 b)
+{
+    if (a <= b)
+        return a;
+    return b;
+}
+
+inline i32 maxInt(i32 a, i32 b)
+{
+    if (a >= b)
+        return a;
+    return b;
+}
+
 inline f32 Squared(f32 n)
 {
     return n * n;
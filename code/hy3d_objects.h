@@ -23,15 +23,31 @@ struct mesh
     triangle_index *indices;
 };
 
+struct vertex_lighting_cache;
+struct impostor;
 struct object
 {
+    asset_slot *slot;
+    u32 volatile loadState;
+    vec3 boundsMin;
+    vec3 boundsMax;
     vertex *vertices;
     i32 nVertices;
     bool hasNormals;
+    f32 *occlusion; // NOTE: Optional, baked ambient occlusion per vertex (see occlusion_bake)
     loaded_bitmap *texture;
     material mat;
     orientation orientation;
     vec3 pos;
+    vertex_lighting_cache *lightingCache; // NOTE: Optional, keeps the Gouraud colors between frames
+    impostor *impostor; // NOTE: Optional, drawn instead of the mesh from IMPOSTOR_DISTANCE on
+};
+
+// NOTE: One copy of an object for DrawObjectInstanced.
+struct instance_data
+{
+    vec3 pos;
+    orientation orientation;
 };
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ //
@@ -0,0 +1,369 @@
+// NOTE:
+// Offline asset packer. Run it inside the data folder:
+//      hy3d_packer [-layout linear|tiled4|tiled8|morton|bc1] [-texture name.bmp layout]... [output.hya]
+// Every .obj and .bmp in the folder is converted to the format the engine uses
+// at runtime and written into a single HYA file (see hy3d_asset_pack.h).
+// Textures are stored in 4x4 tiles unless another layout is given. -texture
+// overrides the layout of one texture, the engine uses whatever the pack holds.
+//      hy3d_packer -virtual source.bmp output.hyv
+// builds a virtual texture (see hy3d_asset_pack.h) instead.
+#include "hy3d_engine.h"
+#include "hy3d_assets.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <io.h>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+static DEBUG_READ_FILE(PackerReadFile)
+{
+    debug_read_file_result result = {};
+    FILE *file = fopen(filename, "rb");
+    if (file)
+    {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (size > 0)
+        {
+            result.content = malloc(size);
+            if (result.content && fread(result.content, 1, size, file) == (size_t)size)
+            {
+                result.size = (u32)size;
+            }
+            else
+            {
+                free(result.content);
+                result = {};
+            }
+        }
+        fclose(file);
+    }
+    return result;
+}
+
+struct packer_source
+{
+    std::string filename;
+    hya_asset_type type;
+};
+
+struct packer_layout_override
+{
+    std::string filename;
+    texture_layout layout;
+};
+
+static void FindSources(std::vector<packer_source> &sources, char *pattern, hya_asset_type type)
+{
+    _finddata_t data;
+    intptr_t handle = _findfirst(pattern, &data);
+    if (handle == -1)
+        return;
+    do
+    {
+        if (strlen(data.name) < HYA_NAME_LENGTH)
+            sources.push_back({data.name, type});
+        else
+            printf("skipping %s: name is longer than %d characters\n", data.name, HYA_NAME_LENGTH - 1);
+    } while (_findnext(handle, &data) == 0);
+    _findclose(handle);
+}
+
+static u64 WritePadding(FILE *out, u64 offset)
+{
+    static u8 zeros[HYA_DATA_ALIGNMENT] = {};
+    u64 aligned = (offset + HYA_DATA_ALIGNMENT - 1) & ~((u64)HYA_DATA_ALIGNMENT - 1);
+    fwrite(zeros, 1, (size_t)(aligned - offset), out);
+    return aligned;
+}
+
+static bool PackBitmap(hya_asset *asset, packer_source *source, texture_layout layout, FILE *out, u64 *offset)
+{
+    debug_read_file_result file = PackerReadFile((char *)source->filename.c_str());
+    bitmap_import_info info;
+    if (!GetBitmapImportInfo(file, &info))
+    {
+        printf("skipping %s: only 24 and 32 bit uncompressed bitmaps are supported\n", source->filename.c_str());
+        free(file.content);
+        return false;
+    }
+
+    i32 mipCount;
+    u64 texelsSize = GetMipChainTexelCount(info.width, info.height, layout, &mipCount) * sizeof(u32);
+    u64 linearSize = GetMipChainTexelCount(info.width, info.height, TEXTURE_LAYOUT_LINEAR, &mipCount) * sizeof(u32);
+    u32 *texels = (u32 *)calloc(1, (size_t)texelsSize);
+    u32 *linear = (layout == TEXTURE_LAYOUT_LINEAR) ? texels : (u32 *)malloc((size_t)linearSize);
+    bool isOpaque = ImportBitmap(&info, linear);
+    free(file.content);
+
+    loaded_bitmap bmp = {};
+    SetMipChain(&bmp, texels, info.width, info.height, mipCount, layout);
+    BuildMipChain(&bmp, linear);
+    if (linear != texels)
+        free(linear);
+
+    asset->bitmap.width = info.width;
+    asset->bitmap.height = info.height;
+    asset->bitmap.mipCount = mipCount;
+    asset->bitmap.layout = layout;
+    asset->bitmap.isOpaque = isOpaque;
+    asset->dataSize = texelsSize;
+    asset->dataOffset = *offset;
+    fwrite(texels, 1, (size_t)asset->dataSize, out);
+    *offset += asset->dataSize;
+    free(texels);
+    return true;
+}
+
+#define OCCLUSION_BAKE_CHUNK 256
+
+// NOTE: Threads take OCCLUSION_BAKE_CHUNK distinct vertices at a time until none are left.
+static void BakeOcclusionChunks(occlusion_bake *bake, std::atomic<i32> *nextChunk)
+{
+    for (;;)
+    {
+        i32 first = nextChunk->fetch_add(1) * OCCLUSION_BAKE_CHUNK;
+        if (first >= bake->distinctCount)
+            break;
+        BakeOcclusionRange(bake, first, minInt(first + OCCLUSION_BAKE_CHUNK, bake->distinctCount));
+    }
+}
+
+// NOTE: Bakes on every core, the packer has nothing else to do meanwhile.
+static void BakeOcclusion(object *obj, memory_arena *arena, f32 *occlusion)
+{
+    occlusion_bake bake;
+    BeginOcclusionBake(&bake, arena, obj->vertices, obj->nVertices, obj->hasNormals);
+
+    std::atomic<i32> nextChunk(0);
+    i32 threadCount = maxInt((i32)std::thread::hardware_concurrency(), 1);
+    std::vector<std::thread> threads;
+    for (i32 i = 1; i < threadCount; i++)
+        threads.emplace_back(BakeOcclusionChunks, &bake, &nextChunk);
+    BakeOcclusionChunks(&bake, &nextChunk);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    EndOcclusionBake(&bake, occlusion);
+}
+
+static bool PackMesh(hya_asset *asset, packer_source *source, memory_arena *arena, FILE *out, u64 *offset)
+{
+    object obj = {};
+    arena->used = 0;
+    if (!LoadOBJ(source->filename, arena, &obj, 0, {}, {}) || obj.nVertices == 0)
+        return false;
+
+    vec3 boundsMin = obj.vertices[0].pos;
+    vec3 boundsMax = obj.vertices[0].pos;
+    for (i32 i = 1; i < obj.nVertices; i++)
+    {
+        vec3 p = obj.vertices[i].pos;
+        boundsMin = {minF32(boundsMin.x, p.x), minF32(boundsMin.y, p.y), minF32(boundsMin.z, p.z)};
+        boundsMax = {maxF32(boundsMax.x, p.x), maxF32(boundsMax.y, p.y), maxF32(boundsMax.z, p.z)};
+    }
+
+    auto bakeStart = std::chrono::steady_clock::now();
+    f32 *occlusion = ReserveArrayMemory(arena, obj.nVertices, f32);
+    BakeOcclusion(&obj, arena, occlusion);
+    f64 bakeTime = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - bakeStart).count();
+    printf("%s: baked ambient occlusion for %d vertices in %.1f ms\n", source->filename.c_str(), obj.nVertices, bakeTime);
+
+    asset->mesh.nVertices = (u32)obj.nVertices;
+    asset->mesh.hasNormals = obj.hasNormals;
+    asset->mesh.hasOcclusion = true;
+    for (i32 i = 0; i < 3; i++)
+    {
+        asset->mesh.boundsMin[i] = boundsMin.pos[i];
+        asset->mesh.boundsMax[i] = boundsMax.pos[i];
+    }
+    u64 verticesSize = (u64)obj.nVertices * sizeof(vertex);
+    u64 occlusionSize = (u64)obj.nVertices * sizeof(f32);
+    asset->dataSize = verticesSize + occlusionSize;
+    asset->dataOffset = *offset;
+    fwrite(obj.vertices, 1, (size_t)verticesSize, out);
+    fwrite(occlusion, 1, (size_t)occlusionSize, out);
+    *offset += asset->dataSize;
+    return true;
+}
+
+static bool PackVirtualTexture(char *sourceName, char *outputName)
+{
+    debug_read_file_result file = PackerReadFile(sourceName);
+    bitmap_import_info info;
+    if (!GetBitmapImportInfo(file, &info))
+    {
+        printf("%s: only 24 and 32 bit uncompressed bitmaps are supported\n", sourceName);
+        free(file.content);
+        return false;
+    }
+
+    i32 mipCount;
+    u64 texelsSize = GetMipChainTexelCount(info.width, info.height, TEXTURE_LAYOUT_LINEAR, &mipCount) * sizeof(u32);
+    u32 *texels = (u32 *)malloc((size_t)texelsSize);
+    ImportBitmap(&info, texels);
+    free(file.content);
+    loaded_bitmap bmp = {};
+    SetMipChain(&bmp, texels, info.width, info.height, mipCount, TEXTURE_LAYOUT_LINEAR);
+    GenerateMipChain(&bmp);
+
+    FILE *out = fopen(outputName, "wb");
+    if (!out)
+    {
+        printf("could not open %s for writing\n", outputName);
+        free(texels);
+        return false;
+    }
+
+    static virtual_texture texture;
+    u64 pageCount = InitializeVirtualTextureLevels(&texture, info.width, info.height);
+    hyv_header header = {};
+    header.magicValue = HYV_MAGIC_VALUE;
+    header.version = HYV_VERSION;
+    header.width = info.width;
+    header.height = info.height;
+    header.levelCount = texture.levelCount;
+    header.pageSize = VT_PAGE_SIZE;
+    fwrite(&header, sizeof(header), 1, out);
+    WritePadding(out, sizeof(header));
+
+    // NOTE: Edge pages repeat the last row / column.
+    u32 *page = (u32 *)malloc(VT_PAGE_SIZE * VT_PAGE_SIZE * sizeof(u32));
+    for (i32 level = 0; level < texture.levelCount; level++)
+    {
+        bitmap_mip *mip = bmp.mips + level;
+        virtual_texture_level *l = texture.levels + level;
+        for (i32 pageY = 0; pageY < l->pagesY; pageY++)
+        {
+            for (i32 pageX = 0; pageX < l->pagesX; pageX++)
+            {
+                for (i32 y = 0; y < VT_PAGE_SIZE; y++)
+                {
+                    i32 sourceY = minInt(pageY * VT_PAGE_SIZE + y, mip->height - 1);
+                    for (i32 x = 0; x < VT_PAGE_SIZE; x++)
+                    {
+                        i32 sourceX = minInt(pageX * VT_PAGE_SIZE + x, mip->width - 1);
+                        page[y * VT_PAGE_SIZE + x] = mip->pixels[(u64)sourceY * mip->width + sourceX];
+                    }
+                }
+                fwrite(page, sizeof(u32), VT_PAGE_SIZE * VT_PAGE_SIZE, out);
+            }
+        }
+    }
+    fclose(out);
+    free(page);
+    free(texels);
+    printf("%s: %dx%d, %d levels, %llu pages\n", outputName, info.width, info.height, texture.levelCount, pageCount);
+    return true;
+}
+
+static char *layoutNames[TEXTURE_LAYOUT_COUNT] = {"linear", "tiled4", "tiled8", "morton", "bc1", "virtual"};
+
+// NOTE: TEXTURE_LAYOUT_VIRTUAL for a name that is not a packable layout.
+static texture_layout ParseLayout(char *name)
+{
+    i32 l = 0;
+    while (l < TEXTURE_LAYOUT_VIRTUAL && strcmp(name, layoutNames[l]) != 0)
+        l++;
+    if (l == TEXTURE_LAYOUT_VIRTUAL)
+        printf("unknown layout %s\n", name);
+    return (texture_layout)l;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "-virtual") == 0)
+        return PackVirtualTexture(argv[2], argv[3]) ? 0 : 1;
+
+    char *outputName = "hy3d.hya";
+    texture_layout layout = TEXTURE_LAYOUT_TILED_4X4;
+    std::vector<packer_layout_override> overrides;
+    for (i32 i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-layout") == 0 && i + 1 < argc)
+        {
+            i++;
+            layout = ParseLayout(argv[i]);
+            if (layout == TEXTURE_LAYOUT_VIRTUAL)
+                return 1;
+        }
+        else if (strcmp(argv[i], "-texture") == 0 && i + 2 < argc)
+        {
+            packer_layout_override o = {argv[i + 1], ParseLayout(argv[i + 2])};
+            if (o.layout == TEXTURE_LAYOUT_VIRTUAL)
+                return 1;
+            overrides.push_back(o);
+            i += 2;
+        }
+        else
+        {
+            outputName = argv[i];
+        }
+    }
+
+    std::vector<packer_source> sources;
+    FindSources(sources, "*.obj", HYA_ASSET_MESH);
+    FindSources(sources, "*.bmp", HYA_ASSET_BITMAP);
+    std::sort(sources.begin(), sources.end(),
+              [](const packer_source &a, const packer_source &b) { return a.filename < b.filename; });
+
+    FILE *out = fopen(outputName, "wb");
+    if (!out)
+    {
+        printf("could not open %s for writing\n", outputName);
+        return 1;
+    }
+
+    memory_arena arena;
+    size_t arenaSize = MEGABYTES(256);
+    InitializeMemoryArena(&arena, (u8 *)malloc(arenaSize), arenaSize);
+
+    hya_header header = {};
+    header.magicValue = HYA_MAGIC_VALUE;
+    header.version = HYA_VERSION;
+    fwrite(&header, sizeof(header), 1, out);
+    u64 offset = sizeof(header);
+
+    std::vector<hya_asset> toc;
+    for (packer_source &source : sources)
+    {
+        offset = WritePadding(out, offset);
+
+        hya_asset asset = {};
+        strncpy(asset.name, source.filename.c_str(), HYA_NAME_LENGTH - 1);
+        asset.type = source.type;
+
+        texture_layout sourceLayout = layout;
+        for (packer_layout_override &o : overrides)
+        {
+            if (o.filename == source.filename)
+                sourceLayout = o.layout;
+        }
+
+        bool packed = (source.type == HYA_ASSET_MESH)
+                          ? PackMesh(&asset, &source, &arena, out, &offset)
+                          : PackBitmap(&asset, &source, sourceLayout, out, &offset);
+        if (packed)
+        {
+            toc.push_back(asset);
+            if (source.type == HYA_ASSET_BITMAP)
+                printf("packed %-24s %10llu bytes %s\n", asset.name, asset.dataSize, layoutNames[sourceLayout]);
+            else
+                printf("packed %-24s %10llu bytes\n", asset.name, asset.dataSize);
+        }
+    }
+
+    offset = WritePadding(out, offset);
+    header.assetCount = (u32)toc.size();
+    header.tocOffset = offset;
+    fwrite(toc.data(), sizeof(hya_asset), toc.size(), out);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fclose(out);
+
+    printf("%s: %u assets, %s textures\n", outputName, header.assetCount, layoutNames[layout]);
+    return 0;
+}
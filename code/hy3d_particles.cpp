@@ -0,0 +1,214 @@
+#include "hy3d_engine.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Particles
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline u32 NextRandom(u32 *state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// NOTE: -1 to 1
+static inline f32 RandomBilateral(u32 *state)
+{
+    return (f32)(NextRandom(state) >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+static void InitializeParticleSystem(particle_system *system, memory_arena *arena, i32 capacity)
+{
+    capacity = (capacity + PARTICLE_BATCH_SIZE - 1) & ~(PARTICLE_BATCH_SIZE - 1);
+    capacity = minInt(capacity, PARTICLE_BATCH_SIZE * PARTICLE_MAX_BATCHES);
+    *system = {};
+    system->capacity = capacity;
+    system->randomState = 0x2545F491;
+    system->posX = ReserveArrayMemory(arena, capacity, f32);
+    system->posY = ReserveArrayMemory(arena, capacity, f32);
+    system->posZ = ReserveArrayMemory(arena, capacity, f32);
+    system->velX = ReserveArrayMemory(arena, capacity, f32);
+    system->velY = ReserveArrayMemory(arena, capacity, f32);
+    system->velZ = ReserveArrayMemory(arena, capacity, f32);
+    system->life = ReserveArrayMemory(arena, capacity, f32);
+    system->color = ReserveArrayMemory(arena, capacity, u32);
+    for (i32 i = 0; i < capacity; i++)
+        system->life[i] = 0.0f;
+
+    system->gravity = {0.0f, -2.0f, 0.0f};
+    system->drag = 0.5f;
+    system->size = 0.02f;
+    system->fadeTime = 0.5f;
+}
+
+// NOTE: Velocities are spread by up to spread on every axis, lifetimes by up to half.
+static void SpawnParticles(particle_system *system, i32 count, vec3 pos, vec3 velocity,
+                           f32 spread, f32 life, u32 color)
+{
+    u32 *random = &system->randomState;
+    for (i32 i = 0; i < count; i++)
+    {
+        i32 index = system->nextSpawn;
+        system->nextSpawn = (index + 1 == system->capacity) ? 0 : index + 1;
+        system->count = maxInt(system->count, index + 1);
+
+        system->posX[index] = pos.x;
+        system->posY[index] = pos.y;
+        system->posZ[index] = pos.z;
+        system->velX[index] = velocity.x + spread * RandomBilateral(random);
+        system->velY[index] = velocity.y + spread * RandomBilateral(random);
+        system->velZ[index] = velocity.z + spread * RandomBilateral(random);
+        system->life[index] = life * (0.75f + 0.25f * RandomBilateral(random));
+        system->maxLife = maxF32(system->maxLife, system->life[index]);
+        system->color[index] = color;
+    }
+}
+
+// NOTE: first and end are multiples of PARTICLE_STEP. Dead particles are
+// integrated too, it is cheaper than branching on them.
+static void UpdateParticleRange(particle_system *system, i32 first, i32 end, f32 dt)
+{
+    __m128 dt4 = _mm_set1_ps(dt);
+    __m128 damping = _mm_set1_ps(maxF32(1.0f - system->drag * dt, 0.0f));
+    __m128 gravityX = _mm_set1_ps(system->gravity.x * dt);
+    __m128 gravityY = _mm_set1_ps(system->gravity.y * dt);
+    __m128 gravityZ = _mm_set1_ps(system->gravity.z * dt);
+    for (i32 i = first; i < end; i += PARTICLE_STEP)
+    {
+        for (i32 lane = i; lane < i + PARTICLE_STEP; lane += 4)
+        {
+            __m128 velX = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(system->velX + lane), gravityX), damping);
+            __m128 velY = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(system->velY + lane), gravityY), damping);
+            __m128 velZ = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(system->velZ + lane), gravityZ), damping);
+            _mm_storeu_ps(system->velX + lane, velX);
+            _mm_storeu_ps(system->velY + lane, velY);
+            _mm_storeu_ps(system->velZ + lane, velZ);
+            _mm_storeu_ps(system->posX + lane, _mm_add_ps(_mm_loadu_ps(system->posX + lane), _mm_mul_ps(velX, dt4)));
+            _mm_storeu_ps(system->posY + lane, _mm_add_ps(_mm_loadu_ps(system->posY + lane), _mm_mul_ps(velY, dt4)));
+            _mm_storeu_ps(system->posZ + lane, _mm_add_ps(_mm_loadu_ps(system->posZ + lane), _mm_mul_ps(velZ, dt4)));
+            _mm_storeu_ps(system->life + lane, _mm_sub_ps(_mm_loadu_ps(system->life + lane), dt4));
+        }
+    }
+}
+
+static PLATFORM_WORK_QUEUE_CALLBACK(UpdateParticlesWork)
+{
+    particle_update_work *work = (particle_update_work *)data;
+    UpdateParticleRange(work->system, work->first, work->end, work->dt);
+}
+
+// NOTE: Every PARTICLE_BATCH_SIZE particles go to the high priority queue as one
+// entry and the main thread helps until all of them are done. Once every
+// particle is dead the system is emptied, so idle frames cost nothing.
+static void UpdateParticles(particle_system *system, engine_memory *memory, f32 dt)
+{
+    system->maxLife -= dt;
+    if (system->maxLife <= 0.0f)
+    {
+        system->maxLife = 0.0f;
+        system->count = 0;
+        system->nextSpawn = 0;
+        return;
+    }
+
+    i32 end = (system->count + PARTICLE_STEP - 1) & ~(PARTICLE_STEP - 1);
+    if (end <= PARTICLE_BATCH_SIZE)
+    {
+        UpdateParticleRange(system, 0, end, dt);
+        return;
+    }
+
+    i32 batchCount = 0;
+    for (i32 first = 0; first < end; first += PARTICLE_BATCH_SIZE)
+    {
+        particle_update_work *work = system->work + batchCount++;
+        work->system = system;
+        work->first = first;
+        work->end = minInt(first + PARTICLE_BATCH_SIZE, end);
+        work->dt = dt;
+        memory->PlatformAddWorkEntry(memory->highPriorityQueue, UpdateParticlesWork, work);
+    }
+    memory->PlatformCompleteAllWork(memory->highPriorityQueue);
+}
+
+// NOTE:
+// A square of at most 4x4 pixels, blended one row per call like DrawSprite.
+// Pixels behind the zBuffer are left alone and the zBuffer isn't written, so
+// particles never hide each other.
+static void SplatParticle(pixel_buffer *pixelBuffer, i32 x0, i32 y0, i32 side, f32 z, u32 color, __m128i opacity)
+{
+    for (i32 y = maxInt(y0, 0); y < minInt(y0 + side, pixelBuffer->height); y++)
+    {
+        u32 *dest = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
+        f32 *zBuffer = pixelBuffer->zBuffer + y * pixelBuffer->width;
+        u32 texels[4] = {};
+        u32 pixels[4] = {};
+        for (i32 i = 0; i < side; i++)
+        {
+            i32 x = x0 + i;
+            if (x >= 0 && x < pixelBuffer->width && z < zBuffer[x])
+            {
+                texels[i] = color;
+                pixels[i] = dest[x];
+            }
+        }
+        __m128i blended = BlendPremultiplied4(_mm_loadu_si128((__m128i *)texels),
+                                              _mm_loadu_si128((__m128i *)pixels), opacity);
+        _mm_storeu_si128((__m128i *)pixels, blended);
+        for (i32 i = 0; i < side; i++)
+        {
+            if (texels[i])
+                dest[x0 + i] = pixels[i];
+        }
+    }
+}
+
+// NOTE: Projected 4 at a time the same way TransformVertexToScreen does it.
+// The splat side is the particle size in pixels, from 1 to 4.
+static void DrawParticles(particle_system *system, pixel_buffer *pixelBuffer, screen_transformer *st)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 nearZ = _mm_set1_ps(0.1f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 xFactor = _mm_set1_ps(st->xFactor);
+    __m128 yFactor = _mm_set1_ps(st->yFactor);
+    __m128 sideFactor = _mm_set1_ps(system->size * st->xFactor);
+    __m128 fadeScale = _mm_set1_ps(256.0f / system->fadeTime);
+    for (i32 i = 0; i < system->count; i += 4)
+    {
+        __m128 life = _mm_loadu_ps(system->life + i);
+        __m128 z = _mm_loadu_ps(system->posZ + i);
+        __m128 isVisible = _mm_and_ps(_mm_cmpgt_ps(life, zero), _mm_cmpgt_ps(z, nearZ));
+        i32 visibleMask = _mm_movemask_ps(isVisible);
+        if (visibleMask == 0)
+            continue;
+
+        __m128 zInv = _mm_div_ps(one, _mm_max_ps(z, nearZ));
+        __m128 side = _mm_min_ps(_mm_max_ps(_mm_mul_ps(sideFactor, zInv), one), _mm_set1_ps(4.0f));
+        __m128 halfSide = _mm_mul_ps(side, _mm_set1_ps(0.5f));
+        __m128 x = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(system->posX + i), zInv), one), xFactor), halfSide);
+        __m128 y = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(system->posY + i), zInv), one), yFactor), halfSide);
+        __m128 fade = _mm_min_ps(_mm_mul_ps(life, fadeScale), _mm_set1_ps(256.0f));
+
+        i32 xs[4];
+        i32 ys[4];
+        i32 sides[4];
+        i32 opacities[4];
+        f32 zs[4];
+        _mm_storeu_si128((__m128i *)xs, _mm_cvtps_epi32(_mm_floor_ps(x)));
+        _mm_storeu_si128((__m128i *)ys, _mm_cvtps_epi32(_mm_floor_ps(y)));
+        _mm_storeu_si128((__m128i *)sides, _mm_cvtps_epi32(side));
+        _mm_storeu_si128((__m128i *)opacities, _mm_cvttps_epi32(fade));
+        _mm_storeu_ps(zs, z);
+        for (i32 lane = 0; lane < 4 && i + lane < system->count; lane++)
+        {
+            if (visibleMask & (1 << lane))
+            {
+                SplatParticle(pixelBuffer, xs[lane], ys[lane], sides[lane], zs[lane],
+                              system->color[i + lane], _mm_set1_epi16((i16)opacities[lane]));
+            }
+        }
+    }
+}
@@ -1,5 +1,6 @@
 #include "hy3d_renderer.h"
 #include "stdlib.h"
+#include <algorithm>
 
 static void PutPixel(pixel_buffer *pixelBuffer, i16 x, i16 y, color c)
 {
@@ -40,14 +41,53 @@ static void ClearZBuffer(pixel_buffer *pixelBuffer)
         pixelBuffer->zBuffer[i] = FLT_MAX;
 }
 
+static inline bool IsEmptyRect(screen_rect r)
+{
+    return r.minX >= r.maxX || r.minY >= r.maxY;
+}
+
+static inline screen_rect UnionRect(screen_rect a, screen_rect b)
+{
+    if (IsEmptyRect(a))
+        return b;
+    if (IsEmptyRect(b))
+        return a;
+    return {minInt(a.minX, b.minX), minInt(a.minY, b.minY), maxInt(a.maxX, b.maxX), maxInt(a.maxY, b.maxY)};
+}
+
+// NOTE: Black with an empty zBuffer, what the platform used to hand us every frame.
+static void ClearRect(pixel_buffer *pixelBuffer, screen_rect r)
+{
+    for (i32 y = r.minY; y < r.maxY; y++)
+    {
+        u32 *pixels = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
+        f32 *zBuffer = pixelBuffer->zBuffer + y * pixelBuffer->width;
+        for (i32 x = r.minX; x < r.maxX; x++)
+        {
+            pixels[x] = 0;
+            zBuffer[x] = FLT_MAX;
+        }
+    }
+}
+
 static bool UpdateZBuffer(pixel_buffer *pixelBuffer, i32 x, i32 y, f32 value)
 {
     if (x >= 0 && x < pixelBuffer->width && y >= 0 && y < pixelBuffer->height)
     {
+        pixelBuffer->stats.testedFragments++;
         f32 *old = &pixelBuffer->zBuffer[x + y * pixelBuffer->width];
-        if (*old > value)
+        if (pixelBuffer->depthTest == DEPTH_TEST_EQUAL)
+        {
+            if (value <= *old * DEPTH_EQUAL_SCALE)
+            {
+                pixelBuffer->stats.shadedFragments++;
+                return true;
+            }
+        }
+        else if (*old > value)
         {
             *old = value;
+            pixelBuffer->stats.shadedFragments++;
             return true;
         }
     }
@@ -63,6 +103,14 @@ static inline void VertexShaderWave(vertex *v, void *properties)
     v->pos.y += f32(wave->amplitude * sin(wave->time * wave->scrollFreq + v->pos.x * wave->waveFreq));
 }
 
+// NOTE: The ambient of triangle i / 3 darkened by the mean of its baked occlusion.
+static inline ambient OccludeAmbient(ambient a, f32 *occlusion, i32 i)
+{
+    if (!occlusion)
+        return a;
+    return a * ((occlusion[i] + occlusion[i + 1] + occlusion[i + 2]) * (1.0f / 3.0f));
+}
+
 static vec3 FlatShading(diffuse d, ambient a, vec3 n, material m)
 {
     n.normalize();
@@ -84,26 +132,471 @@ static vec3 CellShading(diffuse d, ambient a, vec3 n, material m, f32 threshold,
     return result;
 }
 
-static void GouraudShading(triangle_smooth *t, diffuse d, ambient a, material m, mat3 r)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Spherical Harmonics
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE: The real SH basis at unit direction n, in the order of sh9.
+static inline void GetSHBasis(vec3 n, f32 *basis)
+{
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * n.y;
+    basis[2] = 0.488603f * n.z;
+    basis[3] = 0.488603f * n.x;
+    basis[4] = 1.092548f * n.x * n.y;
+    basis[5] = 1.092548f * n.y * n.z;
+    basis[6] = 0.315392f * (3.0f * n.z * n.z - 1.0f);
+    basis[7] = 1.092548f * n.x * n.z;
+    basis[8] = 0.546274f * (n.x * n.x - n.y * n.y);
+}
+
+// NOTE: Radiance to irradiance: the cosine lobe convolution of each band.
+static f32 shCosineLobe[SH_COEFFICIENT_COUNT] = {
+    3.141593f,
+    2.094395f, 2.094395f, 2.094395f,
+    0.785398f, 0.785398f, 0.785398f, 0.785398f, 0.785398f};
+
+// NOTE: A directional light, direction is unit and points at the light.
+static void AddSHLight(sh9 *sh, vec3 direction, vec3 intensity)
+{
+    f32 basis[SH_COEFFICIENT_COUNT];
+    GetSHBasis(direction, basis);
+    for (i32 i = 0; i < SH_COEFFICIENT_COUNT; i++)
+        sh->c[i] += intensity * (basis[i] * shCosineLobe[i]);
+}
+
+// NOTE: The same light from everywhere.
+static void AddSHAmbient(sh9 *sh, vec3 intensity)
+{
+    sh->c[0] += intensity * (1.0f / 0.282095f);
+}
+
+static void ScaleSH(sh9 *sh, f32 scale)
+{
+    for (i32 i = 0; i < SH_COEFFICIENT_COUNT; i++)
+        sh->c[i] = sh->c[i] * scale;
+}
+
+// NOTE: The average over all normals, only band 0 is left.
+static inline vec3 GetSHAverage(sh9 *sh)
+{
+    return sh->c[0] * 0.282095f;
+}
+
+// NOTE: Bands 1 and 2 can ring below zero opposite a strong light.
+static inline vec3 EvaluateSH(sh9 *sh, vec3 n)
+{
+    f32 basis[SH_COEFFICIENT_COUNT];
+    GetSHBasis(n, basis);
+    vec3 result = {};
+    for (i32 i = 0; i < SH_COEFFICIENT_COUNT; i++)
+        result += sh->c[i] * basis[i];
+    return {maxF32(result.r, 0.0f), maxF32(result.g, 0.0f), maxF32(result.b, 0.0f)};
+}
+
+static inline void EvaluateSH4(sh9 *sh, __m128 nx, __m128 ny, __m128 nz, __m128 *r, __m128 *g, __m128 *b)
+{
+    __m128 basis[SH_COEFFICIENT_COUNT];
+    basis[0] = _mm_set1_ps(0.282095f);
+    basis[1] = _mm_mul_ps(_mm_set1_ps(0.488603f), ny);
+    basis[2] = _mm_mul_ps(_mm_set1_ps(0.488603f), nz);
+    basis[3] = _mm_mul_ps(_mm_set1_ps(0.488603f), nx);
+    basis[4] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(nx, ny));
+    basis[5] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(ny, nz));
+    basis[6] = _mm_mul_ps(_mm_set1_ps(0.315392f), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(nz, nz)), _mm_set1_ps(1.0f)));
+    basis[7] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(nx, nz));
+    basis[8] = _mm_mul_ps(_mm_set1_ps(0.546274f), _mm_sub_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)));
+    __m128 sumR = _mm_setzero_ps();
+    __m128 sumG = _mm_setzero_ps();
+    __m128 sumB = _mm_setzero_ps();
+    for (i32 i = 0; i < SH_COEFFICIENT_COUNT; i++)
+    {
+        sumR = _mm_add_ps(sumR, _mm_mul_ps(basis[i], _mm_set1_ps(sh->c[i].r)));
+        sumG = _mm_add_ps(sumG, _mm_mul_ps(basis[i], _mm_set1_ps(sh->c[i].g)));
+        sumB = _mm_add_ps(sumB, _mm_mul_ps(basis[i], _mm_set1_ps(sh->c[i].b)));
+    }
+    *r = _mm_max_ps(sumR, _mm_setzero_ps());
+    *g = _mm_max_ps(sumG, _mm_setzero_ps());
+    *b = _mm_max_ps(sumB, _mm_setzero_ps());
+}
+
+// NOTE:
+// Point lights further than foldDistance from center, and the weakest ones at
+// center past maxLights, are added to sh as directional lights: from where they
+// are seen from center, as bright as they are there. The others are copied to
+// kept. Returns how many were kept.
+static i32 FoldPointLights(sh9 *sh, point_light *lights, i32 lightCount, vec3 center, f32 foldDistance,
+                           i32 maxLights, point_light *kept)
+{
+    lightCount = minInt(lightCount, MAX_POINT_LIGHTS);
+    f32 strength[MAX_POINT_LIGHTS];
+    bool isFolded[MAX_POINT_LIGHTS];
+    i32 nearCount = 0;
+    for (i32 i = 0; i < lightCount; i++)
+    {
+        point_light *light = lights + i;
+        f32 dist = (light->pos - center).length();
+        f32 attenuation = 1.0f / (light->constantAttenuation + light->linearAttenuation * dist +
+                                  light->quadradicAttenuation * dist * dist);
+        strength[i] = attenuation * maxF32(maxF32(light->intensity.r, light->intensity.g), light->intensity.b);
+        isFolded[i] = dist > foldDistance;
+        if (!isFolded[i])
+            nearCount++;
+    }
+    for (; nearCount > maxLights; nearCount--)
+    {
+        i32 weakest = -1;
+        for (i32 i = 0; i < lightCount; i++)
+        {
+            if (!isFolded[i] && (weakest < 0 || strength[i] < strength[weakest]))
+                weakest = i;
+        }
+        isFolded[weakest] = true;
+    }
+
+    i32 keptCount = 0;
+    for (i32 i = 0; i < lightCount; i++)
+    {
+        point_light *light = lights + i;
+        if (!isFolded[i])
+        {
+            kept[keptCount++] = *light;
+            continue;
+        }
+        vec3 toLight = light->pos - center;
+        f32 dist = toLight.length();
+        if (dist > 0.0f)
+        {
+            f32 attenuation = 1.0f / (light->constantAttenuation + light->linearAttenuation * dist +
+                                      light->quadradicAttenuation * dist * dist);
+            AddSHLight(sh, toLight / dist, light->intensity * attenuation);
+        }
+    }
+    return keptCount;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Light Culling
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeLightGrid(light_grid *grid, memory_arena *arena, i32 width, i32 height)
+{
+    grid->tilesX = (width + LIGHT_TILE_SIZE - 1) >> LIGHT_TILE_SHIFT;
+    grid->tilesY = (height + LIGHT_TILE_SIZE - 1) >> LIGHT_TILE_SHIFT;
+    i32 tileCount = grid->tilesX * grid->tilesY;
+    grid->tileLightCounts = ReserveArrayMemory(arena, tileCount, u16);
+    grid->tileLights = ReserveArrayMemory(arena, tileCount * LIGHT_MAX_PER_TILE, u16);
+    for (i32 i = 0; i < tileCount; i++)
+        grid->tileLightCounts[i] = 0;
+    grid->lightCount = 0;
+}
+
+// NOTE: Distance where intensity / (c + l * d + q * d^2) drops under 1 / 256.
+static f32 GetPointLightRadius(point_light *light)
+{
+    f32 intensity = maxF32(maxF32(light->intensity.r, light->intensity.g), light->intensity.b);
+    f32 c = light->constantAttenuation - 256.0f * intensity;
+    f32 l = light->linearAttenuation;
+    f32 q = light->quadradicAttenuation;
+    if (c >= 0.0f)
+        return 0.0f;
+    if (q > 0.0f)
+        return (-l + sqrtf(l * l - 4.0f * q * c)) / (2.0f * q);
+    if (l > 0.0f)
+        return -c / l;
+    return FLT_MAX;
+}
+
+// NOTE:
+// The screen bounds of a sphere are taken from the view space box around it:
+// x / z over the box is smallest / largest at one of its corners. Spheres that
+// reach behind the near plane cover the whole screen.
+static void BuildLightGrid(light_grid *grid, point_light *lights, i32 lightCount, sh9 *ambientSH,
+                           screen_transformer *st)
+{
+    i32 tileCount = grid->tilesX * grid->tilesY;
+    for (i32 i = 0; i < tileCount; i++)
+        grid->tileLightCounts[i] = 0;
+    lightCount = minInt(lightCount, MAX_POINT_LIGHTS);
+    bool isChanged = lightCount != grid->lightCount || (ambientSH != 0) != grid->hasAmbientSH;
+    if (ambientSH && memcmp(ambientSH, &grid->ambientSH, sizeof(sh9)) != 0)
+        isChanged = true;
+    grid->lightCount = lightCount;
+    grid->hasAmbientSH = ambientSH != 0;
+    if (ambientSH)
+        grid->ambientSH = *ambientSH;
+
+    f32 nearZ = 0.1f;
+    for (i32 lightIndex = 0; lightIndex < grid->lightCount; lightIndex++)
+    {
+        point_light *light = grid->lights + lightIndex;
+        if (!isChanged && memcmp(light, lights + lightIndex, sizeof(point_light)) != 0)
+            isChanged = true;
+        *light = lights[lightIndex];
+        f32 radius = GetPointLightRadius(light);
+        vec3 c = light->pos;
+        if (radius <= 0.0f || c.z + radius < nearZ)
+            continue;
+
+        i32 minTileX = 0;
+        i32 minTileY = 0;
+        i32 maxTileX = grid->tilesX - 1;
+        i32 maxTileY = grid->tilesY - 1;
+        if (c.z - radius > nearZ)
+        {
+            f32 zNear = c.z - radius;
+            f32 zFar = c.z + radius;
+            f32 minX = (c.x - radius) / ((c.x - radius < 0.0f) ? zNear : zFar);
+            f32 maxX = (c.x + radius) / ((c.x + radius > 0.0f) ? zNear : zFar);
+            f32 minY = (c.y - radius) / ((c.y - radius < 0.0f) ? zNear : zFar);
+            f32 maxY = (c.y + radius) / ((c.y + radius > 0.0f) ? zNear : zFar);
+            f32 tileScale = 1.0f / (f32)LIGHT_TILE_SIZE;
+            minTileX = maxInt((i32)floorf((minX + 1.0f) * st->xFactor * tileScale), 0);
+            maxTileX = minInt((i32)floorf((maxX + 1.0f) * st->xFactor * tileScale), grid->tilesX - 1);
+            minTileY = maxInt((i32)floorf((minY + 1.0f) * st->yFactor * tileScale), 0);
+            maxTileY = minInt((i32)floorf((maxY + 1.0f) * st->yFactor * tileScale), grid->tilesY - 1);
+        }
+
+        for (i32 tileY = minTileY; tileY <= maxTileY; tileY++)
+        {
+            for (i32 tileX = minTileX; tileX <= maxTileX; tileX++)
+            {
+                i32 tile = tileY * grid->tilesX + tileX;
+                u16 count = grid->tileLightCounts[tile];
+                if (count < LIGHT_MAX_PER_TILE)
+                {
+                    grid->tileLights[tile * LIGHT_MAX_PER_TILE + count] = (u16)lightIndex;
+                    grid->tileLightCounts[tile] = count + 1;
+                }
+            }
+        }
+    }
+    if (isChanged)
+        grid->version++;
+}
+
+// NOTE: Pixels outside the screen use the closest tile. Without a grid there
+// are no point lights.
+static inline u16 *GetTileLights(light_grid *grid, i32 x, i32 y, i32 *count)
+{
+    if (!grid)
+    {
+        *count = 0;
+        return 0;
+    }
+    i32 tileX = minInt(maxInt(x >> LIGHT_TILE_SHIFT, 0), grid->tilesX - 1);
+    i32 tileY = minInt(maxInt(y >> LIGHT_TILE_SHIFT, 0), grid->tilesY - 1);
+    i32 tile = tileY * grid->tilesX + tileX;
+    *count = grid->tileLightCounts[tile];
+    return grid->tileLights + tile * LIGHT_MAX_PER_TILE;
+}
+
+// NOTE:
+// How much of the directional light reaches 4 view space points, 0 to 1: 2x2
+// percentage closer filtering, the depth tests of the 4 closest texels weighted
+// like a bilinear fetch. Texel (x, y) holds the depth at x + 0.5, y - 0.5 like
+// screen pixels do. Points outside the map are lit.
+static inline __m128 SampleShadow4(shadow_map *shadow, __m128 px, __m128 py, __m128 pz)
+{
+    __m128 x = _mm_sub_ps(px, _mm_set1_ps(shadow->origin.x));
+    __m128 y = _mm_sub_ps(py, _mm_set1_ps(shadow->origin.y));
+    __m128 z = _mm_sub_ps(pz, _mm_set1_ps(shadow->origin.z));
+    vec3 ax = shadow->axisX;
+    vec3 ay = shadow->axisY;
+    vec3 az = shadow->axisZ;
+    __m128 lx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(ax.x)), _mm_mul_ps(y, _mm_set1_ps(ax.y))), _mm_mul_ps(z, _mm_set1_ps(ax.z)));
+    __m128 ly = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(ay.x)), _mm_mul_ps(y, _mm_set1_ps(ay.y))), _mm_mul_ps(z, _mm_set1_ps(ay.z)));
+    __m128 lz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(az.x)), _mm_mul_ps(y, _mm_set1_ps(az.y))), _mm_mul_ps(z, _mm_set1_ps(az.z)));
+    lz = _mm_max_ps(lz, _mm_set1_ps(1e-6f));
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zInv = _mm_div_ps(one, lz);
+    __m128 u = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(lx, zInv), one), _mm_set1_ps(shadow->st.xFactor)), _mm_set1_ps(0.5f));
+    __m128 v = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(ly, zInv), one), _mm_set1_ps(shadow->st.yFactor)), _mm_set1_ps(0.5f));
+    __m128 u0 = _mm_floor_ps(u);
+    __m128 v0 = _mm_floor_ps(v);
+
+    f32 fx[4];
+    f32 fy[4];
+    f32 depth[4];
+    i32 tx[4];
+    i32 ty[4];
+    _mm_storeu_ps(fx, _mm_sub_ps(u, u0));
+    _mm_storeu_ps(fy, _mm_sub_ps(v, v0));
+    _mm_storeu_ps(depth, _mm_mul_ps(lz, _mm_set1_ps(1.0f - shadow->bias)));
+    _mm_storeu_si128((__m128i *)tx, _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(u0, _mm_set1_ps(32767.0f)), _mm_set1_ps(-2.0f))));
+    _mm_storeu_si128((__m128i *)ty, _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(v0, _mm_set1_ps(32767.0f)), _mm_set1_ps(-2.0f))));
+
+    i32 width = shadow->depth.width;
+    i32 height = shadow->depth.height;
+    f32 *zBuffer = shadow->depth.zBuffer;
+    f32 lit[4];
+    for (i32 i = 0; i < 4; i++)
+    {
+        f32 taps[4];
+        for (i32 tap = 0; tap < 4; tap++)
+        {
+            i32 sx = tx[i] + (tap & 1);
+            i32 sy = ty[i] + (tap >> 1);
+            bool isInside = sx >= 0 && sx < width && sy >= 0 && sy < height;
+            taps[tap] = (!isInside || depth[i] <= zBuffer[sy * width + sx]) ? 1.0f : 0.0f;
+        }
+        f32 bottom = taps[0] + fx[i] * (taps[1] - taps[0]);
+        f32 top = taps[2] + fx[i] * (taps[3] - taps[2]);
+        lit[i] = bottom + fy[i] * (top - bottom);
+    }
+    return _mm_loadu_ps(lit);
+}
+
+// NOTE: The color of one vertex. n is its view space normal, p its view space
+// position, lit by the point lights of the grid at lightIndices. Without a grid
+// there are only the ambient and the directional light.
+static vec3 LightVertex(lighting *l, vec3 n, vec3 p, f32 shadow, f32 occlusion, u16 *lightIndices, i32 lightCount)
+{
+    vec3 light = (l->grid && l->grid->hasAmbientSH) ? EvaluateSH(&l->grid->ambientSH, n.normalized()) : l->a;
+    light *= occlusion;
+    light += l->d.intensity * (shadow * maxF32(0.0f, -n * l->d.direction));
+    for (i32 li = 0; li < lightCount; li++)
+    {
+        point_light *pl = l->grid->lights + lightIndices[li];
+        vec3 toLight = pl->pos - p;
+        f32 dist = maxF32(toLight.length(), 1e-6f);
+        f32 attenuation = 1.0f / (pl->constantAttenuation + pl->linearAttenuation * dist +
+                                  pl->quadradicAttenuation * dist * dist);
+        light += pl->intensity * (attenuation * maxF32(0.0f, n * toLight / dist));
+    }
+    return Saturated(HadamardProduct(l->m, light));
+}
+
+// NOTE: Directional, ambient and the point lights of the vertex's tile, per vertex.
+// viewPos are the view space positions, t is already in screen space. occlusion
+// is the baked ambient occlusion of the 3 vertices or 0.
+static void GouraudShading(triangle_smooth *t, lighting *l, mat3 r, vec3 *viewPos, f32 *occlusion)
 {
+    f32 shadow[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    if (l->d.shadow)
+    {
+        __m128 px = _mm_setr_ps(viewPos[0].x, viewPos[1].x, viewPos[2].x, viewPos[2].x);
+        __m128 py = _mm_setr_ps(viewPos[0].y, viewPos[1].y, viewPos[2].y, viewPos[2].y);
+        __m128 pz = _mm_setr_ps(viewPos[0].z, viewPos[1].z, viewPos[2].z, viewPos[2].z);
+        _mm_storeu_ps(shadow, SampleShadow4(l->d.shadow, px, py, pz));
+    }
     for (i8 i = 0; i < 3; i++)
     {
-        vec3 n = t->v[i].normal * r;
-        vec3 dif = d.intensity * maxF32(0.0f, -n * d.direction);
-        t->v[i].color = Saturated(HadamardProduct(m, dif + a));
+        i32 lightCount;
+        u16 *lightIndices = GetTileLights(l->grid, (i32)t->v[i].pos.x, (i32)t->v[i].pos.y, &lightCount);
+        t->v[i].color = LightVertex(l, t->v[i].normal * r, viewPos[i], shadow[i], occlusion ? occlusion[i] : 1.0f,
+                                    lightIndices, lightCount);
     }
 }
-/*
-static vec3 PhongShading(vertex_smooth v, lighting l, material m)
+// NOTE:
+// The colors in the cache if they were lit with what this draw lights with,
+// and *isLit is set. Otherwise the key is taken over and the caller lights
+// the vertices it draws into the returned colors. 0 without a cache.
+static vec3 *UseVertexLightingCache(vertex_lighting_cache *cache, object *o, mat3 rot, vec3 trans,
+                                    lighting *l, bool *isLit)
+{
+    *isLit = false;
+    if (!cache)
+        return 0;
+
+    vertex_lighting_key key;
+    memset(&key, 0, sizeof(key));
+    key.vertices = o->vertices;
+    key.nVertices = o->nVertices;
+    key.rotation = rot;
+    key.translation = trans;
+    key.d = l->d;
+    key.shadowVersion = l->d.shadow ? l->d.shadow->renderCount : 0;
+    key.a = l->a;
+    key.m = l->m;
+    key.grid = l->grid;
+    key.lightsVersion = l->grid ? l->grid->version : 0;
+    if (cache->isValid && memcmp(&key, &cache->key, sizeof(key)) == 0)
+    {
+        *isLit = true;
+        return cache->colors;
+    }
+
+    if (cache->capacity < o->nVertices)
+    {
+        cache->colors = ReserveArrayMemory(cache->arena, o->nVertices, vec3);
+        cache->capacity = o->nVertices;
+    }
+    cache->key = key;
+    cache->isValid = true;
+    return cache->colors;
+}
+
+// NOTE:
+// Lights 4 fragments at once. n is the interpolated normal (any length), p the
+// view space position. Normals and light directions are normalized with rsqrt and
+// one Newton-Raphson step, attenuation uses a reciprocal refined the same way.
+// Returns the lit colors packed 0x00RRGGBB.
+static inline __m128 FastReciprocalSqrt(__m128 x)
+{
+    __m128 r = _mm_rsqrt_ps(x);
+    __m128 halfX = _mm_mul_ps(x, _mm_set1_ps(0.5f));
+    return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(halfX, _mm_mul_ps(r, r))));
+}
+
+static inline __m128 FastReciprocal(__m128 x)
+{
+    __m128 r = _mm_rcp_ps(x);
+    return _mm_sub_ps(_mm_add_ps(r, r), _mm_mul_ps(x, _mm_mul_ps(r, r)));
+}
+
+static inline __m128i PhongShading4(lighting *l, u16 *lightIndices, i32 lightCount,
+                                    __m128 nx, __m128 ny, __m128 nz, __m128 px, __m128 py, __m128 pz)
 {
-    vec3 vToL = l.p.pos - v.color;
-    f32 dist = vToL.length();
-    vec3 dir = vToL / dist;
-    f32 attenuation = 1.0f / (l.p.constantAttenuation + l.p.linearAttenuation * dist + l.p.quadradicAttenuation * Squared(dist));
-    vec3 dif = l.d.intensity * attenuation * maxF32(0.0f, v.normal.normalized() * l.d.direction);
-    return Saturated(HadamardProduct(m, dif + l.a));
+    __m128 zero = _mm_setzero_ps();
+    __m128 tiny = _mm_set1_ps(1e-12f);
+    __m128 nInv = FastReciprocalSqrt(_mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)), tiny));
+    nx = _mm_mul_ps(nx, nInv);
+    ny = _mm_mul_ps(ny, nInv);
+    nz = _mm_mul_ps(nz, nInv);
+
+    vec3 dir = l->d.direction;
+    __m128 nDotL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_set1_ps(-dir.x)), _mm_mul_ps(ny, _mm_set1_ps(-dir.y))),
+                              _mm_mul_ps(nz, _mm_set1_ps(-dir.z)));
+    nDotL = _mm_max_ps(nDotL, zero);
+    if (l->d.shadow && _mm_movemask_ps(_mm_cmpgt_ps(nDotL, zero)))
+        nDotL = _mm_mul_ps(nDotL, SampleShadow4(l->d.shadow, px, py, pz));
+    __m128 r = _mm_set1_ps(l->a.r);
+    __m128 g = _mm_set1_ps(l->a.g);
+    __m128 b = _mm_set1_ps(l->a.b);
+    if (l->grid && l->grid->hasAmbientSH)
+        EvaluateSH4(&l->grid->ambientSH, nx, ny, nz, &r, &g, &b);
+    r = _mm_add_ps(r, _mm_mul_ps(nDotL, _mm_set1_ps(l->d.intensity.r)));
+    g = _mm_add_ps(g, _mm_mul_ps(nDotL, _mm_set1_ps(l->d.intensity.g)));
+    b = _mm_add_ps(b, _mm_mul_ps(nDotL, _mm_set1_ps(l->d.intensity.b)));
+
+    for (i32 i = 0; i < lightCount; i++)
+    {
+        point_light *light = l->grid->lights + lightIndices[i];
+        __m128 toLightX = _mm_sub_ps(_mm_set1_ps(light->pos.x), px);
+        __m128 toLightY = _mm_sub_ps(_mm_set1_ps(light->pos.y), py);
+        __m128 toLightZ = _mm_sub_ps(_mm_set1_ps(light->pos.z), pz);
+        __m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(toLightX, toLightX), _mm_mul_ps(toLightY, toLightY)),
+                                   _mm_mul_ps(toLightZ, toLightZ));
+        distSq = _mm_max_ps(distSq, tiny);
+        __m128 distInv = FastReciprocalSqrt(distSq);
+        __m128 dist = _mm_mul_ps(distSq, distInv);
+        __m128 attenuation = FastReciprocal(_mm_add_ps(_mm_add_ps(_mm_set1_ps(light->constantAttenuation),
+                                                                  _mm_mul_ps(dist, _mm_set1_ps(light->linearAttenuation))),
+                                                       _mm_mul_ps(distSq, _mm_set1_ps(light->quadradicAttenuation))));
+        __m128 nDotP = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, toLightX), _mm_mul_ps(ny, toLightY)), _mm_mul_ps(nz, toLightZ));
+        __m128 amount = _mm_mul_ps(_mm_max_ps(_mm_mul_ps(nDotP, distInv), zero), attenuation);
+        r = _mm_add_ps(r, _mm_mul_ps(amount, _mm_set1_ps(light->intensity.r)));
+        g = _mm_add_ps(g, _mm_mul_ps(amount, _mm_set1_ps(light->intensity.g)));
+        b = _mm_add_ps(b, _mm_mul_ps(amount, _mm_set1_ps(light->intensity.b)));
+    }
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 scale = _mm_set1_ps(255.0f);
+    __m128i ri = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_mul_ps(r, _mm_set1_ps(l->m.r)), one), scale));
+    __m128i gi = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_mul_ps(g, _mm_set1_ps(l->m.g)), one), scale));
+    __m128i bi = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_mul_ps(b, _mm_set1_ps(l->m.b)), one), scale));
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(ri, 16), _mm_slli_epi32(gi, 8)), bi);
 }
-*/
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // NOTE:  FLAT Triangle Rendering
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -118,16 +611,38 @@ static inline vertex_smooth Prestep(i32 rounded, f32 original, vertex_smooth ste
     return result;
 }
 
-static inline color GetShadedColor(color c, vec3 shade)
+// NOTE:
+// Rows are sampled at y - 0.5 but spans at x + 0.5 (xLeft is the first pixel
+// with x + 0.5 past the edge), so along x the prestep goes one pixel further.
+static inline vertex PrestepX(i32 rounded, f32 original, vertex step)
+{
+    return Prestep(rounded + 1, original, step);
+}
+
+static inline vertex_smooth PrestepX(i32 rounded, f32 original, vertex_smooth step)
+{
+    return Prestep(rounded + 1, original, step);
+}
+
+// NOTE:
+// The depth of pixel i of a span. 1/z is interpolated from the span start for
+// every pixel instead of stepped, and always with these instructions, so the
+// depth only pass (see DrawFlatTriangleDepth) and the shading pass get exactly
+// the same value for the EQUAL test.
+static inline f32 SpanDepth(f32 startInvZ, f32 stepInvZ, i32 i)
+{
+    __m128 invZ = _mm_sub_ss(_mm_set_ss(startInvZ), _mm_mul_ss(_mm_set_ss((f32)i), _mm_set_ss(stepInvZ)));
+    return _mm_cvtss_f32(_mm_div_ss(_mm_set_ss(1.0f), invZ));
+}
+
+static inline __m128 SpanDepth4(__m128 startInvZ, __m128 stepInvZ, __m128 i)
 {
-    u8 r = (u8)((f32)c.r * shade.x);
-    u8 g = (u8)((f32)c.g * shade.y);
-    u8 b = (u8)((f32)c.b * shade.z);
-    return {r, g, b};
+    __m128 invZ = _mm_sub_ps(startInvZ, _mm_mul_ps(i, stepInvZ));
+    return _mm_div_ps(_mm_set1_ps(1.0f), invZ);
 }
 
 static void DrawFlatTriangle(
-    pixel_buffer *pixelBuffer, color c,
+    pixel_buffer *pixelBuffer, u32 c,
     vertex leftStart, vertex rightStart, vertex dvLeft, vertex dvRight,
     f32 yTopF32, f32 yBottomF32)
 {
@@ -143,17 +658,19 @@ static void DrawFlatTriangle(
 
     for (i16 y = yTop; y > yBottom; y--)
     {
+        // NOTE: Only written where UpdateZBuffer passed, which also does the bounds check.
+        u32 *row = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
         xLeft = RoundF32toI16(left.pos.x);
         xRight = RoundF32toI16(right.pos.x);
         leftToRightStep = VertexSlopeX(left, right);
-        inTriangleCoord = left + Prestep(xLeft, left.pos.x, leftToRightStep);
+        inTriangleCoord = left + PrestepX(xLeft, left.pos.x, leftToRightStep);
 
-        for (i16 x = xLeft; x < xRight; x++, inTriangleCoord -= leftToRightStep)
+        for (i16 x = xLeft; x < xRight; x++)
         {
-            objectSpazeZ = 1.0f / inTriangleCoord.pos.z;
+            objectSpazeZ = SpanDepth(inTriangleCoord.pos.z, leftToRightStep.pos.z, x - xLeft);
             if (UpdateZBuffer(pixelBuffer, x, y, objectSpazeZ))
             {
-                PutPixel(pixelBuffer, x, y, c);
+                row[x] = c;
             }
         }
         left -= dvLeft;
@@ -161,26 +678,283 @@ static void DrawFlatTriangle(
     }
 }
 
-static color GetTextureColorRGB(loaded_bitmap *bmp, vec2 coord)
+// NOTE:
+// Looks the page up in the virtual texture's page table. Missing pages are put
+// in the feedback list (once, the entry stays until the end of the frame) and
+// the texel comes from the closest coarser level that is resident. The coarsest
+// levels are pinned so this always ends.
+static u32 FetchVirtualTexel(virtual_texture *texture, i32 level, i32 x, i32 y)
 {
-    f32 x = coord.x * bmp->width;
-    f32 y = coord.y * bmp->height;
-    f32 xMax = (f32)bmp->width - 1.0f;
-    f32 yMax = (f32)bmp->height - 1.0f;
-    if (x < 0.0f)
-        x = 0.0f;
-    else if (xMax < x)
-        x = bmp->width - 1.0f;
-    if (y < 0.0f)
-        y = 0.0f;
-    else if (yMax < y)
-        y = bmp->height - 1.0f;
+    for (;;)
+    {
+        u32 key = GetVirtualPageKey(level, x >> VT_PAGE_SHIFT, y >> VT_PAGE_SHIFT);
+        virtual_page_entry *entry = FindVirtualPageEntry(texture, key);
+        if (entry && (entry->value & VT_ENTRY_ASSIGNED))
+        {
+            virtual_page *page = texture->pages + (entry->value & ~VT_ENTRY_ASSIGNED);
+            if (page->state >= VIRTUAL_PAGE_RESIDENT)
+            {
+                CompletePreviousReadsBeforeFutureReads;
+                if (page->lastUsedFrame != texture->frameIndex)
+                    page->lastUsedFrame = texture->frameIndex;
+                return page->texels[((y & (VT_PAGE_SIZE - 1)) << VT_PAGE_SHIFT) + (x & (VT_PAGE_SIZE - 1))];
+            }
+        }
+        else if (!entry)
+        {
+            RequestVirtualPage(texture, key);
+        }
+
+        level++;
+        x = minInt(x >> 1, texture->levels[level].width - 1);
+        y = minInt(y >> 1, texture->levels[level].height - 1);
+    }
+}
+
+static inline u32 FetchBC1Texel(bc1_block_cache *cache, bitmap_mip *mip, i32 x, i32 y)
+{
+    u32 *block = mip->GetBlock(x, y);
+    u32 entry = ((x >> 2) & 3) | (((y >> 2) & 3) << 2);
+    u32 *texels = cache->texels[entry];
+    if (cache->tags[entry] != block)
+    {
+        u32 palette[4];
+        DecodeBC1Palette(block[0], palette);
+        for (i32 i = 0; i < 16; i++)
+            texels[i] = palette[(block[1] >> (2 * i)) & 3];
+        cache->tags[entry] = block;
+    }
+    return texels[(y & 3) * 4 + (x & 3)];
+}
+
+static inline u32 SampleNearest(bitmap_mip *mip, bc1_block_cache *cache, f32 u, f32 v)
+{
+    i32 x = (i32)(u * mip->width);
+    i32 y = (i32)(v * mip->height);
+    x = minInt(maxInt(x, 0), mip->width - 1);
+    y = minInt(maxInt(y, 0), mip->height - 1);
+    if (mip->layout == TEXTURE_LAYOUT_BC1)
+        return FetchBC1Texel(cache, mip, x, y);
+    return mip->GetTexel(x, y);
+}
+
+static inline __m128i Part1By1_4(__m128i n)
+{
+    n = _mm_and_si128(n, _mm_set1_epi32(0x0000FFFF));
+    n = _mm_and_si128(_mm_or_si128(n, _mm_slli_epi32(n, 8)), _mm_set1_epi32(0x00FF00FF));
+    n = _mm_and_si128(_mm_or_si128(n, _mm_slli_epi32(n, 4)), _mm_set1_epi32(0x0F0F0F0F));
+    n = _mm_and_si128(_mm_or_si128(n, _mm_slli_epi32(n, 2)), _mm_set1_epi32(0x33333333));
+    n = _mm_and_si128(_mm_or_si128(n, _mm_slli_epi32(n, 1)), _mm_set1_epi32(0x55555555));
+    return n;
+}
+
+// NOTE: bitmap_mip::GetTexelIndex for 4 texels.
+static inline __m128i GetTexelIndex4(bitmap_mip *mip, __m128i x, __m128i y)
+{
+    __m128i shift = _mm_cvtsi32_si128(mip->blockShift);
+    __m128i shift2 = _mm_cvtsi32_si128(2 * mip->blockShift);
+    __m128i mask = _mm_set1_epi32((1 << mip->blockShift) - 1);
+    switch (mip->layout)
+    {
+    case TEXTURE_LAYOUT_TILED_4X4:
+    case TEXTURE_LAYOUT_TILED_8X8:
+    {
+        __m128i tile = _mm_add_epi32(_mm_mullo_epi32(_mm_srl_epi32(y, shift), _mm_set1_epi32(mip->blocksPerRow)),
+                                     _mm_srl_epi32(x, shift));
+        __m128i inTile = _mm_or_si128(_mm_sll_epi32(_mm_and_si128(y, mask), shift), _mm_and_si128(x, mask));
+        return _mm_or_si128(_mm_sll_epi32(tile, shift2), inTile);
+    }
+    case TEXTURE_LAYOUT_MORTON:
+    {
+        __m128i rest = _mm_or_si128(_mm_srl_epi32(x, shift), _mm_srl_epi32(y, shift));
+        __m128i interleaved = _mm_or_si128(Part1By1_4(_mm_and_si128(x, mask)),
+                                           _mm_slli_epi32(Part1By1_4(_mm_and_si128(y, mask)), 1));
+        return _mm_or_si128(_mm_sll_epi32(rest, shift2), interleaved);
+    }
+    default:
+        return _mm_add_epi32(x, _mm_mullo_epi32(y, _mm_set1_epi32(mip->width)));
+    }
+}
+
+static inline __m128i GatherTexels4(bitmap_mip *mip, bc1_block_cache *cache, __m128i x, __m128i y)
+{
+    if (mip->layout == TEXTURE_LAYOUT_BC1)
+    {
+        i32 xs[4];
+        i32 ys[4];
+        _mm_storeu_si128((__m128i *)xs, x);
+        _mm_storeu_si128((__m128i *)ys, y);
+        return _mm_setr_epi32(FetchBC1Texel(cache, mip, xs[0], ys[0]), FetchBC1Texel(cache, mip, xs[1], ys[1]),
+                              FetchBC1Texel(cache, mip, xs[2], ys[2]), FetchBC1Texel(cache, mip, xs[3], ys[3]));
+    }
+    if (mip->layout == TEXTURE_LAYOUT_VIRTUAL)
+    {
+        i32 xs[4];
+        i32 ys[4];
+        _mm_storeu_si128((__m128i *)xs, x);
+        _mm_storeu_si128((__m128i *)ys, y);
+        return _mm_setr_epi32(mip->GetTexel(xs[0], ys[0]), mip->GetTexel(xs[1], ys[1]),
+                              mip->GetTexel(xs[2], ys[2]), mip->GetTexel(xs[3], ys[3]));
+    }
+
+    u32 index[4];
+    _mm_storeu_si128((__m128i *)index, GetTexelIndex4(mip, x, y));
+    u32 *pixels = mip->pixels;
+    return _mm_setr_epi32(pixels[index[0]], pixels[index[1]], pixels[index[2]], pixels[index[3]]);
+}
+
+// NOTE: Spreads 4 weights (0 - 256, one per texel) over the 16 bit channels of
+// texels 0, 1 (lo) and 2, 3 (hi).
+static inline void ExpandWeights4(__m128i weights, __m128i *lo, __m128i *hi)
+{
+    __m128i w = _mm_packs_epi32(weights, weights);
+    w = _mm_unpacklo_epi16(w, w);
+    *lo = _mm_unpacklo_epi32(w, w);
+    *hi = _mm_unpackhi_epi32(w, w);
+}
+
+// NOTE: a * (256 - t) + b * t per 8 bit channel, 4 texels at once. The weights
+// sum to 256 so the 16 bit sums can't overflow.
+static inline __m128i LerpTexels4(__m128i a, __m128i b, __m128i tLo, __m128i tHi)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(256);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_sub_epi16(full, tLo)),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), tLo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_sub_epi16(full, tHi)),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), tHi));
+    return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+// NOTE:
+// Bilinear filtering of 4 fragments per call. Coordinates, clamping and weights
+// are computed for all 4 in SSE floats, the 2x2 footprints are fetched as four
+// vectors (one per corner) and blended on packed RGBA with 16 bit integer math.
+static inline __m128i SampleBilinear4(bitmap_mip *mip, bc1_block_cache *cache, __m128 u, __m128 v)
+{
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 x = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps((f32)mip->width)), half);
+    __m128 y = _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps((f32)mip->height)), half);
+    x = _mm_min_ps(_mm_max_ps(x, zero), _mm_set1_ps((f32)(mip->width - 1)));
+    y = _mm_min_ps(_mm_max_ps(y, zero), _mm_set1_ps((f32)(mip->height - 1)));
+
+    __m128i x0 = _mm_cvttps_epi32(x);
+    __m128i y0 = _mm_cvttps_epi32(y);
+    __m128i one = _mm_set1_epi32(1);
+    __m128i x1 = _mm_min_epi32(_mm_add_epi32(x0, one), _mm_set1_epi32(mip->width - 1));
+    __m128i y1 = _mm_min_epi32(_mm_add_epi32(y0, one), _mm_set1_epi32(mip->height - 1));
+    __m128 fixedOne = _mm_set1_ps(256.0f);
+    __m128i fx = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(x, _mm_cvtepi32_ps(x0)), fixedOne));
+    __m128i fy = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(y0)), fixedOne));
+
+    __m128i t00 = GatherTexels4(mip, cache, x0, y0);
+    __m128i t10 = GatherTexels4(mip, cache, x1, y0);
+    __m128i t01 = GatherTexels4(mip, cache, x0, y1);
+    __m128i t11 = GatherTexels4(mip, cache, x1, y1);
+
+    __m128i fxLo, fxHi, fyLo, fyHi;
+    ExpandWeights4(fx, &fxLo, &fxHi);
+    ExpandWeights4(fy, &fyLo, &fyHi);
+    __m128i bottom = LerpTexels4(t00, t10, fxLo, fxHi);
+    __m128i top = LerpTexels4(t01, t11, fxLo, fxHi);
+    return LerpTexels4(bottom, top, fyLo, fyHi);
+}
+
+// NOTE: Samples 4 fragments. Unused lanes must still hold valid coordinates.
+static inline void SampleTexture4(texture_sampler *sampler, f32 *u, f32 *v, u32 *result)
+{
+    switch (sampler->filter)
+    {
+    case TEXTURE_FILTER_BILINEAR:
+    {
+        __m128i texels = SampleBilinear4(sampler->mip, sampler->blockCache, _mm_loadu_ps(u), _mm_loadu_ps(v));
+        _mm_storeu_si128((__m128i *)result, texels);
+    }
+    break;
+    case TEXTURE_FILTER_TRILINEAR:
+    {
+        __m128 u4 = _mm_loadu_ps(u);
+        __m128 v4 = _mm_loadu_ps(v);
+        __m128i weight = _mm_set1_epi16((i16)sampler->nextMipWeight);
+        __m128i texels = LerpTexels4(SampleBilinear4(sampler->mip, sampler->blockCache, u4, v4),
+                                     SampleBilinear4(sampler->nextMip, sampler->blockCache, u4, v4),
+                                     weight, weight);
+        _mm_storeu_si128((__m128i *)result, texels);
+    }
+    break;
+    default:
+        for (i32 i = 0; i < 4; i++)
+            result[i] = SampleNearest(sampler->mip, sampler->blockCache, u[i], v[i]);
+        break;
+    }
+}
+
+// NOTE:
+// The level of detail is picked once per triangle from the ratio of its area in
+// texels (of the base level) to its area in pixels. Every level down halves both
+// sides, so lod = log2(sqrt(texelArea / pixelArea)). The vertices must already
+// be in screen space, where texCoord is divided by z (see TransformVertexToScreen).
+static texture_sampler GetTriangleSampler(loaded_bitmap *bmp, triangle *t)
+{
+    texture_sampler result = {};
+    result.filter = bmp->filter;
+    result.mip = &bmp->mips[0];
+    result.nextMip = result.mip; // NOTE: Magnified trilinear blends the base level with itself
+    if (bmp->filter == TEXTURE_FILTER_NEAREST || bmp->mipCount < 2)
+        return result;
+
+    vec2 p0 = {t->v0.pos.x, t->v0.pos.y};
+    vec2 p1 = {t->v1.pos.x, t->v1.pos.y};
+    vec2 p2 = {t->v2.pos.x, t->v2.pos.y};
+    vec2 uv0 = t->v0.texCoord / t->v0.pos.z;
+    vec2 uv1 = t->v1.texCoord / t->v1.pos.z;
+    vec2 uv2 = t->v2.texCoord / t->v2.pos.z;
+    vec2 e1 = p1 - p0;
+    vec2 e2 = p2 - p0;
+    vec2 t1 = uv1 - uv0;
+    vec2 t2 = uv2 - uv0;
+    f32 pixelArea = fabsf(e1.x * e2.y - e1.y * e2.x);
+    f32 texelArea = fabsf(t1.x * t2.y - t1.y * t2.x) * (f32)bmp->width * (f32)bmp->height;
+    if (pixelArea <= 0.0f || texelArea <= pixelArea)
+        return result;
+
+    f32 lod = minF32(0.5f * log2f(texelArea / pixelArea), (f32)(bmp->mipCount - 1));
+    i32 level = (i32)lod;
+    result.mip = &bmp->mips[level];
+    if (bmp->filter == TEXTURE_FILTER_TRILINEAR)
+    {
+        result.nextMip = &bmp->mips[minInt(level + 1, bmp->mipCount - 1)];
+        result.nextMipWeight = (u32)((lod - (f32)level) * 256.0f);
+    }
+    else if (lod - (f32)level > 0.5f && level + 1 < bmp->mipCount)
+    {
+        result.mip = &bmp->mips[level + 1];
+    }
+    return result;
+}
 
-    return bmp->GetColorRGB((i32)x, (i32)y);
+// NOTE: The fragments already passed UpdateZBuffer, so they are inside the buffer.
+static void DrawTexturedFragments(pixel_buffer *pixelBuffer, texture_sampler *sampler, __m128i shade,
+                                  textured_fragments *fragments, i16 y)
+{
+    for (i32 i = fragments->count; i < 4; i++)
+    {
+        fragments->u[i] = fragments->u[0];
+        fragments->v[i] = fragments->v[0];
+    }
+    u32 texels[4];
+    SampleTexture4(sampler, fragments->u, fragments->v, texels);
+    _mm_storeu_si128((__m128i *)texels, ModulateTexels4(_mm_loadu_si128((__m128i *)texels), shade));
+    u32 *row = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
+    for (i32 i = 0; i < fragments->count; i++)
+        row[fragments->x[i]] = texels[i];
+    fragments->count = 0;
 }
 
+// NOTE: Fragments that pass the depth test are queued and sampled 4 at a time.
 static void DrawFlatTriangleTextured(
-    pixel_buffer *pixelBuffer, loaded_bitmap *bmp, vec3 shade,
+    pixel_buffer *pixelBuffer, texture_sampler *sampler, __m128i shade,
     vertex leftStart, vertex rightStart, vertex dvLeft, vertex dvRight,
     f32 yTopF32, f32 yBottomF32)
 {
@@ -193,23 +967,30 @@ static void DrawFlatTriangleTextured(
     vertex leftToRightStep;
     vertex inTriangleCoord;
     f32 objectSpazeZ;
+    textured_fragments fragments = {};
     for (i16 y = yTop; y > yBottom; y--)
     {
         xLeft = RoundF32toI16(left.pos.x);
         xRight = RoundF32toI16(right.pos.x);
         leftToRightStep = VertexSlopeX(left, right);
-        inTriangleCoord = left + Prestep(xLeft, left.pos.x, leftToRightStep);
+        inTriangleCoord = left + PrestepX(xLeft, left.pos.x, leftToRightStep);
+        f32 startInvZ = inTriangleCoord.pos.z;
 
         for (i16 x = xLeft; x < xRight; x++, inTriangleCoord -= leftToRightStep)
         {
-            objectSpazeZ = 1.0f / inTriangleCoord.pos.z;
+            objectSpazeZ = SpanDepth(startInvZ, leftToRightStep.pos.z, x - xLeft);
             if (UpdateZBuffer(pixelBuffer, x, y, objectSpazeZ))
             {
-                vertex attr = inTriangleCoord * objectSpazeZ;
-                color c = GetShadedColor(GetTextureColorRGB(bmp, attr.texCoord), shade);
-                PutPixel(pixelBuffer, x, y, c);
+                vec2 texCoord = inTriangleCoord.texCoord * objectSpazeZ;
+                fragments.x[fragments.count] = x;
+                fragments.u[fragments.count] = texCoord.x;
+                fragments.v[fragments.count] = texCoord.y;
+                if (++fragments.count == 4)
+                    DrawTexturedFragments(pixelBuffer, sampler, shade, &fragments, y);
             }
         }
+        if (fragments.count)
+            DrawTexturedFragments(pixelBuffer, sampler, shade, &fragments, y);
         left -= dvLeft;
         right -= dvRight;
     }
@@ -233,64 +1014,157 @@ static void DrawFlatTriangleSmooth(
 
     for (i16 y = yTop; y > yBottom; y--)
     {
+        u32 *row = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
         xLeft = RoundF32toI16(left.pos.x);
         xRight = RoundF32toI16(right.pos.x);
         leftToRightStep = VertexSlopeX(left, right);
-        inTriangleCoord = left + Prestep(xLeft, left.pos.x, leftToRightStep);
+        inTriangleCoord = left + PrestepX(xLeft, left.pos.x, leftToRightStep);
+        f32 startInvZ = inTriangleCoord.pos.z;
 
         for (i16 x = xLeft; x < xRight; x++, inTriangleCoord -= leftToRightStep)
         {
-            objectSpazeZ = 1.0f / inTriangleCoord.pos.z;
+            objectSpazeZ = SpanDepth(startInvZ, leftToRightStep.pos.z, x - xLeft);
             if (UpdateZBuffer(pixelBuffer, x, y, objectSpazeZ))
             {
-                color c = Vec3ToRGB(inTriangleCoord.color);
-                PutPixel(pixelBuffer, x, y, c);
+                row[x] = Vec3ToU32(inTriangleCoord.color);
             }
         }
         left -= dvLeft;
         right -= dvRight;
     }
 }
-/*
+// NOTE:
+// Spans are clipped to the buffer and walked 4 pixels at a time: 1/z and n/z
+// are linear in screen space (see TransformVertexToScreen and SpanDepth), depth
+// is tested for all 4 lanes, and only the lanes that passed are stored.
+// The view space position is recovered from z and the point the pixel is
+// sampled at, x + 0.5, y - 0.5 (see PrestepX). Groups
+// start on multiples of 4 so each one sits in a single light tile.
 static void DrawFlatTrianglePhong(
-    pixel_buffer *pixelBuffer, lighting l, material m,
-    vertex_smooth leftStart, vertex_smooth rightStart,
-    vertex_smooth dvLeft, vertex_smooth dvRight,
+    pixel_buffer *pixelBuffer, screen_transformer *st, lighting *l,
+    vertex leftStart, vertex rightStart, vertex dvLeft, vertex dvRight,
     f32 yTopF32, f32 yBottomF32)
 {
-    i16 xLeft;
-    i16 xRight;
     i16 yTop = RoundF32toI16(yTopF32);
     i16 yBottom = RoundF32toI16(yBottomF32);
-    vertex_smooth left = leftStart + Prestep(yTop, yTopF32, -dvLeft);
-    vertex_smooth right = rightStart + Prestep(yTop, yTopF32, -dvRight);
-    vertex_smooth leftToRightStep;
-    vertex_smooth inTriangleCoord;
-    f32 worldZ;
-    color c;
-
-    for (i16 y = yTop; y > yBottom; y--)
+    vertex left = leftStart + Prestep(yTop, yTopF32, -dvLeft);
+    vertex right = rightStart + Prestep(yTop, yTopF32, -dvRight);
+    __m128 laneIndex = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 xScale = _mm_set1_ps(1.0f / st->xFactor);
+    for (i16 y = yTop; y > yBottom; y--, left -= dvLeft, right -= dvRight)
     {
-        xLeft = RoundF32toI16(left.pos.x);
-        xRight = RoundF32toI16(right.pos.x);
-        leftToRightStep = VertexSlopeX(left, right);
-        inTriangleCoord = left + Prestep(xLeft, left.pos.x, leftToRightStep);
-
-        for (i16 x = xLeft; x < xRight; x++, inTriangleCoord -= leftToRightStep)
+        if (y < 0 || y >= pixelBuffer->height)
+            continue;
+        i32 xLeft = RoundF32toI16(left.pos.x);
+        i32 xRight = RoundF32toI16(right.pos.x);
+        i32 xStart = maxInt(xLeft, 0);
+        i32 xEnd = minInt(xRight, pixelBuffer->width);
+        if (xStart >= xEnd)
+            continue;
+
+        // NOTE: The steps are negative slopes (see VertexSlopeX).
+        vertex step = VertexSlopeX(left, right);
+        vertex spanStart = left + PrestepX(xLeft, left.pos.x, step);
+        i32 xGroup = xStart & ~3;
+        vertex start = spanStart - step * (f32)(xGroup - xLeft);
+        __m128 startInvZ = _mm_set1_ps(spanStart.pos.z);
+        __m128 stepInvZ = _mm_set1_ps(step.pos.z);
+        __m128 nxStep = _mm_set1_ps(-4.0f * step.normal.x);
+        __m128 nyStep = _mm_set1_ps(-4.0f * step.normal.y);
+        __m128 nzStep = _mm_set1_ps(-4.0f * step.normal.z);
+        __m128 nx = _mm_sub_ps(_mm_set1_ps(start.normal.x), _mm_mul_ps(laneIndex, _mm_set1_ps(step.normal.x)));
+        __m128 ny = _mm_sub_ps(_mm_set1_ps(start.normal.y), _mm_mul_ps(laneIndex, _mm_set1_ps(step.normal.y)));
+        __m128 nz = _mm_sub_ps(_mm_set1_ps(start.normal.z), _mm_mul_ps(laneIndex, _mm_set1_ps(step.normal.z)));
+        __m128 screenY = _mm_set1_ps(((f32)y - 0.5f) / st->yFactor - 1.0f);
+
+        u32 *row = (u32 *)pixelBuffer->memory + y * pixelBuffer->width;
+        f32 *zRow = pixelBuffer->zBuffer + y * pixelBuffer->width;
+        for (i32 x = xGroup; x < xEnd; x += 4)
         {
-            worldZ = 1.0f / inTriangleCoord.pos.z;
-            if (UpdateZBuffer(pixelBuffer, x, y, worldZ))
+            // NOTE: Lanes outside the span get depth 0 so they never pass.
+            i32 first = maxInt(xStart - x, 0);
+            i32 count = minInt(xEnd - x, 4);
+            f32 zValues[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            u32 colors[4] = {};
+            for (i32 i = first; i < count; i++)
+                zValues[i] = zRow[x + i];
+            __m128 oldZ = _mm_loadu_ps(zValues);
+            __m128 z = SpanDepth4(startInvZ, stepInvZ, _mm_add_ps(_mm_set1_ps((f32)(x - xLeft)), laneIndex));
+            __m128 passed = (pixelBuffer->depthTest == DEPTH_TEST_EQUAL) ? _mm_cmple_ps(z, _mm_mul_ps(oldZ, _mm_set1_ps(DEPTH_EQUAL_SCALE))) : _mm_cmplt_ps(z, oldZ);
+            i32 passedMask = _mm_movemask_ps(passed);
+            pixelBuffer->stats.testedFragments += count - first;
+            if (passedMask)
             {
-                vertex_smooth attr = inTriangleCoord * worldZ;
-                c = Vec3ToRGB(PhongShading(attr, l, m));
-                PutPixel(pixelBuffer, x, y, c);
+                _mm_storeu_ps(zValues, z);
+                __m128 screenX = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((f32)x + 0.5f), laneIndex), xScale), one);
+                __m128 px = _mm_mul_ps(screenX, z);
+                __m128 py = _mm_mul_ps(screenY, z);
+                i32 lightCount;
+                u16 *lightIndices = GetTileLights(l->grid, x, y, &lightCount);
+                __m128i lit = PhongShading4(l, lightIndices, lightCount,
+                                            _mm_mul_ps(nx, z), _mm_mul_ps(ny, z), _mm_mul_ps(nz, z), px, py, z);
+                _mm_storeu_si128((__m128i *)colors, lit);
+                for (i32 i = first; i < count; i++)
+                {
+                    if (passedMask & (1 << i))
+                    {
+                        // NOTE: The EQUAL test keeps the prepass depths, like UpdateZBuffer.
+                        if (pixelBuffer->depthTest != DEPTH_TEST_EQUAL)
+                            zRow[x + i] = zValues[i];
+                        row[x + i] = colors[i];
+                        pixelBuffer->stats.shadedFragments++;
+                    }
+                }
             }
+            nx = _mm_add_ps(nx, nxStep);
+            ny = _mm_add_ps(ny, nyStep);
+            nz = _mm_add_ps(nz, nzStep);
         }
-        left -= dvLeft;
-        right -= dvRight;
     }
 }
-*/
+
+// NOTE:
+// Depth only: no attributes are stepped along the spans, the zBuffer takes the
+// closest depth 4 pixels at a time. Edges are walked exactly like the shading
+// rasterizers so the depths match theirs bit for bit.
+static void DrawFlatTriangleDepth(
+    pixel_buffer *pixelBuffer,
+    vertex leftStart, vertex rightStart, vertex dvLeft, vertex dvRight,
+    f32 yTopF32, f32 yBottomF32)
+{
+    i16 yTop = RoundF32toI16(yTopF32);
+    i16 yBottom = RoundF32toI16(yBottomF32);
+    vertex left = leftStart + Prestep(yTop, yTopF32, -dvLeft);
+    vertex right = rightStart + Prestep(yTop, yTopF32, -dvRight);
+    __m128 laneIndex = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    for (i16 y = yTop; y > yBottom; y--, left -= dvLeft, right -= dvRight)
+    {
+        if (y < 0 || y >= pixelBuffer->height)
+            continue;
+        i32 xLeft = RoundF32toI16(left.pos.x);
+        i32 xRight = RoundF32toI16(right.pos.x);
+        i32 xStart = maxInt(xLeft, 0);
+        i32 xEnd = minInt(xRight, pixelBuffer->width);
+        if (xStart >= xEnd)
+            continue;
+
+        vertex step = VertexSlopeX(left, right);
+        f32 startInvZ = (left + PrestepX(xLeft, left.pos.x, step)).pos.z;
+        __m128 startInvZ4 = _mm_set1_ps(startInvZ);
+        __m128 stepInvZ4 = _mm_set1_ps(step.pos.z);
+        f32 *zRow = pixelBuffer->zBuffer + y * pixelBuffer->width;
+        i32 x = xStart;
+        for (; x + 4 <= xEnd; x += 4)
+        {
+            __m128 z = SpanDepth4(startInvZ4, stepInvZ4, _mm_add_ps(_mm_set1_ps((f32)(x - xLeft)), laneIndex));
+            _mm_storeu_ps(zRow + x, _mm_min_ps(z, _mm_loadu_ps(zRow + x)));
+        }
+        for (; x < xEnd; x++)
+            zRow[x] = minF32(SpanDepth(startInvZ, step.pos.z, x - xLeft), zRow[x]);
+        pixelBuffer->stats.depthFragments += xEnd - xStart;
+    }
+}
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // NOTE:  GENERIC Triangle Rendering
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -329,7 +1203,7 @@ static processed_triangle ProcessTriangle(triangle *t)
     return result;
 }
 
-static void DrawTriangleSolid(pixel_buffer *pixelBuffer, triangle t, color c)
+static void DrawTriangleSolid(pixel_buffer *pixelBuffer, triangle t, u32 c)
 {
     processed_triangle p = ProcessTriangle(&t);
 
@@ -346,39 +1220,65 @@ static void DrawTriangleSolid(pixel_buffer *pixelBuffer, triangle t, color c)
         DrawFlatTriangle(pixelBuffer, c, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
 }
 
-static void DrawTriangleTextured(pixel_buffer *pixelBuffer, triangle t, loaded_bitmap *bmp, vec3 shade)
+static void DrawTriangleDepth(pixel_buffer *pixelBuffer, triangle t)
 {
     processed_triangle p = ProcessTriangle(&t);
 
     // Top Half | Flat Bottom Triangle
     if (p.isLeftSideMajor)
-        DrawFlatTriangleTextured(pixelBuffer, bmp, shade, t.v0, t.v0, p.dv02, p.dv01, t.v0.pos.y, t.v1.pos.y);
+        DrawFlatTriangleDepth(pixelBuffer, t.v0, t.v0, p.dv02, p.dv01, t.v0.pos.y, t.v1.pos.y);
     else
-        DrawFlatTriangleTextured(pixelBuffer, bmp, shade, t.v0, t.v0, p.dv01, p.dv02, t.v0.pos.y, t.v1.pos.y);
+        DrawFlatTriangleDepth(pixelBuffer, t.v0, t.v0, p.dv01, p.dv02, t.v0.pos.y, t.v1.pos.y);
 
     //Bottom Half | Flat Top
     if (p.isLeftSideMajor)
-        DrawFlatTriangleTextured(pixelBuffer, bmp, shade, p.split, t.v1, p.dv02, p.dv12, t.v1.pos.y, t.v2.pos.y);
+        DrawFlatTriangleDepth(pixelBuffer, p.split, t.v1, p.dv02, p.dv12, t.v1.pos.y, t.v2.pos.y);
     else
-        DrawFlatTriangleTextured(pixelBuffer, bmp, shade, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
+        DrawFlatTriangleDepth(pixelBuffer, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
 }
 
-static processed_smooth_triangle ProcessSmoothTriangle(triangle_smooth *t)
+static void DrawTriangleTextured(pixel_buffer *pixelBuffer, triangle t, loaded_bitmap *bmp, vec3 shadeFactor)
 {
-    processed_smooth_triangle result = {};
-
-    // Sort by y: v0 is at the top, v2 at the bottom
-    if (t->v0.pos.y < t->v1.pos.y)
+    __m128i shade = Vec3ToShade88(shadeFactor);
+    texture_sampler sampler = GetTriangleSampler(bmp, &t);
+    bc1_block_cache blockCache;
+    if (bmp->mips[0].layout == TEXTURE_LAYOUT_BC1)
     {
-        std::swap(t->v0, t->v1);
-    }
-    if (t->v1.pos.y < t->v2.pos.y)
-    {
-        std::swap(t->v1, t->v2);
+        for (i32 i = 0; i < BC1_BLOCK_CACHE_SIZE; i++)
+            blockCache.tags[i] = 0;
+        sampler.blockCache = &blockCache;
     }
-    if (t->v0.pos.y < t->v1.pos.y)
-    {
-        std::swap(t->v0, t->v1);
+    processed_triangle p = ProcessTriangle(&t);
+
+    // Top Half | Flat Bottom Triangle
+    if (p.isLeftSideMajor)
+        DrawFlatTriangleTextured(pixelBuffer, &sampler, shade, t.v0, t.v0, p.dv02, p.dv01, t.v0.pos.y, t.v1.pos.y);
+    else
+        DrawFlatTriangleTextured(pixelBuffer, &sampler, shade, t.v0, t.v0, p.dv01, p.dv02, t.v0.pos.y, t.v1.pos.y);
+
+    //Bottom Half | Flat Top
+    if (p.isLeftSideMajor)
+        DrawFlatTriangleTextured(pixelBuffer, &sampler, shade, p.split, t.v1, p.dv02, p.dv12, t.v1.pos.y, t.v2.pos.y);
+    else
+        DrawFlatTriangleTextured(pixelBuffer, &sampler, shade, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
+}
+
+static processed_smooth_triangle ProcessSmoothTriangle(triangle_smooth *t)
+{
+    processed_smooth_triangle result = {};
+
+    // Sort by y: v0 is at the top, v2 at the bottom
+    if (t->v0.pos.y < t->v1.pos.y)
+    {
+        std::swap(t->v0, t->v1);
+    }
+    if (t->v1.pos.y < t->v2.pos.y)
+    {
+        std::swap(t->v1, t->v2);
+    }
+    if (t->v0.pos.y < t->v1.pos.y)
+    {
+        std::swap(t->v0, t->v1);
     }
 
     // Sort by x:
@@ -425,24 +1325,22 @@ static void DrawTriangleGouraudShaded(pixel_buffer *pixelBuffer, triangle_smooth
     else
         DrawFlatTriangleSmooth(pixelBuffer, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
 }
-/*
-static void DrawTrianglePhongShaded(pixel_buffer *pixelBuffer, triangle_smooth t, lighting l, material m)
+static void DrawTrianglePhongShaded(pixel_buffer *pixelBuffer, screen_transformer *st, triangle t, lighting *l)
 {
-    processed_smooth_triangle p = ProcessSmoothTriangle(&t);
+    processed_triangle p = ProcessTriangle(&t);
 
     // Top Half | Flat Bottom Triangle
     if (p.isLeftSideMajor)
-        DrawFlatTrianglePhong(pixelBuffer, l, m, t.v0, t.v0, p.dv02, p.dv01, t.v0.pos.y, t.v1.pos.y);
+        DrawFlatTrianglePhong(pixelBuffer, st, l, t.v0, t.v0, p.dv02, p.dv01, t.v0.pos.y, t.v1.pos.y);
     else
-        DrawFlatTrianglePhong(pixelBuffer, l, m, t.v0, t.v0, p.dv01, p.dv02, t.v0.pos.y, t.v1.pos.y);
+        DrawFlatTrianglePhong(pixelBuffer, st, l, t.v0, t.v0, p.dv01, p.dv02, t.v0.pos.y, t.v1.pos.y);
 
     //Bottom Half | Flat Top
     if (p.isLeftSideMajor)
-        DrawFlatTrianglePhong(pixelBuffer, l, m, p.split, t.v1, p.dv02, p.dv12, t.v1.pos.y, t.v2.pos.y);
+        DrawFlatTrianglePhong(pixelBuffer, st, l, p.split, t.v1, p.dv02, p.dv12, t.v1.pos.y, t.v2.pos.y);
     else
-        DrawFlatTrianglePhong(pixelBuffer, l, m, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
+        DrawFlatTrianglePhong(pixelBuffer, st, l, t.v1, p.split, p.dv12, p.dv02, t.v1.pos.y, t.v2.pos.y);
 }
-*/
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // NOTE:  Generic Mesh & Bitmap Rendering
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -539,7 +1437,7 @@ static void DrawObjectSolid(object *o, mat3 rot, vec3 trans,
 {
     triangle t;
     vec3 normal;
-    color c;
+    u32 c;
     for (i32 i = 0; i + 2 < o->nVertices; i += 3)
     {
         t.v[0] = o->vertices[i];
@@ -557,7 +1455,7 @@ static void DrawObjectSolid(object *o, mat3 rot, vec3 trans,
             TransformVertexToScreen(st, &t.v0);
             TransformVertexToScreen(st, &t.v1);
             TransformVertexToScreen(st, &t.v2);
-            c = Vec3ToRGB(o->mat);
+            c = Vec3ToU32(o->mat);
             DrawTriangleSolid(pb, t, c);
         }
     }
@@ -568,7 +1466,7 @@ static void DrawObjectFlatShaded(object *o, mat3 rot, vec3 trans, diffuse d, amb
 {
     triangle t;
     vec3 normal;
-    color c;
+    u32 c;
     for (i32 i = 0; i + 2 < o->nVertices; i += 3)
     {
         t.v[0] = o->vertices[i];
@@ -586,7 +1484,7 @@ static void DrawObjectFlatShaded(object *o, mat3 rot, vec3 trans, diffuse d, amb
             TransformVertexToScreen(st, &t.v0);
             TransformVertexToScreen(st, &t.v1);
             TransformVertexToScreen(st, &t.v2);
-            c = Vec3ToRGB(FlatShading(d, a, normal, o->mat));
+            c = Vec3ToU32(FlatShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat));
             DrawTriangleSolid(pb, t, c);
         }
     }
@@ -615,7 +1513,7 @@ static void DrawObjectTexturedFlatShaded(object *o, mat3 rot, vec3 trans, diffus
             TransformVertexToScreen(st, &t.v0);
             TransformVertexToScreen(st, &t.v1);
             TransformVertexToScreen(st, &t.v2);
-            shade = FlatShading(d, a, normal, o->mat);
+            shade = FlatShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat);
             DrawTriangleTextured(pb, t, o->texture, shade);
         }
     }
@@ -624,7 +1522,7 @@ static void DrawObjectTexturedFlatShaded(object *o, mat3 rot, vec3 trans, diffus
 static void DrawObjectCellShaded(object *o, mat3 rot, vec3 trans, diffuse d, ambient a, f32 th, f32 sf,
                                  pixel_buffer *pb, screen_transformer *st)
 {
-    color c;
+    u32 c;
     triangle t;
     vec3 normal;
     for (i32 i = 0; i + 2 < o->nVertices; i += 3)
@@ -643,7 +1541,7 @@ static void DrawObjectCellShaded(object *o, mat3 rot, vec3 trans, diffuse d, amb
             TransformVertexToScreen(st, &t.v0);
             TransformVertexToScreen(st, &t.v1);
             TransformVertexToScreen(st, &t.v2);
-            c = Vec3ToRGB(CellShading(d, a, normal, o->mat, th, sf));
+            c = Vec3ToU32(CellShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat, th, sf));
             DrawTriangleSolid(pb, t, c);
         }
     }
@@ -668,11 +1566,14 @@ static void TransformAndAssemble(vertex v0, vertex v1, vertex v2, mat3 rot, vec3
     tOut->v2.texCoord = v2.texCoord;
 }
 
-static void DrawObjectGouraudShaded(object *o, mat3 rot, vec3 trans, diffuse d, ambient a,
+static void DrawObjectGouraudShaded(object *o, mat3 rot, vec3 trans, lighting *l,
                                     pixel_buffer *pb, screen_transformer *st)
 {
     triangle_smooth t = {};
     vec3 normal;
+    vec3 viewPos[3];
+    bool isLit;
+    vec3 *colors = UseVertexLightingCache(o->lightingCache, o, rot, trans, l, &isLit);
     for (i32 i = 0; i + 2 < o->nVertices; i += 3)
     {
         TransformAndAssemble(o->vertices[i], o->vertices[i + 1], o->vertices[i + 2], rot, trans, &t);
@@ -680,44 +1581,225 @@ static void DrawObjectGouraudShaded(object *o, mat3 rot, vec3 trans, diffuse d,
         if ((normal * t.v0.pos) <= 0) // is visible
         {
             for (i8 vi = 0; vi < 3; vi++)
+            {
+                viewPos[vi] = t.v[vi].pos;
                 TransformVertexToScreen(st, &t.v[vi]);
-            GouraudShading(&t, d, a, o->mat, rot);
+            }
+            if (isLit)
+            {
+                for (i8 vi = 0; vi < 3; vi++)
+                    t.v[vi].color = colors[i + vi];
+            }
+            else
+            {
+                GouraudShading(&t, l, rot, viewPos, o->occlusion ? o->occlusion + i : 0);
+                if (colors)
+                {
+                    for (i8 vi = 0; vi < 3; vi++)
+                        colors[i + vi] = t.v[vi].color;
+                }
+            }
             DrawTriangleGouraudShaded(pb, t);
         }
     }
 }
-/*
-static void DrawObjectPhongShaded(object *o, mat3 rot, vec3 trans, diffuse d, ambient a, point_light p,
+// NOTE: Normals are rotated into view space per vertex; TransformVertexToScreen
+// divides them by z with the rest of the vertex.
+static void DrawObjectPhongShaded(object *o, mat3 rot, vec3 trans, lighting *l,
                                   pixel_buffer *pb, screen_transformer *st)
 {
-    triangle_smooth t = {};
+    triangle t;
     vec3 normal;
     for (i32 i = 0; i + 2 < o->nVertices; i += 3)
     {
-        TransformAndAssemble(o->vertices[i], o->vertices[i + 1], o->vertices[i + 2], rot, trans, &t);
+        t.v[0] = o->vertices[i];
+        t.v[1] = o->vertices[i + 1];
+        t.v[2] = o->vertices[i + 2];
+
+        t.v0.pos = t.v0.pos * rot + trans;
+        t.v1.pos = t.v1.pos * rot + trans;
+        t.v2.pos = t.v2.pos * rot + trans;
+
         normal = CrossProduct(t.v1.pos - t.v0.pos, t.v2.pos - t.v0.pos);
         if ((normal * t.v0.pos) <= 0) // is visible
         {
             for (i8 vi = 0; vi < 3; vi++)
+            {
+                t.v[vi].normal = t.v[vi].normal * rot;
                 TransformVertexToScreen(st, &t.v[vi]);
-            DrawTrianglePhongShaded(pb, t, {d, a, p}, o->mat);
+            }
+            DrawTrianglePhongShaded(pb, st, t, l);
         }
     }
 }
-*/
-static void DrawObject(object *o, diffuse d, ambient a, point_light l, shade_type shade,
-                       pixel_buffer *pb, screen_transformer *st)
+// NOTE: Stand-in for an object whose mesh is still streaming in: its bounding box.
+// vertices must have room for 36.
+static object GetPlaceholderBox(object *o, vertex *vertices)
+{
+    vec3 center = 0.5f * (o->boundsMin + o->boundsMax);
+    vec3 extent = 0.5f * (o->boundsMax - o->boundsMin);
+    vec3 x = {extent.x, 0.0f, 0.0f};
+    vec3 y = {0.0f, extent.y, 0.0f};
+    vec3 z = {0.0f, 0.0f, extent.z};
+
+    // NOTE: Each face is (normal, u, v) with u x v pointing out of the box.
+    vec3 faces[6][3] = {
+        {x, y, z}, {-x, z, y},
+        {y, z, x}, {-y, x, z},
+        {z, x, y}, {-z, y, x}};
+
+    for (i32 f = 0; f < 6; f++)
+    {
+        vec3 c = center + faces[f][0];
+        vec3 u = faces[f][1];
+        vec3 v = faces[f][2];
+        vec3 quad[4] = {c - u - v, c + u - v, c + u + v, c - u + v};
+        vertex *at = vertices + f * 6;
+        for (i32 i = 0; i < 6; i++)
+            at[i] = {};
+        at[0].pos = quad[0];
+        at[1].pos = quad[1];
+        at[2].pos = quad[2];
+        at[3].pos = quad[0];
+        at[4].pos = quad[2];
+        at[5].pos = quad[3];
+    }
+
+    object box = {};
+    box.loadState = ASSET_STATE_LOADED;
+    box.vertices = vertices;
+    box.nVertices = 36;
+    box.mat = 0.5f * o->mat;
+    box.orientation = o->orientation;
+    box.pos = o->pos;
+    return box;
+}
+
+static void DrawObjectPlaceholder(object *o, mat3 rot, vec3 trans, diffuse d, ambient a,
+                                  pixel_buffer *pb, screen_transformer *st)
+{
+    vertex vertices[36];
+    object box = GetPlaceholderBox(o, vertices);
+    DrawObjectFlatShaded(&box, rot, trans, d, a, pb, st);
+}
+
+// NOTE:
+// First pass of a depth prepass: the depth of the object, placeholder included,
+// transformed and culled the same way the shading passes do it.
+static void DrawObjectDepth(object *o, mat3 rotation, vec3 translation, pixel_buffer *pb, screen_transformer *st)
+{
+    if (o->loadState != ASSET_STATE_LOADED)
+    {
+        vertex vertices[36];
+        object box = GetPlaceholderBox(o, vertices);
+        DrawObjectDepth(&box, rotation, translation, pb, st);
+        return;
+    }
+    CompletePreviousReadsBeforeFutureReads;
+
+    triangle t;
+    vec3 normal;
+    for (i32 i = 0; i + 2 < o->nVertices; i += 3)
+    {
+        t.v[0] = o->vertices[i];
+        t.v[1] = o->vertices[i + 1];
+        t.v[2] = o->vertices[i + 2];
+
+        t.v0.pos = t.v0.pos * rotation + translation;
+        t.v1.pos = t.v1.pos * rotation + translation;
+        t.v2.pos = t.v2.pos * rotation + translation;
+
+        normal = CrossProduct(t.v1.pos - t.v0.pos, t.v2.pos - t.v0.pos);
+        if ((normal * t.v0.pos) <= 0) // is visible
+        {
+            TransformVertexToScreen(st, &t.v0);
+            TransformVertexToScreen(st, &t.v1);
+            TransformVertexToScreen(st, &t.v2);
+            DrawTriangleDepth(pb, t);
+        }
+    }
+}
+
+static void DrawObjectDepth(object *o, pixel_buffer *pb, screen_transformer *st)
 {
     mat3 rotation = RotateX(o->orientation.thetaX) *
                     RotateY(o->orientation.thetaY) *
                     RotateZ(o->orientation.thetaZ);
-    vec3 translation = o->pos;
+    DrawObjectDepth(o, rotation, o->pos, pb, st);
+}
+
+// NOTE:
+// The pixels DrawObject can touch: the projected corners of the object's
+// bounds, with a pixel of margin for rounding. Objects that reach behind the
+// near plane may cover the whole screen. Nothing is drawn without vertices or
+// a placeholder box, so unloaded objects without one are empty.
+static screen_rect GetObjectScreenRect(object *o, pixel_buffer *pb, screen_transformer *st)
+{
+    screen_rect result = {};
+    screen_rect screen = {0, 0, pb->width, pb->height};
+    if (o->loadState == ASSET_STATE_LOADED && o->nVertices == 0)
+        return result;
+
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    f32 minX = FLT_MAX;
+    f32 minY = FLT_MAX;
+    f32 maxX = -FLT_MAX;
+    f32 maxY = -FLT_MAX;
+    for (i32 i = 0; i < 8; i++)
+    {
+        vec3 corner = {(i & 1) ? o->boundsMax.x : o->boundsMin.x,
+                       (i & 2) ? o->boundsMax.y : o->boundsMin.y,
+                       (i & 4) ? o->boundsMax.z : o->boundsMin.z};
+        corner = corner * rotation + o->pos;
+        if (corner.z < 0.1f)
+            return screen;
+        f32 x = (corner.x / corner.z + 1.0f) * st->xFactor;
+        f32 y = (corner.y / corner.z + 1.0f) * st->yFactor;
+        minX = minF32(minX, x);
+        minY = minF32(minY, y);
+        maxX = maxF32(maxX, x);
+        maxY = maxF32(maxY, y);
+    }
+    result.minX = maxInt((i32)floorf(minX) - 1, 0);
+    result.minY = maxInt((i32)floorf(minY) - 1, 0);
+    result.maxX = minInt((i32)ceilf(maxX) + 2, pb->width);
+    result.maxY = minInt((i32)ceilf(maxY) + 2, pb->height);
+    return result;
+}
+
+static void DrawObject(object *o, mat3 rotation, vec3 translation, diffuse d, ambient a, light_grid *lights,
+                       shade_type shade, pixel_buffer *pb, screen_transformer *st)
+{
+    // NOTE: Flat and cell shading take the average of the SH ambient.
+    if (lights && lights->hasAmbientSH)
+        a = GetSHAverage(&lights->ambientSH);
 
-    if (o->texture)
+    if (o->loadState != ASSET_STATE_LOADED)
     {
+        DrawObjectPlaceholder(o, rotation, translation, d, a, pb, st);
+        return;
+    }
+    CompletePreviousReadsBeforeFutureReads;
+
+    // NOTE: Until its texture streams in the object is drawn untextured.
+    // Smooth shading needs vertex normals, objects without them are flat shaded.
+    bool isTextured = o->texture && o->texture->loadState == ASSET_STATE_LOADED;
+    bool isSmooth = shade == shade_type::GOURAUD || shade == shade_type::PHONG;
+    lighting l = {d, a, o->mat, lights};
+
+    // NOTE: A depth prepass is done by the caller: DrawObjectDepth for every
+    // object, then DrawObject with DEPTH_TEST_EQUAL, which shades only the
+    // closest fragments.
+    if (isTextured)
+    {
+        CompletePreviousReadsBeforeFutureReads;
         if (shade == shade_type::GOURAUD && o->hasNormals)
-            DrawObjectGouraudShaded(o, rotation, translation, d, a, pb, st);
-        else if (shade == shade_type::FLAT || (shade == shade_type::GOURAUD && !o->hasNormals))
+            DrawObjectGouraudShaded(o, rotation, translation, &l, pb, st);
+        else if (shade == shade_type::PHONG && o->hasNormals)
+            DrawObjectPhongShaded(o, rotation, translation, &l, pb, st);
+        else if (shade == shade_type::FLAT || (isSmooth && !o->hasNormals))
             DrawObjectTexturedFlatShaded(o, rotation, translation, d, a, pb, st);
         else if (shade == shade_type::CELL)
             DrawObjectCellShaded(o, rotation, translation, d, a, 0.6f, 0.7f, pb, st);
@@ -727,80 +1809,1315 @@ static void DrawObject(object *o, diffuse d, ambient a, point_light l, shade_typ
         if (shade == shade_type::SOLID)
             DrawObjectSolid(o, rotation, translation, pb, st);
         else if (shade == shade_type::GOURAUD && o->hasNormals)
-            DrawObjectGouraudShaded(o, rotation, translation, d, a, pb, st);
-        else if (shade == shade_type::FLAT || (shade == shade_type::GOURAUD && !o->hasNormals))
+            DrawObjectGouraudShaded(o, rotation, translation, &l, pb, st);
+        else if (shade == shade_type::PHONG && o->hasNormals)
+            DrawObjectPhongShaded(o, rotation, translation, &l, pb, st);
+        else if (shade == shade_type::FLAT || (isSmooth && !o->hasNormals))
             DrawObjectFlatShaded(o, rotation, translation, d, a, pb, st);
         else if (shade == shade_type::CELL)
             DrawObjectCellShaded(o, rotation, translation, d, a, 0.6f, 0.7f, pb, st);
-        //else if (shade == shade_type::PHONG && o->hasNormals)
-        //    DrawObjectPhongShaded(o, rotation, translation, d, a, l, pb, st);
     }
 }
 
-static void DrawBitmap(loaded_bitmap *bmp, i32 xPos, i32 yPos, pixel_buffer *pixelBuffer)
+static void DrawObject(object *o, diffuse d, ambient a, light_grid *lights, shade_type shade,
+                       pixel_buffer *pb, screen_transformer *st)
+{
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    DrawObject(o, rotation, o->pos, d, a, lights, shade, pb, st);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Instancing
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:
+// sinf and cosf of 4 angles at once, the Cephes single precision polynomials.
+// The angle is reduced to within pi/4 of a multiple of pi/2 in three steps.
+// Measured on 4 million evenly spaced angles with |x| < 8192, the results
+// are within 6e-8 of sinf and cosf and within 7.8e-8 of the exact values.
+static inline void SinCos4(__m128 x, __m128 *sinX, __m128 *cosX)
+{
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 sinSign = _mm_and_ps(x, signMask);
+    x = _mm_andnot_ps(signMask, x);
+
+    // NOTE: The octant, rounded up to even: which multiple of pi/4 x is near.
+    __m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.27323954473516f)));
+    j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+    __m128 y = _mm_cvtepi32_ps(j);
+    sinSign = _mm_xor_ps(sinSign, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29)));
+    __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29));
+    __m128 isSinPoly = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128()));
+
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+    __m128 z = _mm_mul_ps(x, x);
+
+    __m128 cosPoly = _mm_set1_ps(2.443315711809948e-5f);
+    cosPoly = _mm_add_ps(_mm_mul_ps(cosPoly, z), _mm_set1_ps(-1.388731625493765e-3f));
+    cosPoly = _mm_add_ps(_mm_mul_ps(cosPoly, z), _mm_set1_ps(4.166664568298827e-2f));
+    cosPoly = _mm_mul_ps(_mm_mul_ps(cosPoly, z), z);
+    cosPoly = _mm_add_ps(_mm_sub_ps(cosPoly, _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1.0f));
+
+    __m128 sinPoly = _mm_set1_ps(-1.9515295891e-4f);
+    sinPoly = _mm_add_ps(_mm_mul_ps(sinPoly, z), _mm_set1_ps(8.3321608736e-3f));
+    sinPoly = _mm_add_ps(_mm_mul_ps(sinPoly, z), _mm_set1_ps(-1.6666654611e-1f));
+    sinPoly = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sinPoly, z), x), x);
+
+    *sinX = _mm_xor_ps(_mm_blendv_ps(cosPoly, sinPoly, isSinPoly), sinSign);
+    *cosX = _mm_xor_ps(_mm_blendv_ps(sinPoly, cosPoly, isSinPoly), cosSign);
+}
+
+// NOTE:
+// Draws the object once per instance, at the instance's pos and orientation
+// instead of its own. The rotations are built 4 instances at a time, rows of
+// RotateX * RotateY * RotateZ written out, and instances whose bounding sphere
+// is outside the view (behind the eye or past a side of the screen) are culled
+// in the same pass. The rest go through the same shading paths as DrawObject,
+// one after the other, so the mesh stays in cache. The object's lighting
+// cache is left alone, every instance would replace it.
+static void DrawObjectInstanced(object *o, instance_data *instances, i32 count, diffuse d, ambient a,
+                                light_grid *lights, shade_type shade, pixel_buffer *pb, screen_transformer *st)
+{
+    object mesh = *o;
+    mesh.lightingCache = 0;
+    vec3 boundsCenter = 0.5f * (o->boundsMin + o->boundsMax);
+    __m128 radius = _mm_set1_ps(0.5f * (o->boundsMax - o->boundsMin).length());
+    __m128 sideRadius = _mm_mul_ps(radius, _mm_set1_ps(1.41421356f)); // NOTE: x = z is 45 degrees off
+    __m128 zero = _mm_setzero_ps();
+
+    for (i32 first = 0; first < count; first += 4)
+    {
+        i32 batchCount = minInt(count - first, 4);
+        f32 thetaX[4] = {};
+        f32 thetaY[4] = {};
+        f32 thetaZ[4] = {};
+        f32 posX[4] = {};
+        f32 posY[4] = {};
+        f32 posZ[4] = {};
+        for (i32 i = 0; i < batchCount; i++)
+        {
+            instance_data *instance = instances + first + i;
+            thetaX[i] = instance->orientation.thetaX;
+            thetaY[i] = instance->orientation.thetaY;
+            thetaZ[i] = instance->orientation.thetaZ;
+            posX[i] = instance->pos.x;
+            posY[i] = instance->pos.y;
+            posZ[i] = instance->pos.z;
+        }
+        __m128 sx, cx, sy, cy, sz, cz;
+        SinCos4(_mm_loadu_ps(thetaX), &sx, &cx);
+        SinCos4(_mm_loadu_ps(thetaY), &sy, &cy);
+        SinCos4(_mm_loadu_ps(thetaZ), &sz, &cz);
+
+        __m128 cell[3][3];
+        __m128 sxsy = _mm_mul_ps(sx, sy);
+        __m128 cxsy = _mm_mul_ps(cx, sy);
+        cell[0][0] = _mm_mul_ps(cy, cz);
+        cell[0][1] = _mm_mul_ps(cy, sz);
+        cell[0][2] = _mm_sub_ps(zero, sy);
+        cell[1][0] = _mm_sub_ps(_mm_mul_ps(sxsy, cz), _mm_mul_ps(cx, sz));
+        cell[1][1] = _mm_add_ps(_mm_mul_ps(sxsy, sz), _mm_mul_ps(cx, cz));
+        cell[1][2] = _mm_mul_ps(sx, cy);
+        cell[2][0] = _mm_add_ps(_mm_mul_ps(cxsy, cz), _mm_mul_ps(sx, sz));
+        cell[2][1] = _mm_sub_ps(_mm_mul_ps(cxsy, sz), _mm_mul_ps(sx, cz));
+        cell[2][2] = _mm_mul_ps(cx, cy);
+
+        // NOTE: Inside means the sphere reaches in front of the eye and inside
+        // the planes x = -z, x = z, y = -z and y = z the screen maps to.
+        __m128 center[3];
+        for (i32 col = 0; col < 3; col++)
+        {
+            center[col] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(boundsCenter.x), cell[0][col]),
+                                                _mm_mul_ps(_mm_set1_ps(boundsCenter.y), cell[1][col])),
+                                     _mm_mul_ps(_mm_set1_ps(boundsCenter.z), cell[2][col]));
+        }
+        center[0] = _mm_add_ps(center[0], _mm_loadu_ps(posX));
+        center[1] = _mm_add_ps(center[1], _mm_loadu_ps(posY));
+        center[2] = _mm_add_ps(center[2], _mm_loadu_ps(posZ));
+        __m128 reach = _mm_add_ps(center[2], sideRadius);
+        __m128 isInside = _mm_cmpgt_ps(_mm_add_ps(center[2], radius), zero);
+        isInside = _mm_and_ps(isInside, _mm_cmple_ps(center[0], reach));
+        isInside = _mm_and_ps(isInside, _mm_cmple_ps(_mm_sub_ps(zero, center[0]), reach));
+        isInside = _mm_and_ps(isInside, _mm_cmple_ps(center[1], reach));
+        isInside = _mm_and_ps(isInside, _mm_cmple_ps(_mm_sub_ps(zero, center[1]), reach));
+        i32 insideMask = _mm_movemask_ps(isInside) & ((1 << batchCount) - 1);
+        if (!insideMask)
+            continue;
+
+        f32 cells[3][3][4];
+        for (i32 row = 0; row < 3; row++)
+        {
+            for (i32 col = 0; col < 3; col++)
+                _mm_storeu_ps(cells[row][col], cell[row][col]);
+        }
+        for (i32 i = 0; i < batchCount; i++)
+        {
+            if (!(insideMask & (1 << i)))
+                continue;
+            mat3 rotation;
+            for (i32 row = 0; row < 3; row++)
+            {
+                for (i32 col = 0; col < 3; col++)
+                    rotation.cell[row][col] = cells[row][col][i];
+            }
+            DrawObject(&mesh, rotation, instances[first + i].pos, d, a, lights, shade, pb, st);
+        }
+    }
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Multi-View
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline vec3 ToRenderView(render_view *view, vec3 p)
+{
+    return (p - view->pos) * view->rotation;
+}
+
+// NOTE: Culls, projects and rasterizes the shared draw into one view.
+static void DrawMultiView(multi_view_draw *draw, render_view *view)
+{
+    object *o = draw->o;
+    pixel_buffer *pb = view->pb;
+    screen_transformer *st = &view->st;
+    vec3 p[3];
+    for (i32 i = 0; i + 2 < o->nVertices; i += 3)
+    {
+        for (i32 vi = 0; vi < 3; vi++)
+            p[vi] = ToRenderView(view, draw->positions[i + vi]);
+        vec3 normal = draw->isSolid ? CrossProduct(p[2] - p[0], p[1] - p[0])
+                                    : CrossProduct(p[1] - p[0], p[2] - p[0]);
+        if ((normal * p[0]) > 0) // is hidden
+            continue;
+
+        if (draw->isSmooth)
+        {
+            triangle_smooth t = {};
+            for (i32 vi = 0; vi < 3; vi++)
+            {
+                t.v[vi].pos = p[vi];
+                t.v[vi].texCoord = o->vertices[i + vi].texCoord;
+                TransformVertexToScreen(st, &t.v[vi]);
+                t.v[vi].color = draw->colors[i + vi];
+            }
+            DrawTriangleGouraudShaded(pb, t);
+        }
+        else
+        {
+            triangle t;
+            for (i32 vi = 0; vi < 3; vi++)
+            {
+                t.v[vi] = o->vertices[i + vi];
+                t.v[vi].pos = p[vi];
+                TransformVertexToScreen(st, &t.v[vi]);
+            }
+            if (draw->texture)
+                DrawTriangleTextured(pb, t, draw->texture, draw->colors[i / 3]);
+            else
+                DrawTriangleSolid(pb, t, Vec3ToU32(draw->colors[i / 3]));
+        }
+    }
+}
+
+static PLATFORM_WORK_QUEUE_CALLBACK(DrawMultiViewWork)
+{
+    multi_view_work *work = (multi_view_work *)data;
+    DrawMultiView(work->draw, work->view);
+}
+
+// NOTE:
+// Draws the object into several views at once, e.g. the two eyes of a stereo
+// pair. Everything that doesn't depend on the view is done once for all of
+// them: the transform into view space, the vertex shader, and the lighting.
+// None of the lighting has a specular term, so it doesn't depend on where the
+// eye is. Flat, cell and solid shading get a color per triangle, Gouraud and
+// Phong a color per vertex. Phong falls back to Gouraud here, because it
+// lights per pixel. Smooth vertices are lit by every point light of the grid,
+// since its screen tiles belong to the main view. lights may be 0. Then every
+// view is culled, projected and rasterized on its own thread from the high
+// priority queue. The main thread helps until all of them are done. The
+// scratch arrays come from arena.
+static void DrawObjectMultiView(object *o, diffuse d, ambient a, light_grid *lights, shade_type shade,
+                                void (*VertexShader)(vertex *, void *), void *vertexShaderProperties,
+                                render_view *views, i32 viewCount, memory_arena *arena, engine_memory *memory)
+{
+    if (o->loadState != ASSET_STATE_LOADED)
+    {
+        vertex vertices[36];
+        object box = GetPlaceholderBox(o, vertices);
+        DrawObjectMultiView(&box, d, a, lights, shade_type::FLAT, 0, 0, views, viewCount, arena, memory);
+        return;
+    }
+    CompletePreviousReadsBeforeFutureReads;
+    if (o->nVertices == 0 || viewCount == 0)
+        return;
+
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    multi_view_draw draw = {};
+    draw.o = o;
+    draw.isSmooth = (shade == shade_type::GOURAUD || shade == shade_type::PHONG) && o->hasNormals;
+    draw.isSolid = shade == shade_type::SOLID;
+    if (o->texture && o->texture->loadState == ASSET_STATE_LOADED && !draw.isSmooth && !draw.isSolid &&
+        shade != shade_type::CELL)
+        draw.texture = o->texture;
+    draw.positions = ReserveArrayMemory(arena, o->nVertices, vec3);
+    draw.colors = ReserveArrayMemory(arena, draw.isSmooth ? o->nVertices : o->nVertices / 3 + 1, vec3);
+
+    for (i32 i = 0; i < o->nVertices; i++)
+    {
+        vertex v = o->vertices[i];
+        v.pos = v.pos * rotation + o->pos;
+        if (VertexShader)
+            VertexShader(&v, vertexShaderProperties);
+        draw.positions[i] = v.pos;
+    }
+
+    // NOTE: Only triangles that face at least one view are lit. Turning doesn't
+    // change a dot product, so facing is tested in view space.
+    lighting l = {d, a, o->mat, lights};
+    u16 allLights[MAX_POINT_LIGHTS];
+    i32 lightCount = lights ? lights->lightCount : 0;
+    if (draw.isSmooth)
+    {
+        for (i32 li = 0; li < lightCount; li++)
+            allLights[li] = (u16)li;
+    }
+    else if (lights && lights->hasAmbientSH)
+    {
+        a = GetSHAverage(&lights->ambientSH);
+    }
+    for (i32 i = 0; i + 2 < o->nVertices; i += 3)
+    {
+        vec3 *p = draw.positions + i;
+        vec3 normal = CrossProduct(p[1] - p[0], p[2] - p[0]);
+        bool isFacing = false;
+        for (i32 v = 0; v < viewCount && !isFacing; v++)
+        {
+            f32 facing = normal * (p[0] - views[v].pos);
+            isFacing = draw.isSolid ? facing >= 0 : facing <= 0;
+        }
+        if (!isFacing)
+            continue;
+
+        if (draw.isSmooth)
+        {
+            f32 shadow[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+            if (d.shadow)
+            {
+                __m128 px = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[2].x);
+                __m128 py = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[2].y);
+                __m128 pz = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[2].z);
+                _mm_storeu_ps(shadow, SampleShadow4(d.shadow, px, py, pz));
+            }
+            for (i32 vi = 0; vi < 3; vi++)
+            {
+                draw.colors[i + vi] = LightVertex(&l, o->vertices[i + vi].normal * rotation, p[vi], shadow[vi],
+                                                  o->occlusion ? o->occlusion[i + vi] : 1.0f,
+                                                  allLights, lightCount);
+            }
+        }
+        else if (draw.isSolid)
+        {
+            draw.colors[i / 3] = o->mat;
+        }
+        else if (shade == shade_type::CELL)
+        {
+            draw.colors[i / 3] = CellShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat, 0.6f, 0.7f);
+        }
+        else
+        {
+            draw.colors[i / 3] = FlatShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat);
+        }
+    }
+
+    multi_view_work *work = ReserveArrayMemory(arena, viewCount, multi_view_work);
+    for (i32 i = 0; i < viewCount; i++)
+    {
+        work[i].draw = &draw;
+        work[i].view = views + i;
+        memory->PlatformAddWorkEntry(memory->highPriorityQueue, DrawMultiViewWork, work + i);
+    }
+    memory->PlatformCompleteAllWork(memory->highPriorityQueue);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Shadow Mapping
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeShadowMap(shadow_map *shadow, memory_arena *arena, i16 size)
+{
+    *shadow = {};
+    shadow->depth.zBuffer = ReserveArrayMemory(arena, size * size, f32);
+    shadow->depth.width = size;
+    shadow->depth.height = size;
+    shadow->depth.bytesPerPixel = 4;
+    shadow->depth.size = size * size * 4;
+    shadow->st.xFactor = 0.5f * (f32)size;
+    shadow->st.yFactor = 0.5f * (f32)size;
+}
+
+static inline vec3 ToLightSpace(shadow_map *shadow, vec3 p)
+{
+    p = p - shadow->origin;
+    return {p * shadow->axisX, p * shadow->axisY, p * shadow->axisZ};
+}
+
+// NOTE: Same as DrawObjectDepth, only the vertices go to light space.
+static void DrawObjectShadowDepth(shadow_map *shadow, object *o)
+{
+    if (o->loadState != ASSET_STATE_LOADED)
+    {
+        vertex vertices[36];
+        object box = GetPlaceholderBox(o, vertices);
+        DrawObjectShadowDepth(shadow, &box);
+        return;
+    }
+    CompletePreviousReadsBeforeFutureReads;
+
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    triangle t;
+    vec3 normal;
+    for (i32 i = 0; i + 2 < o->nVertices; i += 3)
+    {
+        t.v[0] = o->vertices[i];
+        t.v[1] = o->vertices[i + 1];
+        t.v[2] = o->vertices[i + 2];
+
+        t.v0.pos = ToLightSpace(shadow, t.v0.pos * rotation + o->pos);
+        t.v1.pos = ToLightSpace(shadow, t.v1.pos * rotation + o->pos);
+        t.v2.pos = ToLightSpace(shadow, t.v2.pos * rotation + o->pos);
+
+        normal = CrossProduct(t.v1.pos - t.v0.pos, t.v2.pos - t.v0.pos);
+        if ((normal * t.v0.pos) <= 0) // is visible
+        {
+            TransformVertexToScreen(&shadow->st, &t.v0);
+            TransformVertexToScreen(&shadow->st, &t.v1);
+            TransformVertexToScreen(&shadow->st, &t.v2);
+            DrawTriangleDepth(&shadow->depth, t);
+        }
+    }
+}
+
+// NOTE:
+// Draws the depth of the casters from the directional light. Nothing is drawn
+// when the light direction and every caster's pose and load state are the same
+// as last time. Returns whether the map was drawn.
+static bool RenderShadowMap(shadow_map *shadow, object **casters, i32 casterCount, vec3 lightDirection)
+{
+    casterCount = minInt(casterCount, SHADOW_MAX_CASTERS);
+    bool isSame = shadow->isValid && casterCount == shadow->casterCount &&
+                  lightDirection.x == shadow->lightDirection.x &&
+                  lightDirection.y == shadow->lightDirection.y &&
+                  lightDirection.z == shadow->lightDirection.z;
+    for (i32 i = 0; isSame && i < casterCount; i++)
+    {
+        shadow_caster_state *state = shadow->casters + i;
+        object *o = casters[i];
+        isSame = state->o == o && state->loadState == o->loadState &&
+                 state->orientation.thetaX == o->orientation.thetaX &&
+                 state->orientation.thetaY == o->orientation.thetaY &&
+                 state->orientation.thetaZ == o->orientation.thetaZ &&
+                 state->pos.x == o->pos.x && state->pos.y == o->pos.y && state->pos.z == o->pos.z;
+    }
+    if (isSame)
+        return false;
+
+    shadow->isValid = true;
+    shadow->renderCount++;
+    shadow->lightDirection = lightDirection;
+    shadow->casterCount = casterCount;
+    for (i32 i = 0; i < casterCount; i++)
+        shadow->casters[i] = {casters[i], casters[i]->loadState, casters[i]->orientation, casters[i]->pos};
+
+    // NOTE: A sphere around the casters' bounding spheres, grown one at a time.
+    vec3 center = {};
+    f32 radius = 0.0f;
+    for (i32 i = 0; i < casterCount; i++)
+    {
+        object *o = casters[i];
+        mat3 rotation = RotateX(o->orientation.thetaX) *
+                        RotateY(o->orientation.thetaY) *
+                        RotateZ(o->orientation.thetaZ);
+        vec3 c = 0.5f * (o->boundsMin + o->boundsMax) * rotation + o->pos;
+        f32 r = 0.5f * (o->boundsMax - o->boundsMin).length();
+        f32 d = (c - center).length();
+        if (i == 0 || d + radius <= r)
+        {
+            center = c;
+            radius = r;
+        }
+        else if (d + r > radius)
+        {
+            f32 grown = 0.5f * (d + r + radius);
+            center = center + (c - center) * ((grown - radius) / d);
+            radius = grown;
+        }
+    }
+    radius = maxF32(radius, 1e-3f);
+
+    // NOTE: x / z of the sphere stays under r / sqrt(d^2 - r^2) at distance d.
+    vec3 forward = lightDirection;
+    forward.normalize();
+    vec3 up = (fabsf(forward.y) < 0.9f) ? vec3{0.0f, 1.0f, 0.0f} : vec3{1.0f, 0.0f, 0.0f};
+    vec3 axisX = CrossProduct(up, forward);
+    axisX.normalize();
+    vec3 axisY = CrossProduct(forward, axisX);
+    f32 distance = 20.0f * radius;
+    f32 scale = 0.98f * sqrtf(distance * distance - radius * radius) / radius;
+    shadow->origin = center - forward * distance;
+    shadow->axisX = axisX * scale;
+    shadow->axisY = axisY * scale;
+    shadow->axisZ = forward;
+    // NOTE: About two texels of depth along a surface at 60 degrees to the light.
+    shadow->bias = 4.0f * 1.7f / (scale * (f32)shadow->depth.width);
+
+    ClearZBuffer(&shadow->depth);
+    for (i32 i = 0; i < casterCount; i++)
+        DrawObjectShadowDepth(shadow, casters[i]);
+    return true;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Impostors
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeImpostor(impostor *imp, memory_arena *arena)
+{
+    *imp = {};
+    imp->image.memory = ReserveArrayMemory(arena, IMPOSTOR_MAX_SIZE * IMPOSTOR_MAX_SIZE, u32);
+    imp->image.zBuffer = ReserveArrayMemory(arena, IMPOSTOR_MAX_SIZE * IMPOSTOR_MAX_SIZE, f32);
+    imp->image.bytesPerPixel = 4;
+}
+
+// NOTE: A view space direction in the space of an object turned by rotation.
+static inline vec3 ToObjectSpace(mat3 rotation, vec3 v)
+{
+    return {v.x * rotation.cell[0][0] + v.y * rotation.cell[0][1] + v.z * rotation.cell[0][2],
+            v.x * rotation.cell[1][0] + v.y * rotation.cell[1][1] + v.z * rotation.cell[1][2],
+            v.x * rotation.cell[2][0] + v.y * rotation.cell[2][1] + v.z * rotation.cell[2][2]};
+}
+
+// NOTE: Half the side, at depth 1, of the square the bounding sphere fills.
+static inline f32 GetImpostorExtent(f32 radius, f32 distance)
+{
+    return radius / sqrtf(maxF32(distance * distance - radius * radius, 1e-6f));
+}
+
+// NOTE:
+// Renders the impostor again if it no longer looks like the object (see
+// impostor). The image has about one texel per pixel at the distance it is
+// rendered from. Lit like DrawObject lights flat shaded objects. Returns
+// whether it was rendered.
+static bool RenderImpostor(impostor *imp, object *o, diffuse d, ambient a, light_grid *lights, screen_transformer *st)
+{
+    if (lights && lights->hasAmbientSH)
+        a = GetSHAverage(&lights->ambientSH);
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    vec3 center = 0.5f * (o->boundsMin + o->boundsMax) * rotation + o->pos;
+    f32 radius = 0.5f * (o->boundsMax - o->boundsMin).length();
+    f32 distance = center.length();
+    vec3 forward = center / distance;
+    vec3 viewDirection = ToObjectSpace(rotation, -forward);
+    vec3 lightDirection = ToObjectSpace(rotation, d.direction.normalized());
+    bool isTextured = o->texture && o->texture->loadState == ASSET_STATE_LOADED;
+
+    impostor_key key;
+    memset(&key, 0, sizeof(key));
+    key.vertices = o->vertices;
+    key.nVertices = o->nVertices;
+    key.occlusion = o->occlusion;
+    key.mat = o->mat;
+    key.intensity = d.intensity;
+    if (isTextured)
+    {
+        key.texture = o->texture;
+        key.texturePixels = o->texture->pixels;
+        key.textureFilter = o->texture->filter;
+    }
+    bool isSame = imp->isValid && memcmp(&key, &imp->key, sizeof(key)) == 0 &&
+                  viewDirection * imp->viewDirection >= IMPOSTOR_MIN_COS &&
+                  lightDirection * imp->lightDirection >= IMPOSTOR_MIN_COS &&
+                  fabsf(distance - imp->distance) <= IMPOSTOR_MAX_DISTANCE_CHANGE * imp->distance &&
+                  fabsf(a.r - imp->a.r) <= IMPOSTOR_MAX_AMBIENT_CHANGE &&
+                  fabsf(a.g - imp->a.g) <= IMPOSTOR_MAX_AMBIENT_CHANGE &&
+                  fabsf(a.b - imp->a.b) <= IMPOSTOR_MAX_AMBIENT_CHANGE;
+    if (isSame)
+        return false;
+
+    imp->key = key;
+    imp->viewDirection = viewDirection;
+    imp->lightDirection = lightDirection;
+    imp->a = a;
+    imp->distance = distance;
+    imp->extent = GetImpostorExtent(radius, distance);
+    imp->isValid = true;
+    imp->renderCount++;
+
+    i16 size = (i16)minInt(maxInt((i32)ceilf(2.0f * imp->extent * st->xFactor), 1), IMPOSTOR_MAX_SIZE);
+    pixel_buffer *image = &imp->image;
+    image->width = size;
+    image->height = size;
+    image->size = size * size * image->bytesPerPixel;
+    memset(image->memory, 0, image->size);
+    ClearZBuffer(image);
+    screen_transformer imageSt = {0.5f * (f32)size, 0.5f * (f32)size};
+
+    vec3 up = (fabsf(forward.y) < 0.9f) ? vec3{0.0f, 1.0f, 0.0f} : vec3{1.0f, 0.0f, 0.0f};
+    imp->axisZ = forward;
+    imp->axisX = CrossProduct(up, forward).normalized();
+    imp->axisY = CrossProduct(forward, imp->axisX);
+    vec3 scaledX = imp->axisX / imp->extent;
+    vec3 scaledY = imp->axisY / imp->extent;
+
+    // NOTE: Culled and shaded in view space, drawn in impostor space.
+    triangle t;
+    vec3 viewPos[3];
+    for (i32 i = 0; i + 2 < o->nVertices; i += 3)
+    {
+        for (i32 vi = 0; vi < 3; vi++)
+        {
+            t.v[vi] = o->vertices[i + vi];
+            viewPos[vi] = t.v[vi].pos * rotation + o->pos;
+        }
+        vec3 normal = CrossProduct(viewPos[1] - viewPos[0], viewPos[2] - viewPos[0]);
+        if ((normal * viewPos[0]) <= 0) // is visible
+        {
+            for (i32 vi = 0; vi < 3; vi++)
+            {
+                t.v[vi].pos = {viewPos[vi] * scaledX, viewPos[vi] * scaledY, viewPos[vi] * imp->axisZ};
+                TransformVertexToScreen(&imageSt, &t.v[vi]);
+            }
+            vec3 shade = FlatShading(d, OccludeAmbient(a, o->occlusion, i), normal, o->mat);
+            if (isTextured)
+                DrawTriangleTextured(image, t, o->texture, shade);
+            else
+                DrawTriangleSolid(image, t, Vec3ToU32(shade));
+        }
+    }
+    return true;
+}
+
+// NOTE:
+// The image stands on a plane through the object's center, facing the eye as
+// it was when rendered, and keeps the world size it had then. Its corners on
+// the screen bound what DrawImpostor touches.
+static screen_rect GetImpostorScreenRect(impostor *imp, object *o, pixel_buffer *pb, screen_transformer *st)
+{
+    screen_rect result = {};
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    vec3 center = 0.5f * (o->boundsMin + o->boundsMax) * rotation + o->pos;
+    f32 halfSide = imp->extent * imp->distance;
+    f32 minX = FLT_MAX;
+    f32 minY = FLT_MAX;
+    f32 maxX = -FLT_MAX;
+    f32 maxY = -FLT_MAX;
+    for (i32 i = 0; i < 4; i++)
+    {
+        vec3 corner = center + ((i & 1) ? halfSide : -halfSide) * imp->axisX +
+                      ((i & 2) ? halfSide : -halfSide) * imp->axisY;
+        if (corner.z < 0.1f)
+            return {0, 0, pb->width, pb->height};
+        minX = minF32(minX, (corner.x / corner.z + 1.0f) * st->xFactor);
+        minY = minF32(minY, (corner.y / corner.z + 1.0f) * st->yFactor);
+        maxX = maxF32(maxX, (corner.x / corner.z + 1.0f) * st->xFactor);
+        maxY = maxF32(maxY, (corner.y / corner.z + 1.0f) * st->yFactor);
+    }
+    result.minX = maxInt((i32)floorf(minX), 0);
+    result.minY = maxInt((i32)floorf(minY), 0);
+    result.maxX = minInt((i32)ceilf(maxX) + 1, pb->width);
+    result.maxY = minInt((i32)ceilf(maxY) + 1, pb->height);
+    return result;
+}
+
+// NOTE:
+// The ray of every pixel (sampled where the rasterizers sample it) is cut with
+// the image plane, 4 pixels at a time, and takes the texel whose sample is
+// nearest. Texel rows are sampled at y - 0.5, so v is moved up a row. Depth is
+// the texel's offset from the plane along axisZ, added to where the ray cuts
+// the plane. Empty texels and pixels behind the zBuffer are left alone.
+static void DrawImpostor(impostor *imp, object *o, pixel_buffer *pb, screen_transformer *st)
+{
+    if (!imp->isValid)
+        return;
+    screen_rect r = GetImpostorScreenRect(imp, o, pb, st);
+    if (IsEmptyRect(r))
+        return;
+
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    vec3 center = 0.5f * (o->boundsMin + o->boundsMax) * rotation + o->pos;
+    vec3 axisX = imp->axisX;
+    vec3 axisY = imp->axisY;
+    vec3 axisZ = imp->axisZ;
+    pixel_buffer *image = &imp->image;
+    f32 texelScale = 0.5f * (f32)image->width / (imp->extent * imp->distance);
+
+    __m128 laneIndex = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 xScale = _mm_set1_ps(1.0f / st->xFactor);
+    __m128 planeDepth = _mm_set1_ps(center * axisZ);
+    __m128 centerU = _mm_set1_ps(center * axisX);
+    __m128 centerV = _mm_set1_ps(center * axisY);
+    __m128 scale = _mm_set1_ps(texelScale);
+    __m128 half = _mm_set1_ps(0.5f * (f32)image->width);
+    __m128 halfPlusOne = _mm_set1_ps(0.5f * (f32)image->width + 1.0f);
+    for (i32 y = r.minY; y < r.maxY; y++)
+    {
+        f32 screenY = ((f32)y - 0.5f) / st->yFactor - 1.0f;
+        u32 *row = (u32 *)pb->memory + y * pb->width;
+        f32 *zRow = pb->zBuffer + y * pb->width;
+        for (i32 x = r.minX; x < r.maxX; x += 4)
+        {
+            // NOTE: The ray is (screenX, screenY, 1), it cuts the plane at t.
+            __m128 screenX = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((f32)x + 0.5f), laneIndex), xScale), _mm_set1_ps(1.0f));
+            __m128 rayZ = _mm_add_ps(_mm_add_ps(_mm_mul_ps(screenX, _mm_set1_ps(axisZ.x)), _mm_set1_ps(screenY * axisZ.y)), _mm_set1_ps(axisZ.z));
+            __m128 rayU = _mm_add_ps(_mm_add_ps(_mm_mul_ps(screenX, _mm_set1_ps(axisX.x)), _mm_set1_ps(screenY * axisX.y)), _mm_set1_ps(axisX.z));
+            __m128 rayV = _mm_add_ps(_mm_add_ps(_mm_mul_ps(screenX, _mm_set1_ps(axisY.x)), _mm_set1_ps(screenY * axisY.y)), _mm_set1_ps(axisY.z));
+            __m128 t = _mm_div_ps(planeDepth, rayZ);
+            __m128 u = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(t, rayU), centerU), scale), half);
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(t, rayV), centerV), scale), halfPlusOne);
+
+            i32 texelX[4];
+            i32 texelY[4];
+            f32 rayDepth[4];
+            _mm_storeu_si128((__m128i *)texelX, _mm_cvttps_epi32(_mm_floor_ps(u)));
+            _mm_storeu_si128((__m128i *)texelY, _mm_cvttps_epi32(_mm_floor_ps(v)));
+            _mm_storeu_ps(rayDepth, t);
+            for (i32 i = 0; i < 4 && x + i < r.maxX; i++)
+            {
+                if (texelX[i] < 0 || texelX[i] >= image->width || texelY[i] < 0 || texelY[i] >= image->height)
+                    continue;
+                i32 texel = texelY[i] * image->width + texelX[i];
+                f32 texelDepth = image->zBuffer[texel];
+                if (texelDepth == FLT_MAX)
+                    continue;
+                // NOTE: The ray's z is 1, so t is the view space z where it cuts the plane.
+                f32 z = rayDepth[i] + (texelDepth - imp->distance) * axisZ.z;
+                pb->stats.testedFragments++;
+                if (z < zRow[x + i])
+                {
+                    zRow[x + i] = z;
+                    row[x + i] = ((u32 *)image->memory)[texel];
+                    pb->stats.shadedFragments++;
+                }
+            }
+        }
+    }
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Environment Lighting
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:
+// Adds the light of an equirectangular environment to sh. x goes once around
+// the y axis, rows go from straight down (-y) to straight up (+y), texels are
+// radiance, 255 being scale. Every texel is weighted by the solid angle it
+// covers. A mip level of at most 64 texels across is plenty for 9 coefficients.
+// Virtual textures aren't supported.
+static bool ProjectEnvironmentToSH(sh9 *sh, loaded_bitmap *bmp, f32 scale)
+{
+    if (bmp->loadState != ASSET_STATE_LOADED || bmp->mipCount == 0)
+        return false;
+    CompletePreviousReadsBeforeFutureReads;
+
+    i32 level = 0;
+    while (level + 1 < bmp->mipCount && bmp->mips[level].width > 64)
+        level++;
+    bitmap_mip *mip = bmp->mips + level;
+    if (mip->layout == TEXTURE_LAYOUT_VIRTUAL)
+        return false;
+
+    bc1_block_cache blockCache;
+    for (i32 i = 0; i < BC1_BLOCK_CACHE_SIZE; i++)
+        blockCache.tags[i] = 0;
+    f32 texelAngle = (6.2831853f / (f32)mip->width) * (3.1415927f / (f32)mip->height);
+    for (i32 y = 0; y < mip->height; y++)
+    {
+        f32 theta = 3.1415927f * (1.0f - ((f32)y + 0.5f) / (f32)mip->height);
+        f32 sinTheta = sinf(theta);
+        f32 weight = scale * texelAngle * sinTheta / 255.0f;
+        for (i32 x = 0; x < mip->width; x++)
+        {
+            f32 phi = 6.2831853f * ((f32)x + 0.5f) / (f32)mip->width;
+            vec3 direction = {sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi)};
+            u32 texel = (mip->layout == TEXTURE_LAYOUT_BC1) ? FetchBC1Texel(&blockCache, mip, x, y)
+                                                            : mip->GetTexel(x, y);
+            vec3 radiance = {(f32)((texel >> 16) & 0xFF), (f32)((texel >> 8) & 0xFF), (f32)(texel & 0xFF)};
+            f32 basis[SH_COEFFICIENT_COUNT];
+            GetSHBasis(direction, basis);
+            for (i32 i = 0; i < SH_COEFFICIENT_COUNT; i++)
+                sh->c[i] += radiance * (weight * basis[i] * shCosineLobe[i]);
+        }
+    }
+    return true;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Visibility Buffer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeVisibilityBuffer(visibility_buffer *vb, memory_arena *arena, i32 width, i32 height)
+{
+    vb->width = width;
+    vb->height = height;
+    vb->ids = ReserveArrayMemory(arena, width * height, u32);
+    vb->drawCount = 0;
+}
+
+static void ClearVisibilityBuffer(visibility_buffer *vb)
 {
-    i32 minX = xPos;
-    i32 minY = yPos;
-    i32 maxX = xPos + bmp->width;
-    i32 maxY = yPos + bmp->height;
-    i32 clipLeft = 0;
-    i32 clipTop = 0;
-    i32 clipRight = 0;
-    i32 clipBottom = 0;
+    memset(vb->ids, 0, (size_t)vb->width * vb->height * sizeof(u32));
+    vb->drawCount = 0;
+}
 
-    if (minX < 0)
+// NOTE:
+// First pass: only depth and the triangle id are written, with the solid
+// triangle rasterizer (the ids take the place of the color). Only Gouraud
+// vertices are lit here. Everything the shading pass reads is reserved from
+// frameArena, which must live until ShadeVisibilityBuffer. Draws past
+// VISIBILITY_MAX_DRAWS are dropped.
+static void VisibilityDrawObject(visibility_buffer *vb, memory_arena *frameArena,
+                                 object *o, diffuse d, ambient a, light_grid *lights, shade_type shade,
+                                 pixel_buffer *pb, screen_transformer *st)
+{
+    if (vb->drawCount == VISIBILITY_MAX_DRAWS)
+        return;
+    if (lights && lights->hasAmbientSH)
+        a = GetSHAverage(&lights->ambientSH);
+    if (o->loadState != ASSET_STATE_LOADED)
     {
-        clipLeft -= minX;
-        minX = 0;
+        object box = GetPlaceholderBox(o, ReserveArrayMemory(frameArena, 36, vertex));
+        VisibilityDrawObject(vb, frameArena, &box, d, a, lights, shade_type::FLAT, pb, st);
+        return;
     }
-    if (minY < 0)
+    CompletePreviousReadsBeforeFutureReads;
+
+    mat3 rotation = RotateX(o->orientation.thetaX) *
+                    RotateY(o->orientation.thetaY) *
+                    RotateZ(o->orientation.thetaZ);
+    vec3 translation = o->pos;
+
+    // NOTE: Same fallbacks as DrawObject, but textured solid objects are drawn
+    // in their material color instead of not at all.
+    bool isSmooth = shade == shade_type::GOURAUD || shade == shade_type::PHONG;
+    visibility_draw *draw = vb->draws + vb->drawCount++;
+    draw->shade = (isSmooth && !o->hasNormals) ? shade_type::FLAT : shade;
+    draw->texture = (o->texture && o->texture->loadState == ASSET_STATE_LOADED) ? o->texture : 0;
+    CompletePreviousReadsBeforeFutureReads;
+    draw->l = {d, a, o->mat, lights};
+    draw->vertices = ReserveArrayMemory(frameArena, o->nVertices, vertex);
+    draw->occlusion = o->occlusion;
+    draw->colors = 0;
+    bool isLit = false;
+    if (draw->shade == shade_type::GOURAUD)
     {
-        clipBottom -= minY;
-        minY = 0;
+        draw->colors = UseVertexLightingCache(o->lightingCache, o, rotation, translation, &draw->l, &isLit);
+        if (!draw->colors)
+            draw->colors = ReserveArrayMemory(frameArena, o->nVertices, vec3);
+    }
+
+    bool isSolid = draw->shade == shade_type::SOLID;
+    pixel_buffer idBuffer = *pb;
+    idBuffer.memory = vb->ids;
+    u32 drawId = (u32)vb->drawCount << VISIBILITY_TRIANGLE_BITS;
+    i32 triangleCount = minInt(o->nVertices / 3, VISIBILITY_TRIANGLE_MASK + 1);
+    triangle t;
+    for (i32 triangleIndex = 0; triangleIndex < triangleCount; triangleIndex++)
+    {
+        vertex *v = draw->vertices + 3 * triangleIndex;
+        for (i8 vi = 0; vi < 3; vi++)
+        {
+            v[vi] = o->vertices[3 * triangleIndex + vi];
+            v[vi].pos = v[vi].pos * rotation + translation;
+            v[vi].normal = v[vi].normal * rotation;
+            t.v[vi] = v[vi];
+        }
+
+        // NOTE: Solid objects are culled the other way round, see DrawObjectSolid.
+        vec3 normal = isSolid ? CrossProduct(t.v2.pos - t.v0.pos, t.v1.pos - t.v0.pos)
+                              : CrossProduct(t.v1.pos - t.v0.pos, t.v2.pos - t.v0.pos);
+        if ((normal * t.v0.pos) <= 0) // is visible
+        {
+            for (i8 vi = 0; vi < 3; vi++)
+                TransformVertexToScreen(st, &t.v[vi]);
+            if (draw->colors && !isLit)
+            {
+                triangle_smooth smooth = {};
+                vec3 viewPos[3];
+                for (i8 vi = 0; vi < 3; vi++)
+                {
+                    viewPos[vi] = v[vi].pos;
+                    smooth.v[vi].pos = t.v[vi].pos;
+                    smooth.v[vi].normal = o->vertices[3 * triangleIndex + vi].normal;
+                }
+                GouraudShading(&smooth, &draw->l, rotation, viewPos,
+                               o->occlusion ? o->occlusion + 3 * triangleIndex : 0);
+                for (i8 vi = 0; vi < 3; vi++)
+                    draw->colors[3 * triangleIndex + vi] = smooth.v[vi].color;
+            }
+            DrawTriangleSolid(&idBuffer, t, drawId | (u32)triangleIndex);
+        }
+    }
+}
+
+// NOTE: Direct mapped on the triangle index, so neighbouring triangles don't collide.
+static visibility_triangle *GetVisibilityTriangle(visibility_buffer *vb, visibility_triangle *cache, u32 id,
+                                                  screen_transformer *st, bc1_block_cache *blockCache)
+{
+    visibility_triangle *tri = cache + (id & (VISIBILITY_CACHE_SIZE - 1));
+    if (tri->id == id)
+        return tri;
+
+    tri->id = id;
+    tri->draw = vb->draws + (id >> VISIBILITY_TRIANGLE_BITS) - 1;
+    vertex *v = tri->draw->vertices + 3 * (id & VISIBILITY_TRIANGLE_MASK);
+    for (i32 i = 0; i < 3; i++)
+        tri->v[i] = v[i];
+    vec3 p0 = v[0].pos;
+    vec3 e1 = v[1].pos - p0;
+    vec3 e2 = v[2].pos - p0;
+    tri->n = CrossProduct(e1, e2);
+    tri->m1 = CrossProduct(e2, p0);
+    tri->m2 = CrossProduct(p0, e1);
+    tri->d = p0 * tri->n;
+
+    lighting *l = &tri->draw->l;
+    ambient a = OccludeAmbient(l->a, tri->draw->occlusion, 3 * (i32)(id & VISIBILITY_TRIANGLE_MASK));
+    switch (tri->draw->shade)
+    {
+    case shade_type::SOLID:
+        tri->flatColor = Vec3ToU32(l->m);
+        break;
+    case shade_type::CELL:
+        tri->flatColor = Vec3ToU32(CellShading(l->d, a, tri->n, l->m, 0.6f, 0.7f));
+        break;
+    case shade_type::FLAT:
+        if (tri->draw->texture)
+        {
+            triangle t = {v[0], v[1], v[2]};
+            for (i8 vi = 0; vi < 3; vi++)
+                TransformVertexToScreen(st, &t.v[vi]);
+            tri->sampler = GetTriangleSampler(tri->draw->texture, &t);
+            tri->sampler.blockCache = blockCache;
+            tri->shade = Vec3ToShade88(FlatShading(l->d, a, tri->n, l->m));
+        }
+        else
+        {
+            tri->flatColor = Vec3ToU32(FlatShading(l->d, a, tri->n, l->m));
+        }
+        break;
+    default:
+        break;
+    }
+    return tri;
+}
+
+// NOTE:
+// Second pass: every covered pixel is shaded once. Pixels go 4 at a time like
+// in DrawFlatTrianglePhong. Each lane is rebuilt from its triangle at the point
+// the rasterizer sampled it, then the Phong lanes of one draw and the textured
+// lanes of one triangle are shaded together. Unused lanes keep harmless values.
+static void ShadeVisibilityRows(visibility_buffer *vb, pixel_buffer *pb, screen_transformer *st, i32 yStart, i32 yEnd)
+{
+    visibility_triangle cache[VISIBILITY_CACHE_SIZE];
+    for (i32 i = 0; i < VISIBILITY_CACHE_SIZE; i++)
+        cache[i].id = 0;
+    bc1_block_cache blockCache;
+    for (i32 i = 0; i < BC1_BLOCK_CACHE_SIZE; i++)
+        blockCache.tags[i] = 0;
+
+    f32 xScale = 1.0f / st->xFactor;
+    f32 yScale = 1.0f / st->yFactor;
+    for (i32 y = yStart; y < yEnd; y++)
+    {
+        u32 *ids = vb->ids + y * vb->width;
+        u32 *row = (u32 *)pb->memory + y * pb->width;
+        vec3 r = {0.0f, ((f32)y - 0.5f) * yScale - 1.0f, 1.0f};
+        for (i32 x = 0; x < vb->width; x += 4)
+        {
+            i32 count = minInt(vb->width - x, 4);
+            u32 laneIds[4] = {};
+            for (i32 i = 0; i < count; i++)
+                laneIds[i] = ids[x + i];
+            if ((laneIds[0] | laneIds[1] | laneIds[2] | laneIds[3]) == 0)
+                continue;
+
+            f32 nx[4] = {};
+            f32 ny[4] = {};
+            f32 nz[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+            f32 px[4] = {};
+            f32 py[4] = {};
+            f32 pz[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+            f32 u[4] = {};
+            f32 v[4] = {};
+            u32 colors[4];
+            visibility_draw *draws[4];
+            i32 batchMask = 0;
+            for (i32 i = 0; i < count; i++)
+            {
+                if (!laneIds[i])
+                    continue;
+                visibility_triangle *tri = GetVisibilityTriangle(vb, cache, laneIds[i], st, &blockCache);
+                r.x = ((f32)(x + i) + 0.5f) * xScale - 1.0f;
+                f32 rn = 1.0f / (r * tri->n);
+                f32 b1 = (r * tri->m1) * rn;
+                f32 b2 = (r * tri->m2) * rn;
+                draws[i] = tri->draw;
+                switch (tri->draw->shade)
+                {
+                case shade_type::GOURAUD:
+                {
+                    vec3 *c = tri->draw->colors + 3 * (laneIds[i] & VISIBILITY_TRIANGLE_MASK);
+                    colors[i] = Vec3ToU32(Saturated(c[0] + b1 * (c[1] - c[0]) + b2 * (c[2] - c[0])));
+                }
+                break;
+                case shade_type::PHONG:
+                {
+                    vertex *tv = tri->v;
+                    vec3 n = tv[0].normal + b1 * (tv[1].normal - tv[0].normal) + b2 * (tv[2].normal - tv[0].normal);
+                    f32 z = tri->d * rn;
+                    nx[i] = n.x;
+                    ny[i] = n.y;
+                    nz[i] = n.z;
+                    px[i] = r.x * z;
+                    py[i] = r.y * z;
+                    pz[i] = z;
+                    batchMask |= 1 << i;
+                }
+                break;
+                case shade_type::FLAT:
+                    if (tri->draw->texture)
+                    {
+                        vertex *tv = tri->v;
+                        vec2 uv = tv[0].texCoord + b1 * (tv[1].texCoord - tv[0].texCoord) +
+                                  b2 * (tv[2].texCoord - tv[0].texCoord);
+                        u[i] = uv.x;
+                        v[i] = uv.y;
+                        batchMask |= 1 << i;
+                    }
+                    else
+                    {
+                        colors[i] = tri->flatColor;
+                    }
+                    break;
+                default:
+                    colors[i] = tri->flatColor;
+                    break;
+                }
+            }
+
+            while (batchMask)
+            {
+                i32 lead = 0;
+                while (!(batchMask & (1 << lead)))
+                    lead++;
+                visibility_draw *draw = draws[lead];
+                bool isPhong = draw->shade == shade_type::PHONG;
+                i32 mask = 0;
+                for (i32 i = lead; i < 4; i++)
+                {
+                    bool isSameBatch = isPhong ? draws[i] == draw : laneIds[i] == laneIds[lead];
+                    if ((batchMask & (1 << i)) && isSameBatch)
+                        mask |= 1 << i;
+                }
+
+                u32 shaded[4];
+                if (isPhong)
+                {
+                    i32 lightCount;
+                    u16 *lightIndices = GetTileLights(draw->l.grid, x, y, &lightCount);
+                    __m128i lit = PhongShading4(&draw->l, lightIndices, lightCount,
+                                                _mm_loadu_ps(nx), _mm_loadu_ps(ny), _mm_loadu_ps(nz),
+                                                _mm_loadu_ps(px), _mm_loadu_ps(py), _mm_loadu_ps(pz));
+                    _mm_storeu_si128((__m128i *)shaded, lit);
+                }
+                else
+                {
+                    visibility_triangle *tri = GetVisibilityTriangle(vb, cache, laneIds[lead], st, &blockCache);
+                    SampleTexture4(&tri->sampler, u, v, shaded);
+                    _mm_storeu_si128((__m128i *)shaded, ModulateTexels4(_mm_loadu_si128((__m128i *)shaded), tri->shade));
+                }
+                for (i32 i = lead; i < 4; i++)
+                {
+                    if (mask & (1 << i))
+                        colors[i] = shaded[i];
+                }
+                batchMask &= ~mask;
+            }
+
+            for (i32 i = 0; i < count; i++)
+            {
+                if (laneIds[i])
+                    row[x + i] = colors[i];
+            }
+        }
     }
-    if (maxX > pixelBuffer->width)
+}
+
+static PLATFORM_WORK_QUEUE_CALLBACK(ShadeVisibilityWork)
+{
+    visibility_shade_work *work = (visibility_shade_work *)data;
+    ShadeVisibilityRows(work->vb, work->pb, work->st, work->yStart, work->yEnd);
+}
+
+// NOTE:
+// Bands of rows go to the high priority queue as separate entries and the main
+// thread helps until all of them are done. Draws rasterized with
+// VisibilityDrawObject must be shaded before anything else is drawn on top.
+static void ShadeVisibilityBuffer(visibility_buffer *vb, pixel_buffer *pb, screen_transformer *st,
+                                  engine_memory *memory)
+{
+    if (vb->drawCount == 0)
+        return;
+
+    i32 bandHeight = maxInt(VISIBILITY_BAND_HEIGHT, (vb->height + VISIBILITY_MAX_BANDS - 1) / VISIBILITY_MAX_BANDS);
+    i32 bandCount = 0;
+    for (i32 y = 0; y < vb->height; y += bandHeight)
     {
-        clipRight = maxX - pixelBuffer->width;
-        maxX = pixelBuffer->width;
+        visibility_shade_work *work = vb->work + bandCount++;
+        work->vb = vb;
+        work->pb = pb;
+        work->st = st;
+        work->yStart = y;
+        work->yEnd = minInt(y + bandHeight, vb->height);
+        memory->PlatformAddWorkEntry(memory->highPriorityQueue, ShadeVisibilityWork, work);
     }
-    if (maxY > pixelBuffer->height)
+    memory->PlatformCompleteAllWork(memory->highPriorityQueue);
+}
+
+// NOTE:
+// source + dest * (1 - source alpha) for 4 premultiplied pixels, after the whole
+// source is scaled by opacity (8.8 fixed point, 256 is opaque, one per 16 bit lane).
+static inline __m128i BlendPremultiplied4(__m128i source, __m128i dest, __m128i opacity)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(256);
+    __m128i round = _mm_set1_epi16(128);
+    __m128i sourceLo = _mm_mullo_epi16(_mm_unpacklo_epi8(source, zero), opacity);
+    __m128i sourceHi = _mm_mullo_epi16(_mm_unpackhi_epi8(source, zero), opacity);
+    sourceLo = _mm_srli_epi16(_mm_add_epi16(sourceLo, round), 8);
+    sourceHi = _mm_srli_epi16(_mm_add_epi16(sourceHi, round), 8);
+    __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceLo, 0xFF), 0xFF);
+    __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceHi, 0xFF), 0xFF);
+    __m128i inverseLo = _mm_sub_epi16(full, _mm_add_epi16(alphaLo, _mm_srli_epi16(alphaLo, 7)));
+    __m128i inverseHi = _mm_sub_epi16(full, _mm_add_epi16(alphaHi, _mm_srli_epi16(alphaHi, 7)));
+    __m128i destLo = _mm_mullo_epi16(_mm_unpacklo_epi8(dest, zero), inverseLo);
+    __m128i destHi = _mm_mullo_epi16(_mm_unpackhi_epi8(dest, zero), inverseHi);
+    destLo = _mm_srli_epi16(_mm_add_epi16(destLo, round), 8);
+    destHi = _mm_srli_epi16(_mm_add_epi16(destHi, round), 8);
+    return _mm_packus_epi16(_mm_add_epi16(sourceLo, destLo), _mm_add_epi16(sourceHi, destHi));
+}
+
+// NOTE:
+// Bitmaps are premultiplied at import (see ImportBitmap). Opaque linear bitmaps
+// drawn at full opacity are copied row by row, everything else is blended 4
+// pixels at a time. Tiled, Morton and BC1 bitmaps are fetched by coordinate.
+// Only the pixels inside clip are drawn.
+static void DrawBitmap(loaded_bitmap *bmp, i32 xPos, i32 yPos, pixel_buffer *pixelBuffer, screen_rect clip)
+{
+    i32 minX = maxInt(maxInt(xPos, 0), clip.minX);
+    i32 minY = maxInt(maxInt(yPos, 0), clip.minY);
+    i32 maxX = minInt(minInt(xPos + bmp->width, pixelBuffer->width), clip.maxX);
+    i32 maxY = minInt(minInt(yPos + bmp->height, pixelBuffer->height), clip.maxY);
+    u32 opacity = (u32)(minF32(maxF32(bmp->opacity, 0.0f), 1.0f) * 256.0f);
+    if (minX >= maxX || minY >= maxY || opacity == 0)
+        return;
+
+    i32 width = maxX - minX;
+    bool isLinear = bmp->mips[0].layout == TEXTURE_LAYOUT_LINEAR;
+    if (isLinear && bmp->isOpaque && opacity == 256)
     {
-        clipTop = maxY - pixelBuffer->height;
-        maxY = pixelBuffer->height;
+        for (i32 y = minY; y < maxY; y++)
+        {
+            u32 *source = bmp->pixels + (y - yPos) * bmp->width + (minX - xPos);
+            u32 *dest = (u32 *)pixelBuffer->memory + y * pixelBuffer->width + minX;
+            memcpy(dest, source, width * sizeof(u32));
+        }
+        return;
     }
-    u32 *source = (u32 *)bmp->pixels + clipLeft + clipBottom * bmp->width;
-    u32 *dest = (u32 *)pixelBuffer->memory + minY * pixelBuffer->width + minX;
+
+    __m128i opacity4 = _mm_set1_epi16((i16)opacity);
     for (i32 y = minY; y < maxY; y++)
     {
-        for (i32 x = minX; x < maxX; x++)
+        u32 *source = bmp->pixels + (y - yPos) * bmp->width + (minX - xPos);
+        u32 *dest = (u32 *)pixelBuffer->memory + y * pixelBuffer->width + minX;
+        for (i32 x = 0; x < width; x += 4)
         {
-            f32 A = (f32)((*source >> 24) & 0xFF) / 255.0f;
-            A *= bmp->opacity;
-            f32 SR = (f32)((*source >> 16) & 0xFF);
-            f32 SG = (f32)((*source >> 8) & 0xFF);
-            f32 SB = (f32)((*source >> 0) & 0xFF);
+            i32 count = minInt(width - x, 4);
+            if (isLinear && count == 4)
+            {
+                __m128i texels = _mm_loadu_si128((__m128i *)(source + x));
+                __m128i pixels = _mm_loadu_si128((__m128i *)(dest + x));
+                _mm_storeu_si128((__m128i *)(dest + x), BlendPremultiplied4(texels, pixels, opacity4));
+                continue;
+            }
 
-            f32 DR = (f32)((*dest >> 16) & 0xFF);
-            f32 DG = (f32)((*dest >> 8) & 0xFF);
-            f32 DB = (f32)((*dest >> 0) & 0xFF);
+            u32 texels[4] = {};
+            u32 pixels[4] = {};
+            for (i32 i = 0; i < count; i++)
+            {
+                texels[i] = isLinear ? source[x + i] : bmp->GetColorU32(minX - xPos + x + i, y - yPos);
+                pixels[i] = dest[x + i];
+            }
+            __m128i blended = BlendPremultiplied4(_mm_loadu_si128((__m128i *)texels),
+                                                  _mm_loadu_si128((__m128i *)pixels), opacity4);
+            _mm_storeu_si128((__m128i *)pixels, blended);
+            for (i32 i = 0; i < count; i++)
+                dest[x + i] = pixels[i];
+        }
+    }
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// NOTE:  Sprites
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void InitializeSpriteBatch(sprite_batch *batch, memory_arena *arena, i32 capacity)
+{
+    batch->sprites = ReserveArrayMemory(arena, capacity, sprite);
+    batch->count = 0;
+    batch->capacity = capacity;
+    batch->depthTest = false;
+}
 
-            // TODO(casey): Someday, we need to talk about premultiplied alpha!
-            // (this is not premultiplied alpha)
-            f32 R = (1.0f - A) * DR + A * SR;
-            f32 G = (1.0f - A) * DG + A * SG;
-            f32 B = (1.0f - A) * DB + A * SB;
+// NOTE: Sprites past the capacity are dropped for this frame.
+static void PushSprite(sprite_batch *batch, loaded_bitmap *bitmap, f32 x, f32 y,
+                       f32 scale, f32 rotation, f32 opacity, f32 depth)
+{
+    if (batch->count < batch->capacity)
+        batch->sprites[batch->count++] = {bitmap, x, y, scale, rotation, opacity, depth};
+}
+
+// NOTE:
+// Walks the screen bounding box of the rotated quad 4 pixels at a time and maps
+// every pixel center back into the texture (inverse rotation over scale).
+// Pixels outside the bitmap or behind the zBuffer get a transparent texel, so
+// the blend leaves them as they were. The mip level keeps about one texel per
+// pixel when the sprite is shrunk.
+static void DrawSprite(pixel_buffer *pixelBuffer, sprite *s, bool depthTest, bc1_block_cache *blockCache)
+{
+    loaded_bitmap *bmp = s->bitmap;
+    if (s->scale <= 0.0f)
+        return;
+    f32 cosR = cosf(s->rotation);
+    f32 sinR = sinf(s->rotation);
+    f32 halfWidth = 0.5f * (f32)bmp->width * s->scale;
+    f32 halfHeight = 0.5f * (f32)bmp->height * s->scale;
+    f32 extentX = fabsf(cosR) * halfWidth + fabsf(sinR) * halfHeight;
+    f32 extentY = fabsf(sinR) * halfWidth + fabsf(cosR) * halfHeight;
+    i32 minX = maxInt((i32)floorf(s->x - extentX), 0);
+    i32 minY = maxInt((i32)floorf(s->y - extentY), 0);
+    i32 maxX = minInt((i32)ceilf(s->x + extentX), pixelBuffer->width);
+    i32 maxY = minInt((i32)ceilf(s->y + extentY), pixelBuffer->height);
+    u32 opacity = (u32)(minF32(maxF32(s->opacity, 0.0f), 1.0f) * 256.0f);
+    if (minX >= maxX || minY >= maxY || opacity == 0)
+        return;
+
+    i32 level = 0;
+    if (s->scale < 1.0f)
+        level = minInt((i32)log2f(1.0f / s->scale), bmp->mipCount - 1);
+    bitmap_mip *mip = bmp->mips + level;
+    f32 mipWidth = (f32)mip->width;
+    f32 mipHeight = (f32)mip->height;
+    f32 texelsPerPixelX = mipWidth / ((f32)bmp->width * s->scale);
+    f32 texelsPerPixelY = mipHeight / ((f32)bmp->height * s->scale);
+    f32 dudx = cosR * texelsPerPixelX;
+    f32 dudy = sinR * texelsPerPixelX;
+    f32 dvdx = -sinR * texelsPerPixelY;
+    f32 dvdy = cosR * texelsPerPixelY;
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 maxU = _mm_set1_ps(mipWidth);
+    __m128 maxV = _mm_set1_ps(mipHeight);
+    __m128i lastX = _mm_set1_epi32(mip->width - 1);
+    __m128i lastY = _mm_set1_epi32(mip->height - 1);
+    __m128 laneIndex = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 depth = _mm_set1_ps(s->depth);
+    __m128i opacity4 = _mm_set1_epi16((i16)opacity);
+    i32 width = maxX - minX;
+    for (i32 y = minY; y < maxY; y++)
+    {
+        f32 dx = (f32)minX + 0.5f - s->x;
+        f32 dy = (f32)y + 0.5f - s->y;
+        f32 rowU = dx * dudx + dy * dudy + 0.5f * mipWidth;
+        f32 rowV = dx * dvdx + dy * dvdy + 0.5f * mipHeight;
+        u32 *dest = (u32 *)pixelBuffer->memory + y * pixelBuffer->width + minX;
+        f32 *zBuffer = pixelBuffer->zBuffer + y * pixelBuffer->width + minX;
+        for (i32 x = 0; x < width; x += 4)
+        {
+            i32 count = minInt(width - x, 4);
+            __m128 step = _mm_add_ps(_mm_set1_ps((f32)x), laneIndex);
+            __m128 u = _mm_add_ps(_mm_set1_ps(rowU), _mm_mul_ps(step, _mm_set1_ps(dudx)));
+            __m128 v = _mm_add_ps(_mm_set1_ps(rowV), _mm_mul_ps(step, _mm_set1_ps(dvdx)));
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmplt_ps(u, maxU)),
+                                       _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmplt_ps(v, maxV)));
+            inside = _mm_and_ps(inside, _mm_cmplt_ps(step, _mm_set1_ps((f32)width)));
+            if (depthTest)
+            {
+                f32 z[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+                for (i32 i = 0; i < count; i++)
+                    z[i] = zBuffer[x + i];
+                inside = _mm_and_ps(inside, _mm_cmplt_ps(depth, _mm_loadu_ps(z)));
+            }
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
 
-            *dest = (((u32)(R + 0.5f) << 16) |
-                     ((u32)(G + 0.5f) << 8) |
-                     ((u32)(B + 0.5f) << 0));
-            dest++;
-            source++;
+            __m128i texelX = _mm_min_epi32(_mm_cvttps_epi32(_mm_max_ps(u, zero)), lastX);
+            __m128i texelY = _mm_min_epi32(_mm_cvttps_epi32(_mm_max_ps(v, zero)), lastY);
+            __m128i texels = _mm_and_si128(GatherTexels4(mip, blockCache, texelX, texelY), _mm_castps_si128(inside));
+            if (count == 4)
+            {
+                __m128i pixels = _mm_loadu_si128((__m128i *)(dest + x));
+                _mm_storeu_si128((__m128i *)(dest + x), BlendPremultiplied4(texels, pixels, opacity4));
+            }
+            else
+            {
+                u32 pixels[4] = {};
+                for (i32 i = 0; i < count; i++)
+                    pixels[i] = dest[x + i];
+                __m128i blended = BlendPremultiplied4(texels, _mm_loadu_si128((__m128i *)pixels), opacity4);
+                _mm_storeu_si128((__m128i *)pixels, blended);
+                for (i32 i = 0; i < count; i++)
+                    dest[x + i] = pixels[i];
+            }
         }
-        dest += pixelBuffer->width - bmp->width + clipLeft + clipRight; // - bmp->width + maxXsource;
-        source += clipLeft + clipRight;
     }
 }
 
+// NOTE:
+// Sprites are drawn back to front so blending stays correct, and sprites at the
+// same depth (a HUD layer, a particle sheet) are grouped by bitmap so they reuse
+// the same cached texels and BC1 blocks. The batch is empty afterwards.
+static void DrawSpriteBatch(sprite_batch *batch, pixel_buffer *pixelBuffer)
+{
+    std::sort(batch->sprites, batch->sprites + batch->count,
+              [](const sprite &a, const sprite &b) {
+                  if (a.depth != b.depth)
+                      return a.depth > b.depth;
+                  return a.bitmap < b.bitmap;
+              });
+
+    // NOTE: Tags are block addresses, so one cache serves every bitmap in the batch.
+    bc1_block_cache blockCache;
+    for (i32 i = 0; i < BC1_BLOCK_CACHE_SIZE; i++)
+        blockCache.tags[i] = 0;
+    for (i32 i = 0; i < batch->count; i++)
+    {
+        sprite *s = batch->sprites + i;
+        if (s->bitmap->loadState != ASSET_STATE_LOADED)
+            continue;
+        CompletePreviousReadsBeforeFutureReads;
+        DrawSprite(pixelBuffer, s, batch->depthTest, &blockCache);
+    }
+    batch->count = 0;
+}
+
 /*
 static inline u32 GetTextureWrapColorU32(loaded_bitmap *bmp, vec2 coord)
 {
@@ -837,7 +3154,7 @@ static void DrawFlatTriangleTextureWrap(
         xLeft = RoundF32toI16(left.pos.x);
         xRight = RoundF32toI16(right.pos.x);
         leftToRightStep = (right - left) / (right.pos.x - left.pos.x);
-        texCoord = left + Prestep(xLeft, left.pos.x, leftToRightStep);
+        texCoord = left + PrestepX(xLeft, left.pos.x, leftToRightStep);
 
         for (i16 x = xLeft; x < xRight; x++, texCoord += leftToRightStep)
         {
@@ -4,6 +4,25 @@
 #include "hy3d_vertex.h"
 #include <math.h>
 
+// NOTE: EQUAL is for the second pass over depth laid down by DrawObjectDepth:
+// only the closest fragment of every pixel passes and the zBuffer isn't written.
+// The passes compute depth the same way, but -fp:fast may still reorder the edge
+// math differently in each rasterizer, so "equal" allows a few ulps.
+#define DEPTH_EQUAL_SCALE (1.0f + 1.0f / 65536.0f)
+enum depth_test
+{
+    DEPTH_TEST_LESS,
+    DEPTH_TEST_EQUAL
+};
+
+// NOTE: Counted by the rasterizers, the engine clears them every frame.
+struct pipeline_stats
+{
+    u64 depthFragments;  // NOTE: Written by the depth only pass
+    u64 testedFragments; // NOTE: Depth tested by the shading rasterizers
+    u64 shadedFragments; // NOTE: Passed the depth test and were shaded
+};
+
 struct pixel_buffer
 {
     void *memory;
@@ -12,6 +31,17 @@ struct pixel_buffer
     i16 height;
     i8 bytesPerPixel;
     i32 size;
+    depth_test depthTest;
+    pipeline_stats stats;
+};
+
+// NOTE: Pixels minX to maxX - 1 and minY to maxY - 1, empty when either is reversed.
+struct screen_rect
+{
+    i32 minX;
+    i32 minY;
+    i32 maxX;
+    i32 maxY;
 };
 
 struct color
@@ -30,6 +60,36 @@ static inline color Vec3ToRGB(vec3 color_in)
     return result;
 }
 
+// NOTE: Same as Vec3ToRGB but straight to the frame buffer format (0x00RRGGBB).
+static inline u32 Vec3ToU32(vec3 color_in)
+{
+    __m128 c = _mm_mul_ps(_mm_setr_ps(color_in.b, color_in.g, color_in.r, 0.0f), _mm_set1_ps(255.0f));
+    __m128i i = _mm_cvtps_epi32(c);
+    i = _mm_packs_epi32(i, i);
+    return (u32)_mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+}
+
+// NOTE:
+// A shade factor as 8.8 fixed point, one 16 bit lane per channel of a packed
+// texel (b, g, r, a). The alpha lane is 0 so modulated colors come out with the
+// top byte cleared, the way the frame buffer wants them.
+static inline __m128i Vec3ToShade88(vec3 shade)
+{
+    __m128i s = _mm_cvtps_epi32(_mm_mul_ps(_mm_setr_ps(shade.b, shade.g, shade.r, 0.0f), _mm_set1_ps(256.0f)));
+    s = _mm_min_epi32(s, _mm_set1_epi32(256));
+    s = _mm_packs_epi32(s, s);
+    return s;
+}
+
+// NOTE: texel * shade >> 8 per channel, 4 packed texels at once.
+static inline __m128i ModulateTexels4(__m128i texels, __m128i shade)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(texels, zero), shade), 8);
+    __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(texels, zero), shade), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
 struct triangle
 {
     union
@@ -83,25 +143,213 @@ struct screen_transformer
     f32 yFactor;
 };
 
+// NOTE:
+// One more eye for DrawObjectMultiView, with its own pixel buffer. It sits at
+// pos in view space, and rotation turns view space into its own:
+// p' = (p - pos) * rotation.
+struct render_view
+{
+    pixel_buffer *pb;
+    screen_transformer st;
+    vec3 pos;
+    mat3 rotation;
+};
+
+// NOTE: Assets are filled in by the loader threads. Their data may only be
+// read after loadState is ASSET_STATE_LOADED. A failed asset (missing or
+// unreadable file) is never retried and is drawn like one that isn't ready.
+enum asset_state
+{
+    ASSET_STATE_UNLOADED,
+    ASSET_STATE_QUEUED,
+    ASSET_STATE_LOADED,
+    ASSET_STATE_FAILED
+};
+
+#define MAX_MIP_LEVELS 21
+
+enum texture_filter
+{
+    TEXTURE_FILTER_NEAREST,     // nearest texel of the base level
+    TEXTURE_FILTER_NEAREST_MIP, // nearest texel of the level picked per triangle
+    TEXTURE_FILTER_BILINEAR,    // bilinear inside the level picked per triangle
+    TEXTURE_FILTER_TRILINEAR,   // bilinear in the two closest levels, blended
+    TEXTURE_FILTER_COUNT
+};
+
+// NOTE:
+// How the texels of a mip level are ordered in memory. Values are stored in the
+// asset files, don't reorder them.
+//      LINEAR      rows bottom-up, pitch == width
+//      TILED_4X4   4x4 tiles (one 64 byte cache line each) in row order,
+//                  texels row order inside a tile
+//      TILED_8X8   same with 8x8 tiles
+//      MORTON      Z-order over the level padded to powers of two
+//      BC1         compressed 4x4 blocks of 8 bytes in row order, decoded when
+//                  sampled (see DecodeBC1Palette)
+//      VIRTUAL     not in memory, pages of a virtual_texture (runtime only)
+// Tiled and Morton keep the 2D neighbourhood of a texel close in memory, so
+// walking a texture down or diagonally doesn't touch a new line every texel.
+// BC1 takes 1/8 of the memory at the cost of a lossy encode at import time.
+enum texture_layout
+{
+    TEXTURE_LAYOUT_LINEAR,
+    TEXTURE_LAYOUT_TILED_4X4,
+    TEXTURE_LAYOUT_TILED_8X8,
+    TEXTURE_LAYOUT_MORTON,
+    TEXTURE_LAYOUT_BC1,
+    TEXTURE_LAYOUT_VIRTUAL,
+    TEXTURE_LAYOUT_COUNT
+};
+
+// NOTE: Spreads the low 16 bits of n to the even bits.
+static inline u32 Part1By1(u32 n)
+{
+    n &= 0x0000FFFF;
+    n = (n | (n << 8)) & 0x00FF00FF;
+    n = (n | (n << 4)) & 0x0F0F0F0F;
+    n = (n | (n << 2)) & 0x33333333;
+    n = (n | (n << 1)) & 0x55555555;
+    return n;
+}
+
+static inline u32 Expand565(u32 c)
+{
+    u32 r = (c >> 11) & 0x1F;
+    u32 g = (c >> 5) & 0x3F;
+    u32 b = (c >> 0) & 0x1F;
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+// NOTE:
+// A BC1 block is two u32s: color0 and color1 (RGB 565) in the first, then 2 bit
+// palette indices for the 16 texels, row by row, first texel in the low bits.
+// color0 > color1 selects 4 opaque colors (the endpoints and 1/3, 2/3 between
+// them). Otherwise it is 3 colors (the endpoints and the midpoint) and index 3
+// is transparent black.
+static inline void DecodeBC1Palette(u32 colors, u32 *palette)
+{
+    u32 c0 = colors & 0xFFFF;
+    u32 c1 = colors >> 16;
+    u32 a = Expand565(c0);
+    u32 b = Expand565(c1);
+    palette[0] = a;
+    palette[1] = b;
+    palette[2] = 0xFF000000;
+    palette[3] = 0xFF000000;
+    for (u32 shift = 0; shift < 24; shift += 8)
+    {
+        u32 ca = (a >> shift) & 0xFF;
+        u32 cb = (b >> shift) & 0xFF;
+        if (c0 > c1)
+        {
+            palette[2] |= ((2 * ca + cb) / 3) << shift;
+            palette[3] |= ((ca + 2 * cb) / 3) << shift;
+        }
+        else
+        {
+            palette[2] |= ((ca + cb) / 2) << shift;
+        }
+    }
+    if (c0 <= c1)
+        palette[3] = 0;
+}
+
+// NOTE: Defined with the virtual texture cache (hy3d_engine.h, hy3d_renderer.cpp).
+struct virtual_texture;
+static u32 FetchVirtualTexel(virtual_texture *texture, i32 level, i32 x, i32 y);
+
+struct bitmap_mip
+{
+    i32 width;
+    i32 height;
+    u32 *pixels;
+    texture_layout layout;
+    u32 blockShift;   // NOTE: Tiled and BC1: log2 of the tile side. Morton: bits interleaved on both axes.
+    u32 blocksPerRow; // NOTE: Tiled and BC1 only
+    virtual_texture *virtualTexture; // NOTE: Virtual only
+    i32 level;                       // NOTE: Virtual only
+
+    // NOTE: BC1 only.
+    inline u32 *GetBlock(i32 x, i32 y)
+    {
+        return pixels + 2 * (((u32)y >> 2) * blocksPerRow + ((u32)x >> 2));
+    }
+
+    inline u32 GetTexelIndex(i32 x, i32 y)
+    {
+        switch (layout)
+        {
+        case TEXTURE_LAYOUT_TILED_4X4:
+        case TEXTURE_LAYOUT_TILED_8X8:
+        {
+            u32 mask = (1u << blockShift) - 1;
+            u32 tile = ((u32)y >> blockShift) * blocksPerRow + ((u32)x >> blockShift);
+            return (tile << (2 * blockShift)) | (((u32)y & mask) << blockShift) | ((u32)x & mask);
+        }
+        case TEXTURE_LAYOUT_MORTON:
+        {
+            // NOTE: Past the interleaved bits only the longer axis has bits left.
+            u32 mask = (1u << blockShift) - 1;
+            u32 rest = ((u32)x >> blockShift) | ((u32)y >> blockShift);
+            return (rest << (2 * blockShift)) | Part1By1((u32)x & mask) | (Part1By1((u32)y & mask) << 1);
+        }
+        default:
+            return (u32)(x + y * width);
+        }
+    }
+
+    // NOTE: BC1 texels are decoded one by one here, samplers go through a
+    // bc1_block_cache instead.
+    inline u32 GetTexel(i32 x, i32 y)
+    {
+        if (layout == TEXTURE_LAYOUT_VIRTUAL)
+            return FetchVirtualTexel(virtualTexture, level, x, y);
+        if (layout == TEXTURE_LAYOUT_BC1)
+        {
+            u32 *block = GetBlock(x, y);
+            u32 palette[4];
+            DecodeBC1Palette(block[0], palette);
+            return palette[(block[1] >> (2 * ((y & 3) * 4 + (x & 3)))) & 3];
+        }
+        return pixels[GetTexelIndex(x, y)];
+    }
+};
+
+struct asset_slot;
 struct loaded_bitmap
 {
-    i16 width;
-    i16 height;
+    asset_slot *slot;
+    u32 volatile loadState;
+    i32 width;
+    i32 height;
     f32 posX;
     f32 posY;
     f32 opacity;
+    bool isOpaque; // NOTE: Every texel has alpha 255
     u32 *pixels;
 
+    // NOTE: mips[0] is the base level (width, height, pixels). Each level is half of
+    // the previous one, down to 1x1, stored right after it. layout is the layout
+    // asked for when a loose bitmap is imported, the loaded levels say what they got.
+    texture_filter filter;
+    texture_layout layout;
+    i32 mipCount;
+    bitmap_mip mips[MAX_MIP_LEVELS];
+
     u32 GetColorU32(i32 x, i32 y)
     {
         ASSERT(x >= 0 && x < width && y >= 0 && y < height)
-        return pixels[x + y * width];
+        return mips[0].GetTexel(x, y);
     }
 
     color GetColorRGB(i32 x, i32 y)
     {
         ASSERT(x >= 0 && x < width && y >= 0 && y < height)
-        u32 c = *(pixels + y * width + x);
+        u32 c = mips[0].GetTexel(x, y);
         u8 r = (c >> 16) & 0xFF;
         u8 g = (c >> 8) & 0xFF;
         u8 b = (c >> 0) & 0xFF;
@@ -109,6 +357,58 @@ struct loaded_bitmap
     }
 };
 
+// NOTE: Direct mapped by block position, so neighbouring blocks never evict each
+// other. It lives on the stack of whoever draws the triangle, so every thread
+// has its own.
+#define BC1_BLOCK_CACHE_SIZE 16
+struct bc1_block_cache
+{
+    u32 *tags[BC1_BLOCK_CACHE_SIZE];
+    u32 texels[BC1_BLOCK_CACHE_SIZE][16];
+};
+
+struct texture_sampler
+{
+    texture_filter filter;
+    bitmap_mip *mip;
+    bitmap_mip *nextMip; // NOTE: Trilinear only
+    u32 nextMipWeight;   // NOTE: 0 - 256
+    bc1_block_cache *blockCache; // NOTE: BC1 only
+};
+
+// NOTE: Fragments of one scanline waiting to be sampled together.
+struct textured_fragments
+{
+    i32 count;
+    i16 x[4];
+    f32 u[4];
+    f32 v[4];
+};
+
+// NOTE:
+// A bitmap drawn as a screen aligned quad. x, y is the center in pixels, scale 1
+// draws one texel per pixel, rotation is counter clockwise in radians. depth is
+// a view space z: it orders the batch and, with depth testing on, hides the
+// sprite behind whatever is closer in the zBuffer.
+struct sprite
+{
+    loaded_bitmap *bitmap;
+    f32 x;
+    f32 y;
+    f32 scale;
+    f32 rotation;
+    f32 opacity;
+    f32 depth;
+};
+
+struct sprite_batch
+{
+    sprite *sprites;
+    i32 count;
+    i32 capacity;
+    bool depthTest;
+};
+
 struct processed_triangle
 {
     vertex split;
@@ -155,10 +455,12 @@ enum shade_type
     PHONG
 };
 
+struct shadow_map;
 struct diffuse
 {
     vec3 intensity;
     vec3 direction;
+    shadow_map *shadow; // NOTE: Optional, see RenderShadowMap
 };
 
 struct point_light
@@ -167,11 +469,53 @@ struct point_light
     float linearAttenuation;
     float quadradicAttenuation;
     float constantAttenuation;
+    vec3 intensity;
+};
+
+// NOTE:
+// Irradiance as spherical harmonics, bands 0 to 2 (9 coefficients per channel),
+// already convolved with the cosine lobe: the light reaching a surface with unit
+// normal n is EvaluateSH(sh, n). Built at load time from an environment bitmap
+// or lights, distant lights can be folded in every frame (see FoldPointLights).
+#define SH_COEFFICIENT_COUNT 9
+
+struct sh9
+{
+    vec3 c[SH_COEFFICIENT_COUNT];
+};
+
+// NOTE:
+// The point lights of a frame, culled into screen tiles of LIGHT_TILE_SIZE
+// pixels by the screen bounds of their bounding spheres (see BuildLightGrid).
+// A light reaches as far as its attenuation stays above one 8 bit step. Tiles
+// keep at most LIGHT_MAX_PER_TILE lights, the rest are dropped for that tile.
+#define LIGHT_TILE_SHIFT 4
+#define LIGHT_TILE_SIZE (1 << LIGHT_TILE_SHIFT)
+#define LIGHT_MAX_PER_TILE 64
+#define MAX_POINT_LIGHTS 256
+
+struct light_grid
+{
+    u32 version; // NOTE: Changes whenever the lights do
+    i32 tilesX;
+    i32 tilesY;
+    u16 *tileLightCounts;
+    u16 *tileLights; // NOTE: LIGHT_MAX_PER_TILE per tile
+
+    i32 lightCount;
+    point_light lights[MAX_POINT_LIGHTS];
+
+    // NOTE: When set, smooth shading takes the ambient light from here instead of
+    // the flat ambient, and flat shading takes its average.
+    bool hasAmbientSH;
+    sh9 ambientSH;
 };
 
+// NOTE: Everything lighting needs. Positions are in view space like objects.
 struct lighting
 {
     diffuse d;
     ambient a;
-    point_light p;
+    material m;
+    light_grid *grid;
 };
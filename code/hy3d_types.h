@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <math.h>
+#include <intrin.h>
 
 // TODO: Make this an actual assetion
 #if 1
@@ -24,6 +25,43 @@ typedef uint64_t  u64;
 typedef float  f32;
 typedef double  f64;
 
+#define ARRAY_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+// NOTE: x64 keeps stores (and loads) in order, we only have to stop the compiler.
+#define CompletePreviousWritesBeforeFutureWrites \
+    _WriteBarrier();                             \
+    _mm_sfence()
+#define CompletePreviousReadsBeforeFutureReads _ReadBarrier()
+
+inline u32 AtomicCompareExchangeU32(u32 volatile *value, u32 newValue, u32 expected)
+{
+    return (u32)_InterlockedCompareExchange((long volatile *)value, (long)newValue, (long)expected);
+}
+
+inline u64 AtomicAddU64(u64 volatile *value, u64 addend)
+{
+    // NOTE: Returns the value before the add
+    return (u64)_InterlockedExchangeAdd64((__int64 volatile *)value, (__int64)addend);
+}
+
+struct ticket_mutex
+{
+    u64 volatile ticket;
+    u64 volatile serving;
+};
+
+inline void BeginTicketMutex(ticket_mutex *mutex)
+{
+    u64 ticket = AtomicAddU64(&mutex->ticket, 1);
+    while (ticket != mutex->serving)
+        _mm_pause();
+}
+
+inline void EndTicketMutex(ticket_mutex *mutex)
+{
+    AtomicAddU64(&mutex->serving, 1);
+}
+
 inline i16 RoundF32toI16(f32 in)
 {
     return (i16)(ceilf(in - 0.5f));
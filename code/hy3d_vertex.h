@@ -14,7 +14,7 @@ struct vertex
         return {
             lerp(pos, A.pos, B.pos, alpha),
             lerp(texCoord, A.texCoord, B.texCoord, alpha),
-            normal};
+            lerp(normal, A.normal, B.normal, alpha)};
     }
 };
 
@@ -146,7 +146,7 @@ inline vertex_smooth operator-(vertex_smooth a)
 
 inline vertex_smooth operator*(f32 a, vertex_smooth b)
 {
-    return {a * b.pos, a * b.texCoord, b.color, b.normal};
+    return {a * b.pos, a * b.texCoord, a * b.normal, a * b.color};
 }
 
 inline vertex_smooth operator*(vertex_smooth b, f32 a)
@@ -1,6 +1,7 @@
 #include "win32_platform.h"
 #include "resources.h"
 #include <assert.h>
+#include <stdio.h>
 
 // NOTE: These file I/O functions should only be used for DEBUG purposes.
 DEBUG_FREE_FILE(DEBUGFreeFileMemory)
@@ -64,6 +65,139 @@ DEBUG_WRITE_FILE(DEBUGWriteFile)
 	return result;
 }
 
+PLATFORM_GET_FILE_INFO(PlatformGetFileInfo)
+{
+	platform_file_info result = {};
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (GetFileAttributesExA(filename, GetFileExInfoStandard, &data))
+	{
+		result.exists = true;
+		result.size = ((u64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		result.writeTime = ((u64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	}
+	return result;
+}
+
+PLATFORM_MAP_FILE(PlatformMapFile)
+{
+	platform_mapped_file result = {};
+	HANDLE fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+	if (fileHandle != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(fileHandle, &fileSize) && fileSize.QuadPart > 0)
+		{
+			// NOTE: A read-only named section is backed by the page cache, so every process
+			// mapping the same file shares the physical pages.
+			HANDLE mapping = CreateFileMappingA(fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+			if (mapping)
+			{
+				result.memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if (result.memory)
+				{
+					result.size = (u64)fileSize.QuadPart;
+					result.handle = mapping;
+				}
+				else
+				{
+					CloseHandle(mapping);
+				}
+			}
+		}
+		// NOTE: The mapping keeps its own reference to the file.
+		CloseHandle(fileHandle);
+	}
+	return result;
+}
+
+PLATFORM_UNMAP_FILE(PlatformUnmapFile)
+{
+	if (file->memory)
+		UnmapViewOfFile(file->memory);
+	if (file->handle)
+		CloseHandle((HANDLE)file->handle);
+	*file = {};
+}
+
+PLATFORM_EVICT_MAPPED_RANGE(PlatformEvictMappedRange)
+{
+	// NOTE: Unlocking pages that aren't locked takes them out of the working set.
+	// The call reports an error for that, which is expected.
+	VirtualUnlock(memory, (SIZE_T)size);
+}
+
+// NOTE: Single producer (the main thread), multiple consumers.
+PLATFORM_ADD_WORK_ENTRY(PlatformAddWorkEntry)
+{
+	u32 newNextEntryToWrite = (queue->nextEntryToWrite + 1) % ARRAY_COUNT(queue->entries);
+	ASSERT(newNextEntryToWrite != queue->nextEntryToRead);
+	platform_work_queue_entry *entry = queue->entries + queue->nextEntryToWrite;
+	entry->callback = callback;
+	entry->data = data;
+	++queue->completionGoal;
+	CompletePreviousWritesBeforeFutureWrites;
+	queue->nextEntryToWrite = newNextEntryToWrite;
+	ReleaseSemaphore(queue->semaphore, 1, 0);
+}
+
+static bool Win32DoNextWorkQueueEntry(platform_work_queue *queue)
+{
+	bool shouldSleep = false;
+
+	u32 originalNextEntryToRead = queue->nextEntryToRead;
+	u32 newNextEntryToRead = (originalNextEntryToRead + 1) % ARRAY_COUNT(queue->entries);
+	if (originalNextEntryToRead != queue->nextEntryToWrite)
+	{
+		u32 index = AtomicCompareExchangeU32(&queue->nextEntryToRead, newNextEntryToRead, originalNextEntryToRead);
+		if (index == originalNextEntryToRead)
+		{
+			CompletePreviousReadsBeforeFutureReads;
+			platform_work_queue_entry entry = queue->entries[index];
+			entry.callback(queue, entry.data);
+			_InterlockedIncrement((LONG volatile *)&queue->completionCount);
+		}
+	}
+	else
+	{
+		shouldSleep = true;
+	}
+	return shouldSleep;
+}
+
+PLATFORM_COMPLETE_ALL_WORK(PlatformCompleteAllWork)
+{
+	while (queue->completionGoal != queue->completionCount)
+		Win32DoNextWorkQueueEntry(queue);
+
+	queue->completionGoal = 0;
+	queue->completionCount = 0;
+}
+
+static DWORD WINAPI Win32WorkQueueThreadProc(LPVOID parameter)
+{
+	platform_work_queue *queue = (platform_work_queue *)parameter;
+	for (;;)
+	{
+		if (Win32DoNextWorkQueueEntry(queue))
+			WaitForSingleObjectEx(queue->semaphore, INFINITE, FALSE);
+	}
+}
+
+static void Win32MakeQueue(platform_work_queue *queue, u32 threadCount)
+{
+	queue->completionGoal = 0;
+	queue->completionCount = 0;
+	queue->nextEntryToWrite = 0;
+	queue->nextEntryToRead = 0;
+	queue->semaphore = CreateSemaphoreExA(0, 0, threadCount, 0, 0, SEMAPHORE_ALL_ACCESS);
+	for (u32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
+	{
+		DWORD threadID;
+		HANDLE threadHandle = CreateThread(0, 0, Win32WorkQueueThreadProc, queue, 0, &threadID);
+		CloseHandle(threadHandle);
+	}
+}
+
 static inline void Win32InitializeBackbuffer(win32_pixel_buffer &pixel_buffer, i16 width, i16 height)
 {
 	if (pixel_buffer.memory)
@@ -88,17 +222,6 @@ static inline void Win32InitializeBackbuffer(win32_pixel_buffer &pixel_buffer, i
 	pixel_buffer.zBuffer = VirtualAlloc(0, pixel_buffer.size, MEM_COMMIT, PAGE_READWRITE);
 }
 
-static void Win32ClearBackbuffer(win32_pixel_buffer &pixel_buffer)
-{
-	if (pixel_buffer.memory)
-	{
-		VirtualFree(pixel_buffer.memory, 0, MEM_RELEASE);
-		VirtualFree(pixel_buffer.zBuffer, 0, MEM_RELEASE);
-	}
-	pixel_buffer.memory = VirtualAlloc(0, pixel_buffer.size, MEM_COMMIT, PAGE_READWRITE);
-	pixel_buffer.zBuffer = VirtualAlloc(0, pixel_buffer.size, MEM_COMMIT, PAGE_READWRITE);
-}
-
 static void Win32DisplayPixelBuffer(win32_pixel_buffer &pixel_buffer, HDC deviceContext)
 {
 	StretchDIBits(
@@ -240,7 +363,7 @@ static inline void Win32InitializeWindow(win32_window &window, i16 width, i16 he
 static inline void Win32InitializeMemory(engine_memory &memory)
 {
 	LPVOID baseAddress = (LPVOID)TERABYTES(2);
-	memory.permanentMemorySize = MEGABYTES(64);
+	memory.permanentMemorySize = MEGABYTES(128);
 	memory.transientMemorySize = GIGABYTES(2);
 	u64 totalSize = memory.permanentMemorySize + memory.transientMemorySize;
 	memory.permanentMemory = VirtualAlloc(baseAddress, totalSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
@@ -250,13 +373,33 @@ static inline void Win32InitializeMemory(engine_memory &memory)
 	memory.DEBUGFreeFileMemory = DEBUGFreeFileMemory;
 	memory.DEBUGReadFile = DEBUGReadFile;
 	memory.DEBUGWriteFile = DEBUGWriteFile;
+	memory.PlatformGetFileInfo = PlatformGetFileInfo;
+	memory.PlatformMapFile = PlatformMapFile;
+	memory.PlatformUnmapFile = PlatformUnmapFile;
+	memory.PlatformEvictMappedRange = PlatformEvictMappedRange;
+	memory.PlatformAddWorkEntry = PlatformAddWorkEntry;
+	memory.PlatformCompleteAllWork = PlatformCompleteAllWork;
 }
 
-static void Win32Update(win32_window &window)
+// NOTE: The engine clears and redraws only what changed (presentRect), so the
+// buffers are kept between frames and only that rect is copied to the window.
+// The DIB is bottom up: source rows count from the bottom, the window's from the top.
+static void Win32Update(win32_window &window, screen_rect rect)
 {
+	if (rect.minX >= rect.maxX || rect.minY >= rect.maxY)
+		return;
+	win32_pixel_buffer &pixel_buffer = window.pixelBuffer;
+	i32 width = rect.maxX - rect.minX;
+	i32 height = rect.maxY - rect.minY;
 	HDC deviceContext = GetDC(window.handle);
-	Win32DisplayPixelBuffer(window.pixelBuffer, deviceContext);
-	Win32ClearBackbuffer(window.pixelBuffer);
+	StretchDIBits(
+		deviceContext,
+		rect.minX, pixel_buffer.height - rect.maxY, width, height,
+		rect.minX, rect.minY, width, height,
+		pixel_buffer.memory,
+		&pixel_buffer.info,
+		DIB_RGB_COLORS,
+		SRCCOPY);
 	ReleaseDC(window.handle, deviceContext);
 }
 
@@ -330,6 +473,9 @@ static KEYBOARD_BUTTON Win32TranslateKeyInput(VK_CODE code)
 	case 0x4F:
 		return O;
 		break;
+	case 0x50:
+		return P;
+		break;
 	case VK_SHIFT:
 		return SHIFT;
 		break;
@@ -542,6 +688,18 @@ int CALLBACK WinMain(
 		engine_memory engineMemory;
 		Win32InitializeMemory(engineMemory);
 
+		// NOTE: The high priority queue gets every core but the main thread's,
+		// the low priority one streams assets in the background.
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		u32 coreCount = systemInfo.dwNumberOfProcessors;
+		platform_work_queue highPriorityQueue = {};
+		platform_work_queue lowPriorityQueue = {};
+		Win32MakeQueue(&highPriorityQueue, (coreCount > 1) ? coreCount - 1 : 1);
+		Win32MakeQueue(&lowPriorityQueue, 2);
+		engineMemory.highPriorityQueue = &highPriorityQueue;
+		engineMemory.lowPriorityQueue = &lowPriorityQueue;
+
 		if (engineMemory.permanentMemory && engineMemory.transientMemory)
 		{
 			win32_engine_code engineCode = {};
@@ -555,16 +713,62 @@ int CALLBACK WinMain(
 										 window.pixelBuffer.bytesPerPixel, window.pixelBuffer.size);
 
 			i32 quitMessage = -1;
+			u32 frameCount = 0;
+			pipeline_stats fullStats = {};
+			pipeline_stats partialStats = {};
+			screen_rect partialRect = {};
 			while (Win32ProcessMessages(window, engine.input, quitMessage))
 			{
 				FILETIME newWriteTime = Win32GetWriteTime(sourceDLLPath);
 				if (CompareFileTime(&newWriteTime, &engineCode.writeTime) == 1)
 				{
+					// NOTE: Queued work calls into the dll, so it has to finish before we unload it.
+					PlatformCompleteAllWork(&highPriorityQueue);
+					PlatformCompleteAllWork(&lowPriorityQueue);
 					Win32UnloadEngineCode(&engineCode);
 					Win32LoadEngineCode(&engineCode, sourceDLLPath, sourceDLLCopyPath);
 				}
 				engineCode.UpdateAndRender(engine, &engineMemory);
-				Win32Update(window);
+				Win32Update(window, engine.presentRect);
+
+				// NOTE: Nothing changed, so sleep until there is input or about a frame has passed.
+				screen_rect r = engine.presentRect;
+				bool isIdle = r.minX >= r.maxX || r.minY >= r.maxY;
+				if (isIdle)
+					MsgWaitForMultipleObjects(0, 0, FALSE, 16, QS_ALLINPUT);
+
+				// NOTE:
+				// Pipeline stats in the title, twice a second or so. Only a full redraw
+				// counts the whole scene, so its stats are kept until the next one. A
+				// partial redraw since then is shown separately, with its size.
+				if (!isIdle)
+				{
+					bool isFullRedraw = r.minX == 0 && r.minY == 0 &&
+										r.maxX == engine.pixelBuffer.width && r.maxY == engine.pixelBuffer.height;
+					if (isFullRedraw)
+					{
+						fullStats = engine.pixelBuffer.stats;
+						partialRect = {};
+					}
+					else
+					{
+						partialStats = engine.pixelBuffer.stats;
+						partialRect = r;
+					}
+				}
+				if (++frameCount % 30 == 0)
+				{
+					char title[256];
+					i32 length = sprintf_s(title, sizeof(title), "HY3D | full frame: depth %llu, tested %llu, shaded %llu fragments",
+										   fullStats.depthFragments, fullStats.testedFragments, fullStats.shadedFragments);
+					if (partialRect.minX < partialRect.maxX && length > 0)
+					{
+						sprintf_s(title + length, sizeof(title) - length, " | last partial %dx%d: tested %llu, shaded %llu",
+								  partialRect.maxX - partialRect.minX, partialRect.maxY - partialRect.minY,
+								  partialStats.testedFragments, partialStats.shadedFragments);
+					}
+					SetWindowTextA(window.handle, title);
+				}
 			}
 			return quitMessage;
 		}
@@ -37,4 +37,22 @@ struct win32_engine_code
 	update_and_render *UpdateAndRender;
 
 	bool isValid;
-};
\ No newline at end of file
+};
+
+struct platform_work_queue_entry
+{
+	platform_work_queue_callback *callback;
+	void *data;
+};
+
+struct platform_work_queue
+{
+	u32 volatile completionGoal;
+	u32 volatile completionCount;
+
+	u32 volatile nextEntryToWrite;
+	u32 volatile nextEntryToRead;
+	HANDLE semaphore;
+
+	platform_work_queue_entry entries[256];
+};
@@ -0,0 +1,5 @@
+@echo off
+pushd data
+..\\build\\hy3d_packer.exe -texture bunny_tex.bmp bc1 -texture city_bg_purple.bmp linear hy3d.hya
+..\\build\\hy3d_packer.exe -virtual hy3d_plane.bmp terrain.hyv
+popd
\ No newline at end of file